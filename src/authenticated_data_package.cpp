@@ -23,6 +23,7 @@
 #include "authenticated_data_package.h"
 #include "embeddedvalues.h"
 #include "utilities.h"
+#include <functional>
 
 #pragma warning(push, 0)
 #pragma warning(disable: 4244)
@@ -34,6 +35,68 @@
 #pragma warning(pop)
 
 
+// Maximum size of a decompressed package.
+static const int SANITY_CHECK_SIZE = 10 * 1024 * 1024;
+
+
+typedef CryptoPP::RSASS<CryptoPP::PKCS1v15, CryptoPP::SHA256>::Verifier PackageVerifier;
+
+namespace {
+
+// Everything about a signing public key that doesn't depend on the package:
+// the digest packages name it by, and the decoded verifier. Immutable once
+// built, so it can be shared by concurrent verifications (each of which
+// uses its own accumulator).
+class PackageKey
+{
+public:
+    PackageKey(const char* signaturePublicKey)
+    {
+        CryptoPP::SHA256 hash;
+        CryptoPP::StringSource(
+            signaturePublicKey,
+            true,
+            new CryptoPP::HashFilter(hash,
+                new CryptoPP::Base64Encoder(new CryptoPP::StringSink(m_digest), false)));
+
+#pragma warning(push, 0)
+#pragma warning(disable: 4239)
+        m_verifier.reset(new PackageVerifier(
+            CryptoPP::StringSource(
+                signaturePublicKey,
+                true,
+                new CryptoPP::Base64Decoder())));
+#pragma warning(pop)
+    }
+
+    const string& Digest() const { return m_digest; }
+    const PackageVerifier& Verifier() const { return *m_verifier; }
+
+private:
+    string m_digest;
+    unique_ptr<PackageVerifier> m_verifier;
+};
+
+// The embedded keys (remote server list, upgrade, ...) are few and fixed, so
+// they're built once each and kept for the life of the process.
+shared_ptr<const PackageKey> GetPackageKey(const char* signaturePublicKey)
+{
+    static map<string, shared_ptr<const PackageKey>> keys;
+    static HANDLE mutex = CreateMutex(NULL, FALSE, 0);
+
+    AutoMUTEX lock(mutex);
+
+    auto& key = keys[signaturePublicKey];
+    if (!key)
+    {
+        key = make_shared<const PackageKey>(signaturePublicKey);
+    }
+    return key;
+}
+
+} // namespace
+
+
 // signedDataPackage may be binary, so we also need the length.
 bool verifySignedDataPackage(
     const char* signaturePublicKey,
@@ -42,8 +105,6 @@ bool verifySignedDataPackage(
     bool gzipped,
     string& authenticDataPackage)
 {
-    const int SANITY_CHECK_SIZE = 10 * 1024 * 1024;
-
     authenticDataPackage.clear();
 
     string jsonString;
@@ -154,14 +215,8 @@ bool verifySignedDataPackage(
 
     // Match the presented public key digest against the embedded public key
 
-    string expectedPublicKeyDigest;
-    CryptoPP::SHA256 hash;
-    CryptoPP::StringSource(
-        signaturePublicKey,
-        true,
-        new CryptoPP::HashFilter(hash,
-            new CryptoPP::Base64Encoder(new CryptoPP::StringSink(expectedPublicKeyDigest), false)));
-    if (0 != expectedPublicKeyDigest.compare(signingPublicKeyDigest))
+    shared_ptr<const PackageKey> key = GetPackageKey(signaturePublicKey);
+    if (0 != key->Digest().compare(signingPublicKeyDigest))
     {
         my_print(NOT_SENSITIVE, false, _T("%s: public key mismatch.  This build must be too old."), __TFUNCTION__);
         return false;
@@ -169,17 +224,6 @@ bool verifySignedDataPackage(
 
     // Verify the signature of the data and output the data
 
-#pragma warning(push, 0)
-#pragma warning(disable: 4239)
-    CryptoPP::RSASS<CryptoPP::PKCS1v15, CryptoPP::SHA256>::Verifier verifier(
-        CryptoPP::StringSource(
-            signaturePublicKey,
-            true,
-            new CryptoPP::Base64Decoder()));
-#pragma warning(pop)
-
-    bool result = false;
-
     string signature;
 
     CryptoPP::StringSource(
@@ -187,14 +231,19 @@ bool verifySignedDataPackage(
         true,
         new CryptoPP::Base64Decoder(new CryptoPP::StringSink(signature)));
 
-    CryptoPP::StringSource(
-        string(data) + signature,
-        true,
-        new CryptoPP::SignatureVerificationFilter(
-            verifier,
-            new CryptoPP::ArraySink((byte*)&result, sizeof(result)),
-            CryptoPP::SignatureVerificationFilter::PUT_RESULT |
-            CryptoPP::SignatureVerificationFilter::SIGNATURE_AT_END));
+    bool result = false;
+    try
+    {
+        unique_ptr<CryptoPP::PK_MessageAccumulator> accumulator(key->Verifier().NewVerificationAccumulator());
+        accumulator->Update((const byte*)data.data(), data.length());
+        key->Verifier().InputSignature(*accumulator, (const byte*)signature.data(), signature.length());
+        result = key->Verifier().VerifyAndRestart(*accumulator);
+    }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: signature exception: %S"), __TFUNCTION__, e.what());
+        return false;
+    }
 
     if (result)
     {
@@ -203,3 +252,439 @@ bool verifySignedDataPackage(
 
     return result;
 }
+
+
+/*
+ * SignedDataPackageStreamVerifier
+ */
+
+namespace {
+
+// The signature and key digest fields are small; anything bigger is bogus.
+const size_t MAX_SMALL_FIELD_LENGTH = 4096;
+
+// A Crypto++ sink that hands everything put into it to a callback. The
+// callback may throw to abort the pipeline.
+class CallbackSink : public CryptoPP::Bufferless<CryptoPP::Sink>
+{
+public:
+    typedef std::function<void(const byte*, size_t)> Callback;
+
+    CallbackSink(Callback callback) : m_callback(callback) {}
+
+    size_t Put2(const byte* inString, size_t length, int /*messageEnd*/, bool /*blocking*/)
+    {
+        if (length > 0)
+        {
+            m_callback(inString, length);
+        }
+        return 0;
+    }
+
+private:
+    Callback m_callback;
+};
+
+// Incremental scanner for the flat JSON object that makes up a signed data
+// package. String values are unescaped and passed to the callback in runs as
+// the input arrives; `final` is true on the last run of each value. Values
+// of other types are skipped.
+class PackageJsonScanner
+{
+public:
+    typedef std::function<void(const string& key, const char* value, size_t length, bool final)> ValueCallback;
+
+    PackageJsonScanner(ValueCallback callback)
+        : m_callback(callback), m_state(OBJECT_START), m_escape(false),
+          m_unicodeRemaining(0), m_codePoint(0), m_depth(0), m_inNestedString(false)
+    {
+    }
+
+    // Returns false on a syntax error.
+    bool Put(const char* data, size_t length)
+    {
+        for (size_t i = 0; i < length && m_state != SYNTAX_ERROR; i++)
+        {
+            Step(data[i]);
+        }
+
+        if (m_state == STRING_VALUE && !m_run.empty())
+        {
+            FlushRun(false);
+        }
+
+        return m_state != SYNTAX_ERROR;
+    }
+
+    // True once the closing brace of the object has been seen.
+    bool Complete() const
+    {
+        return m_state == DONE;
+    }
+
+private:
+    enum State
+    {
+        OBJECT_START,
+        KEY_START,
+        KEY,
+        COLON,
+        VALUE_START,
+        STRING_VALUE,
+        OTHER_VALUE,
+        COMMA_OR_END,
+        DONE,
+        SYNTAX_ERROR
+    };
+
+    static bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    static int HexValue(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    void FlushRun(bool final)
+    {
+        m_callback(m_key, m_run.data(), m_run.size(), final);
+        m_run.clear();
+    }
+
+    // Appends a \uXXXX code point as UTF-8. Surrogate pairs are not combined;
+    // the fields we care about are plain ASCII.
+    void AppendCodePoint(unsigned int cp)
+    {
+        if (cp < 0x80)
+        {
+            m_run += (char)cp;
+        }
+        else if (cp < 0x800)
+        {
+            m_run += (char)(0xC0 | (cp >> 6));
+            m_run += (char)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            m_run += (char)(0xE0 | (cp >> 12));
+            m_run += (char)(0x80 | ((cp >> 6) & 0x3F));
+            m_run += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    void Step(char c)
+    {
+        switch (m_state)
+        {
+        case OBJECT_START:
+            if (c == '{') m_state = KEY_START;
+            else if (!IsSpace(c)) m_state = SYNTAX_ERROR;
+            break;
+
+        case KEY_START:
+            if (c == '"') { m_key.clear(); m_state = KEY; }
+            else if (c == '}') m_state = DONE;
+            else if (!IsSpace(c)) m_state = SYNTAX_ERROR;
+            break;
+
+        case KEY:
+            // The keys we care about contain no escapes, so escapes are
+            // only tracked well enough to find the end of the key.
+            if (m_escape) { m_escape = false; m_key += c; }
+            else if (c == '\\') m_escape = true;
+            else if (c == '"') m_state = COLON;
+            else if (m_key.length() < MAX_SMALL_FIELD_LENGTH) m_key += c;
+            else m_state = SYNTAX_ERROR;
+            break;
+
+        case COLON:
+            if (c == ':') m_state = VALUE_START;
+            else if (!IsSpace(c)) m_state = SYNTAX_ERROR;
+            break;
+
+        case VALUE_START:
+            if (c == '"') { m_state = STRING_VALUE; m_escape = false; m_unicodeRemaining = 0; }
+            else if (c == '{' || c == '[') { m_state = OTHER_VALUE; m_depth = 1; m_inNestedString = false; }
+            else if (!IsSpace(c)) { m_state = OTHER_VALUE; m_depth = 0; m_inNestedString = false; }
+            break;
+
+        case STRING_VALUE:
+            if (m_unicodeRemaining > 0)
+            {
+                int v = HexValue(c);
+                if (v < 0) { m_state = SYNTAX_ERROR; break; }
+                m_codePoint = (m_codePoint << 4) | v;
+                if (--m_unicodeRemaining == 0) AppendCodePoint(m_codePoint);
+            }
+            else if (m_escape)
+            {
+                m_escape = false;
+                switch (c)
+                {
+                case 'b': m_run += '\b'; break;
+                case 'f': m_run += '\f'; break;
+                case 'n': m_run += '\n'; break;
+                case 'r': m_run += '\r'; break;
+                case 't': m_run += '\t'; break;
+                case 'u': m_unicodeRemaining = 4; m_codePoint = 0; break;
+                default: m_run += c; break;
+                }
+            }
+            else if (c == '\\') m_escape = true;
+            else if (c == '"') { FlushRun(true); m_state = COMMA_OR_END; }
+            else m_run += c;
+            break;
+
+        case OTHER_VALUE:
+            if (m_inNestedString)
+            {
+                if (m_escape) m_escape = false;
+                else if (c == '\\') m_escape = true;
+                else if (c == '"') m_inNestedString = false;
+            }
+            else if (c == '"') m_inNestedString = true;
+            else if (c == '{' || c == '[') m_depth++;
+            else if (c == '}' || c == ']')
+            {
+                if (m_depth > 0) m_depth--;
+                else if (c == '}') m_state = DONE;
+                else m_state = SYNTAX_ERROR;
+            }
+            else if (c == ',' && m_depth == 0) m_state = KEY_START;
+            break;
+
+        case COMMA_OR_END:
+            if (c == ',') m_state = KEY_START;
+            else if (c == '}') m_state = DONE;
+            else if (!IsSpace(c)) m_state = SYNTAX_ERROR;
+            break;
+
+        case DONE:
+            if (!IsSpace(c)) m_state = SYNTAX_ERROR;
+            break;
+
+        case SYNTAX_ERROR:
+            break;
+        }
+    }
+
+private:
+    ValueCallback m_callback;
+    State m_state;
+    string m_key;
+    string m_run;
+    bool m_escape;
+    int m_unicodeRemaining;
+    unsigned int m_codePoint;
+    int m_depth;
+    bool m_inNestedString;
+};
+
+} // namespace
+
+
+struct SignedDataPackageStreamVerifier::State
+{
+    State(const char* signaturePublicKey, HANDLE outputFile);
+
+    void OnDecompressed(const byte* data, size_t length);
+    void OnValue(const string& key, const char* value, size_t length, bool final);
+    void OnDecoded(const byte* data, size_t length);
+
+    shared_ptr<const PackageKey> key;
+    unique_ptr<CryptoPP::PK_MessageAccumulator> accumulator;
+    unique_ptr<CryptoPP::Gunzip> unzipper;
+    unique_ptr<CryptoPP::Base64Decoder> decoder;
+    PackageJsonScanner scanner;
+
+    HANDLE outputFile;
+    string base64Signature;
+    string signingPublicKeyDigest;
+    bool dataSeen;
+    bool dataComplete;
+    unsigned long long decompressedLength;
+    unsigned long long outputLength;
+    bool failed;
+};
+
+SignedDataPackageStreamVerifier::State::State(const char* signaturePublicKey, HANDLE outputFile_)
+    : scanner([this](const string& key, const char* value, size_t length, bool final) { OnValue(key, value, length, final); }),
+      outputFile(outputFile_),
+      dataSeen(false),
+      dataComplete(false),
+      decompressedLength(0),
+      outputLength(0),
+      failed(false)
+{
+    key = GetPackageKey(signaturePublicKey);
+    accumulator.reset(key->Verifier().NewVerificationAccumulator());
+
+    // The pipelines take ownership of the sinks.
+    unzipper.reset(new CryptoPP::Gunzip(
+        new CallbackSink([this](const byte* data, size_t length) { OnDecompressed(data, length); })));
+    decoder.reset(new CryptoPP::Base64Decoder(
+        new CallbackSink([this](const byte* data, size_t length) { OnDecoded(data, length); })));
+}
+
+void SignedDataPackageStreamVerifier::State::OnDecompressed(const byte* data, size_t length)
+{
+    decompressedLength += length;
+    if (decompressedLength > (unsigned long long)SANITY_CHECK_SIZE)
+    {
+        throw std::exception("Gunzip overflow");
+    }
+
+    if (!scanner.Put((const char*)data, length))
+    {
+        throw std::exception("JSON parse failed");
+    }
+}
+
+void SignedDataPackageStreamVerifier::State::OnValue(const string& key, const char* value, size_t length, bool final)
+{
+    if (key == "data")
+    {
+        if (dataComplete)
+        {
+            throw std::exception("duplicate data field");
+        }
+        dataSeen = true;
+
+        // The signature is over the encoded data, so hash it as-is; only the
+        // decoded form goes to disk.
+        accumulator->Update((const byte*)value, length);
+        (void)decoder->Put((const byte*)value, length);
+
+        if (final)
+        {
+            (void)decoder->MessageEnd();
+            dataComplete = true;
+        }
+    }
+    else if (key == "signature" || key == "signingPublicKeyDigest")
+    {
+        string& field = (key == "signature") ? base64Signature : signingPublicKeyDigest;
+        field.append(value, length);
+        if (field.length() > MAX_SMALL_FIELD_LENGTH)
+        {
+            throw std::exception("oversized field");
+        }
+    }
+}
+
+void SignedDataPackageStreamVerifier::State::OnDecoded(const byte* data, size_t length)
+{
+    DWORD written = 0;
+    if (!WriteFile(outputFile, data, length, &written, NULL) || written != length)
+    {
+        throw std::exception("WriteFile failed");
+    }
+    outputLength += length;
+}
+
+
+SignedDataPackageStreamVerifier::SignedDataPackageStreamVerifier(const char* signaturePublicKey, HANDLE outputFile)
+    : m_signaturePublicKey(signaturePublicKey),
+      m_outputFile(outputFile)
+{
+    Reset();
+}
+
+SignedDataPackageStreamVerifier::~SignedDataPackageStreamVerifier()
+{
+}
+
+void SignedDataPackageStreamVerifier::Reset()
+{
+    m_state.reset(new State(m_signaturePublicKey, m_outputFile));
+}
+
+bool SignedDataPackageStreamVerifier::Put(const char* data, size_t length)
+{
+    if (m_state->failed)
+    {
+        return false;
+    }
+
+    try
+    {
+        (void)m_state->unzipper->Put((const byte*)data, length);
+    }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: %S (%d)"), __TFUNCTION__, e.what(), GetLastError());
+        m_state->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+bool SignedDataPackageStreamVerifier::Finish()
+{
+    if (m_state->failed)
+    {
+        return false;
+    }
+
+    // Once we've finished, the state can't be fed any more.
+    m_state->failed = true;
+
+    try
+    {
+        // Throws if the compressed stream is truncated or its CRC is wrong.
+        (void)m_state->unzipper->MessageEnd();
+    }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: Gunzip exception: %S"), __TFUNCTION__, e.what());
+        return false;
+    }
+
+    if (!m_state->scanner.Complete() || !m_state->dataComplete || m_state->outputLength == 0)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: incomplete package"), __TFUNCTION__);
+        return false;
+    }
+
+    // Match the presented public key digest against the embedded public key
+
+    if (0 != m_state->key->Digest().compare(m_state->signingPublicKeyDigest))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: public key mismatch.  This build must be too old."), __TFUNCTION__);
+        return false;
+    }
+
+    // The data has already been fed to the accumulator, so all that's left
+    // is the signature.
+
+    string signature;
+    CryptoPP::StringSource(
+        m_state->base64Signature,
+        true,
+        new CryptoPP::Base64Decoder(new CryptoPP::StringSink(signature)));
+
+    bool result = false;
+    try
+    {
+        m_state->key->Verifier().InputSignature(*m_state->accumulator, (const byte*)signature.data(), signature.length());
+        result = m_state->key->Verifier().VerifyAndRestart(*m_state->accumulator);
+    }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: signature exception: %S"), __TFUNCTION__, e.what());
+        return false;
+    }
+
+    return result;
+}
+
+unsigned long long SignedDataPackageStreamVerifier::OutputLength() const
+{
+    return m_state->outputLength;
+}
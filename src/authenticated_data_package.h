@@ -20,6 +20,7 @@
 #pragma once
 
 #include <string>
+#include <memory>
 
 bool verifySignedDataPackage(
     const char* signaturePublicKey,
@@ -27,3 +28,40 @@ bool verifySignedDataPackage(
     const size_t signedDataPackageLen,
     bool gzipped,
     string& authenticDataPackage);
+
+
+// Verifies a gzip-compressed signed data package -- the same format accepted
+// by verifySignedDataPackage -- as it arrives, a chunk at a time. The "data"
+// field is expected to be base64, and its decoded bytes are written to
+// outputFile as they are extracted, so memory use is bounded by a few fixed
+// buffers rather than the package size.
+// The output is not trustworthy unless Finish() returns true.
+class SignedDataPackageStreamVerifier
+{
+public:
+    // outputFile is not owned; it must stay open for the lifetime of this object.
+    SignedDataPackageStreamVerifier(const char* signaturePublicKey, HANDLE outputFile);
+    virtual ~SignedDataPackageStreamVerifier();
+
+    // Discards all state so that the package can be fed again from its start.
+    // Does not modify the output file; the caller must rewind/truncate it.
+    void Reset();
+
+    // Feeds the next chunk of the compressed package. Returns false if the
+    // package is malformed or oversized, or the output can't be written.
+    // After a false return all further calls fail until Reset().
+    bool Put(const char* data, size_t length);
+
+    // Must be called after the final Put. Returns true if the package was
+    // complete, the key digest matched, and the signature verified.
+    bool Finish();
+
+    // Number of decoded bytes written to the output file so far.
+    unsigned long long OutputLength() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> m_state;
+    const char* m_signaturePublicKey;
+    HANDLE m_outputFile;
+};
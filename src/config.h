@@ -33,6 +33,7 @@ static const char* LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS = "Servers";
 static const char* LOCAL_SETTINGS_REGISTRY_VALUE_LAST_CONNECTED = "LastConnected";
 static const char* LOCAL_SETTINGS_REGISTRY_VALUE_NATIVE_PROXY_INFO = "NativeProxyInfo";
 static const char* LOCAL_SETTINGS_REGISTRY_VALUE_PSIPHON_PROXY_INFO = "PsiphonProxyInfo";
+static const char* LOCAL_SETTINGS_REGISTRY_VALUE_UPGRADE_DOWNLOAD_VALIDATOR = "UpgradeDownloadValidator";
 static const char* CLIENT_PLATFORM = "Windows";
 static const TCHAR* HTTP_HANDSHAKE_REQUEST_PATH = _T("/handshake");
 static const TCHAR* HTTP_CONNECTED_REQUEST_PATH = _T("/connected");
@@ -46,6 +47,13 @@ static const int SECONDS_BETWEEN_UNSUCCESSFUL_REMOTE_SERVER_LIST_FETCH = 60*5;
 static const int HTTPS_REQUEST_CONNECT_TIMEOUT_MS = 30000;
 static const int HTTPS_REQUEST_SEND_TIMEOUT_MS = 30000;
 static const int HTTPS_REQUEST_RECEIVE_TIMEOUT_MS = 30000;
+// Tunnel-core drops idle connections after 30 seconds; HTTPSSession gives up on
+// its connections well before that.
+static const DWORD HTTPS_SESSION_IDLE_TIMEOUT_MS = 20000;
 static const int TERMINATE_PROCESS_WAIT_MS = 5000;
 static const char* UNTUNNELED_WEB_REQUEST_CAPABILITY = "handshake";
 static const int TEMPORARY_TUNNEL_TIMEOUT_SECONDS = 20;
+// Server entries submitted within this long of each other are merged together.
+static const int SERVER_ENTRY_INGESTION_BATCH_WINDOW_MS = 250;
+// How long the connection thread waits for fetched server entries to be merged.
+static const DWORD SERVER_ENTRY_INGESTION_FLUSH_TIMEOUT_MS = 10000;
@@ -35,13 +35,17 @@
 #include "transport.h"
 #include "transport_registry.h"
 #include "transport_connection.h"
+#include "server_entry_ingestion.h"
 #include "authenticated_data_package.h"
+#include "upgrade_download.h"
 #include "stopsignal.h"
 #include "diagnostic_info.h"
 #include "psicashlib.h"
 #include "psiphon_tunnel_core_utilities.h"
 #include "feedback_upload_worker.h"
 #include "worker_thread.h"
+#include "span_tracer.h"
+#include "metrics.h"
 
 
 // Upgrade process posts a Quit message
@@ -53,6 +57,7 @@ ConnectionManager::ConnectionManager(void) :
     m_thread(0),
     m_upgradeThread(0),
     m_feedbackThread(0),
+    m_feedbackThreadRunning(false),
     m_transport(0),
     m_upgradePending(false),
     m_startSplitTunnel(false),
@@ -60,8 +65,11 @@ ConnectionManager::ConnectionManager(void) :
     m_suppressHomePages(false)
 {
     m_mutex = CreateMutex(NULL, FALSE, 0);
+    m_upgradeMutex = CreateMutex(NULL, FALSE, 0);
 
     Settings::Initialize();
+
+    SpanTracer::Instance().SetEnabled(Settings::ConnectionTrace() != CONNECTION_TRACE_DISABLED);
 }
 
 ConnectionManager::~ConnectionManager(void)
@@ -76,6 +84,7 @@ ConnectionManager::~ConnectionManager(void)
         m_feedbackThread = 0;
     }
 
+    CloseHandle(m_upgradeMutex);
     CloseHandle(m_mutex);
 }
 
@@ -261,12 +270,77 @@ void ConnectionManager::Reconnect(bool suppressHomePages)
     Start(true);
 }
 
+void ConnectionManager::ApplySettingsChanges(DWORD changes)
+{
+    if (changes == SETTINGS_CHANGE_NONE)
+    {
+        return;
+    }
+
+    {
+        AutoMUTEX lock(m_mutex);
+
+        // A pending upgrade is applied by restarting the application, which
+        // happens on reconnect; and while still connecting, it's simplest
+        // to start over.
+        if (!(changes & SETTINGS_CHANGE_TRANSPORT)
+            && !m_upgradePending
+            && m_state == CONNECTION_MANAGER_STATE_CONNECTED
+            && m_transport
+            && m_transport->Reconfigure())
+        {
+            my_print(NOT_SENSITIVE, false, _T("Settings change detected. Applying."));
+            return;
+        }
+    }
+
+    my_print(NOT_SENSITIVE, false, _T("Settings change detected. Reconnecting."));
+    Reconnect(false);
+}
+
+// Writes the connection span trace to the temp directory in Chrome trace
+// format, if enabled by the ConnectionTrace setting.
+static void WriteConnectionTrace()
+{
+    if (Settings::ConnectionTrace() != CONNECTION_TRACE_CHROME_TRACE)
+    {
+        return;
+    }
+
+    filesystem::path tempPath;
+    if (!GetSysTempPath(tempPath))
+    {
+        return;
+    }
+
+    tstring tracePath = tempPath / "psiphon-connection-trace.json";
+    if (!SpanTracer::Instance().WriteChromeTrace(tracePath))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: WriteChromeTrace failed (%d)"), __TFUNCTION__, GetLastError());
+    }
+}
+
 DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
 {
     my_print(NOT_SENSITIVE, true, _T("%s: enter"), __TFUNCTION__);
 
     ConnectionManager* manager = (ConnectionManager*)object;
 
+    // A connection may be requested before the background startup work is
+    // done; the system proxy settings and startup diagnostics must be taken
+    // care of before we change anything, and PsiCash must be initialized.
+    // ConnectionManager::Stop waits for this thread, so the wait must end on
+    // a stop signal.
+    if (!g_startup.WaitFor(
+            { STARTUP_TASK_SYSTEM_PROXY, STARTUP_TASK_DIAGNOSTICS, STARTUP_TASK_PSICASH_INIT },
+            StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_ANY_STOP_TUNNEL),
+            INFINITE))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: stopped while waiting for startup tasks"), __TFUNCTION__);
+        manager->SetState(CONNECTION_MANAGER_STATE_STOPPED);
+        return 0;
+    }
+
     // Seed built-in non-crypto PRNG used for shuffling (load balancing)
     unsigned int seed = (unsigned)time(NULL);
     srand(seed);
@@ -312,6 +386,12 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
         {
             GlobalStopSignal::Instance().CheckSignal(STOP_REASON_ANY_STOP_TUNNEL, true);
 
+            ScopedSpan connectSpan("ConnectionManager::Connect");
+            DWORD connectStartTime = GetTickCount();
+
+            static MetricCounter& connectAttempts = MetricsRegistry::Instance().Counter("connection.attempts");
+            connectAttempts.Add();
+
             manager->SetState(CONNECTION_MANAGER_STATE_STARTING);
 
             // Do we have any usable servers?
@@ -348,6 +428,9 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
 
             tunnelStartTime = GetTickCount();
 
+            static MetricHistogram& connectTime = MetricsRegistry::Instance().Histogram("connection.connect_time_ms");
+            connectTime.Record(tunnelStartTime - connectStartTime);
+
             //
             // The transport connection did a handshake, so its sessionInfo is
             // fuller than ours. Update ours and then update the server entries.
@@ -385,6 +468,9 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
             manager->DoPostConnect(sessionInfo, !homePageOpened);
             homePageOpened = true;
 
+            connectSpan.End();
+            WriteConnectionTrace();
+
             //
             // Wait for transportConnection to stop (or fail)
             //
@@ -401,6 +487,13 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
         catch (TransportConnection::TryNextServer&)
         {
             my_print(NOT_SENSITIVE, true, _T("%s: caught TryNextServer"), __TFUNCTION__);
+
+            // A non-zero tunnelStartTime means the tunnel was up and then
+            // unexpectedly disconnected; otherwise this connect attempt failed.
+            static MetricCounter& reconnects = MetricsRegistry::Instance().Counter("connection.reconnects");
+            static MetricCounter& connectFailures = MetricsRegistry::Instance().Counter("connection.failures");
+            (tunnelStartTime ? reconnects : connectFailures).Add();
+
             // Fall through
         }
         catch (TransportConnection::PermanentFailure&)
@@ -495,6 +588,8 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
 
 void ConnectionManager::DoPostConnect(const SessionInfo& sessionInfo, bool openHomePages)
 {
+    ScopedSpan span("ConnectionManager::DoPostConnect");
+
     // Called from connection thread
     // NOTE: no lock while waiting for network events
 
@@ -854,17 +949,17 @@ void ConnectionManager::FetchRemoteServerList()
         }
     }
 
-    try
-    {
-        // This adds the new server entries to all transports' server lists.
-        TransportRegistry::AddServerEntries(newServerEntryVector, 0);
+    // This queues the new server entries for all transports' server lists.
+    // Corrupt entries are dropped individually during ingestion.
+    TransportRegistry::AddServerEntries(newServerEntryVector, 0);
 
-        my_print(NOT_SENSITIVE, true, _T("%s: %d server entries"), __TFUNCTION__, newServerEntryVector.size());
-    }
-    catch (std::exception &ex)
+    my_print(NOT_SENSITIVE, true, _T("%s: %d server entries"), __TFUNCTION__, newServerEntryVector.size());
+
+    // The connection thread is about to retry, and after a NoServers it gives
+    // up if there are still none, so wait for these to reach the server lists.
+    if (!ServerEntryIngestion::Instance().Flush(SERVER_ENTRY_INGESTION_FLUSH_TIMEOUT_MS))
     {
-        my_print(NOT_SENSITIVE, false, string("Corrupt remote server list: ") + ex.what());
-        // This isn't fatal.
+        my_print(NOT_SENSITIVE, true, _T("%s: timed out waiting for server entries to be merged"), __TFUNCTION__);
     }
 }
 
@@ -885,67 +980,23 @@ DWORD WINAPI ConnectionManager::ConnectionManagerUpgradeThread(void* object)
 
     try
     {
-        SessionInfo sessionInfo;
-        tstring downloadRequestPath;
-        // Note that this is getting the current session info, which is set
-        // by LoadNextServer.  So it's unlikely but possible that we may be
-        // loading the next server after the first one that notified us of an
-        // upgrade failed to connect.  This still should not be a problem, since
-        // all servers should have the same upgrades available.
-        manager->GetUpgradeRequestInfo(sessionInfo, downloadRequestPath);
-
-        // Download new binary
-        HTTPSRequest httpsRequest;
-        HTTPSRequest::Response httpsResponse;
-        if (!httpsRequest.MakeRequest(
-                UTF8ToWString(UPGRADE_ADDRESS).c_str(),
-                443,
-                "",
-                UTF8ToWString(UPGRADE_REQUEST_PATH).c_str(),
+        // Download, verify and stage the new binary. An interrupted download
+        // is resumed by the next upgrade thread.
+        // If the download fails, we simply do nothing.
+        // Rationale:
+        // - The server is (and hopefully will remain) backwards compatible.
+        // - The failure is likely a configuration one, as the handshake worked.
+        // - A configuration failure could be common across all servers, so the
+        //   client will never connect.
+        // - Fail-over exposes new server IPs to hostile networks, so we don't
+        //   like doing it in the case where we know the handshake already succeeded.
+        tstring stagedUpgradeFilename;
+        if (DownloadUpgrade(
                 StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_ANY_STOP_TUNNEL),
-                HTTPSRequest::PsiphonProxy::USE,
-                httpsResponse,
-                true) // fail over to URL proxy
-            || httpsResponse.code != HTTPSRequest::OK
-            || httpsResponse.body.length() <= 0)
-        {
-            // If the download failed, we simply do nothing.
-            // Rationale:
-            // - The server is (and hopefully will remain) backwards compatible.
-            // - The failure is likely a configuration one, as the handshake worked.
-            // - A configuration failure could be common across all servers, so the
-            //   client will never connect.
-            // - Fail-over exposes new server IPs to hostile networks, so we don't
-            //   like doing it in the case where we know the handshake already succeeded.
-        }
-        else
+                stagedUpgradeFilename))
         {
-            my_print(NOT_SENSITIVE, false, _T("Download complete"));
-
             // Perform upgrade.
-
-            string upgradeData;
-
-            if (verifySignedDataPackage(
-                    UPGRADE_SIGNATURE_PUBLIC_KEY,
-                    httpsResponse.body.c_str(),
-                    httpsResponse.body.length(),
-                    true, // gzip compressed
-                    upgradeData))
-            {
-                // Data in the package is Base64 encoded
-                upgradeData = Base64Decode(upgradeData);
-
-                if (upgradeData.length() > 0)
-                {
-                    manager->PaveUpgrade(upgradeData);
-                }
-            }
-            else
-            {
-                // Bad package. Log and continue.
-                my_print(NOT_SENSITIVE, false, _T("Upgrade package verification failed! Please report this error."));
-            }
+            manager->PaveUpgrade(stagedUpgradeFilename);
         }
     }
     catch (StopSignal::StopException&)
@@ -957,9 +1008,11 @@ DWORD WINAPI ConnectionManager::ConnectionManagerUpgradeThread(void* object)
     return 0;
 }
 
-void ConnectionManager::PaveUpgrade(const string& download)
+void ConnectionManager::PaveUpgrade(const tstring& stagedUpgradeFilename)
 {
-    AutoMUTEX lock(m_mutex);
+    // NOTE: m_mutex is not held while touching the disk, so that the UI and
+    // connection threads aren't blocked behind file I/O.
+    AutoMUTEX upgradeLock(m_upgradeMutex);
 
     // Find current process binary path
 
@@ -967,6 +1020,7 @@ void ConnectionManager::PaveUpgrade(const string& download)
     if (!GetOwnExecutablePath(exe_path))
     {
         // Abort upgrade
+        (void)DeleteFile(stagedUpgradeFilename.c_str());
         return;
     }
 
@@ -980,7 +1034,8 @@ void ConnectionManager::PaveUpgrade(const string& download)
     {
         // We can't delete/modify the binary for a running Windows process,
         // so instead we move the running binary to an archive filename and
-        // write the new version to the original filename.
+        // move the new version, which has already been written beside it,
+        // to the original filename.
 
         if (!DeleteFile(archive_filename.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND)
         {
@@ -994,25 +1049,14 @@ void ConnectionManager::PaveUpgrade(const string& download)
 
         bArchiveCreated = true;
 
-        // Write new version to current binary file name
-
-        AutoHANDLE file = CreateFile(exe_path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        // Rename new version to current binary file name
 
-        if (file == INVALID_HANDLE_VALUE)
+        if (!MoveFileEx(
+                stagedUpgradeFilename.c_str(),
+                exe_path.c_str(),
+                MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
         {
-            throw std::exception("Upgrade - CreateFile failed");
-        }
-
-        DWORD written;
-
-        if (!WriteFile(file, download.c_str(), download.length(), &written, NULL) || written != download.length())
-        {
-            throw std::exception("Upgrade - WriteFile failed");
-        }
-
-        if (!FlushFileBuffers(file))
-        {
-            throw std::exception("Upgrade - FlushFileBuffers failed");
+            throw std::exception("Upgrade - MoveFileEx failed");
         }
     }
     catch (std::exception& ex)
@@ -1028,9 +1072,11 @@ void ConnectionManager::PaveUpgrade(const string& download)
         }
 
         // Abort upgrade
+        (void)DeleteFile(stagedUpgradeFilename.c_str());
         return;
     }
 
+    AutoMUTEX lock(m_mutex);
     m_upgradePending = true;
 }
 
@@ -1112,54 +1158,86 @@ void ConnectionManager::UpdateCurrentSessionInfo(const SessionInfo& sessionInfo)
     }
 }
 
-struct FeedbackThreadData
-{
-    ConnectionManager* connectionManager;
-    string feedbackJSON;
-} g_feedbackThreadData;
-
 void ConnectionManager::SendFeedback(const string& utf8FeedbackJSON)
 {
-    g_feedbackThreadData.connectionManager = this;
-    g_feedbackThreadData.feedbackJSON = utf8FeedbackJSON;
+    AutoMUTEX lock(m_mutex);
+
+    m_pendingFeedback.push_back(utf8FeedbackJSON);
+    MetricsRegistry::Instance().Gauge("feedback.pending").Set((long long)m_pendingFeedback.size());
 
-    if (!m_feedbackThread ||
-        WAIT_OBJECT_0 == WaitForSingleObject(m_feedbackThread, 0))
+    // A running feedback thread will pick up the new submission before it
+    // exits; it clears m_feedbackThreadRunning under m_mutex only once the
+    // queue is empty.
+    if (m_feedbackThreadRunning)
     {
-        m_feedbackThread = CreateThread(
-            0,
-            0,
-            ConnectionManager::ConnectionManagerFeedbackThread,
-            (void*)&g_feedbackThreadData, 0, 0);
-        if (!m_feedbackThread)
-        {
-            my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
-            PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
-            return;
-        }
+        return;
+    }
+
+    if (m_feedbackThread)
+    {
+        CloseHandle(m_feedbackThread);
     }
+
+    m_feedbackThread = CreateThread(
+        0,
+        0,
+        ConnectionManager::ConnectionManagerFeedbackThread,
+        (void*)this, 0, 0);
+    if (!m_feedbackThread)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
+        m_pendingFeedback.clear();
+        PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
+        return;
+    }
+
+    m_feedbackThreadRunning = true;
 }
 
 DWORD WINAPI ConnectionManager::ConnectionManagerFeedbackThread(void* object)
 {
     my_print(NOT_SENSITIVE, true, _T("%s: enter"), __TFUNCTION__);
 
-    FeedbackThreadData* data = (FeedbackThreadData*)object;
+    ConnectionManager* manager = (ConnectionManager*)object;
 
     try
     {
-        if (data->connectionManager->DoSendFeedback(data->feedbackJSON))
+        while (true)
         {
-            PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_SUCCESS, 0, 0);
-        }
-        else
-        {
-            PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
+            // Take every submission that's pending as one batch. Identical
+            // submissions (e.g., a repeated click on the send button) are
+            // uploaded once and share the result.
+            vector<string> batch;
+            {
+                AutoMUTEX lock(manager->m_mutex);
+                if (manager->m_pendingFeedback.empty())
+                {
+                    manager->m_feedbackThreadRunning = false;
+                    break;
+                }
+                batch.swap(manager->m_pendingFeedback);
+                MetricsRegistry::Instance().Gauge("feedback.pending").Set(0);
+            }
+
+            map<string, bool> results;
+            for (auto it = batch.begin(); it != batch.end(); ++it)
+            {
+                auto result = results.find(*it);
+                if (result == results.end())
+                {
+                    result = results.insert(std::make_pair(*it, manager->DoSendFeedback(*it))).first;
+                }
+
+                PostMessage(g_hWnd, result->second ? WM_PSIPHON_FEEDBACK_SUCCESS : WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
+            }
         }
     }
     catch (StopSignal::StopException&)
     {
-        // just fall through
+        // Pending submissions are dropped along with the one that was stopped
+        AutoMUTEX lock(manager->m_mutex);
+        manager->m_pendingFeedback.clear();
+        manager->m_feedbackThreadRunning = false;
     }
 
     my_print(NOT_SENSITIVE, true, _T("%s: exit"), __TFUNCTION__);
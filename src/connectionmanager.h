@@ -50,6 +50,9 @@ public:
     void Stop(DWORD reason);
     void Start(bool isReconnect=false);
     void Reconnect(bool suppressHomePages);
+    // Applies a settings change (SETTINGS_CHANGE_* flags) to the current
+    // connection, in place if the transport supports it, or by reconnecting.
+    void ApplySettingsChanges(DWORD changes);
     void SetState(ConnectionManagerState newState);
     ConnectionManagerState GetState();
 
@@ -89,7 +92,7 @@ public:
             unsigned long long bytesTransferred);
 
     // IUpgradePaver implementation
-    void PaveUpgrade(const string& download);
+    void PaveUpgrade(const tstring& stagedUpgradeFilename);
 
     // IAuthorizationsProvider implementation
     psicash::Authorizations GetAuthorizations() const override;
@@ -98,7 +101,8 @@ public:
         const std::vector<std::string>& inactiveIDs) override;
 
     // Results in WM_PSIPHON_FEEDBACK_SUCCESS being posted to the main window
-    // on success, WM_PSIPHON_FEEDBACK_FAILED on failure.
+    // on success, WM_PSIPHON_FEEDBACK_FAILED on failure. Submissions made while
+    // an upload is in progress are queued and uploaded in the same pass.
     void SendFeedback(const string& utf8FeedbackJSON);
 
 private:
@@ -130,11 +134,16 @@ private:
 
 private:
     HANDLE m_mutex;
+    // Serializes upgrade paving, which is file I/O and so isn't done under m_mutex
+    HANDLE m_upgradeMutex;
     ConnectionManagerState m_state;
     SessionInfo m_currentSessionInfo;
     HANDLE m_thread;
     HANDLE m_upgradeThread;
     HANDLE m_feedbackThread;
+    // Guarded by m_mutex
+    vector<string> m_pendingFeedback;
+    bool m_feedbackThreadRunning;
     ITransport* m_transport;
     bool m_upgradePending;
     bool m_startSplitTunnel;
@@ -33,6 +33,8 @@
 #include "utilities.h"
 #include "authenticated_data_package.h"
 #include "psiphon_tunnel_core_utilities.h"
+#include "traffic_meter.h"
+#include "span_tracer.h"
 
 using namespace std::experimental;
 
@@ -52,8 +54,10 @@ CoreTransport::CoreTransport()
       m_localHttpProxyPort(AUTOMATICALLY_ASSIGNED_PORT_NUMBER),
       m_hasEverConnected(false),
       m_isConnected(false),
-      m_clientUpgradeDownloadHandled(false)
+      m_clientUpgradeDownloadHandled(false),
+      m_reconfigureRequested(false)
 {
+    m_upstreamProxyErrorMutex = CreateMutex(NULL, FALSE, 0);
 }
 
 
@@ -61,6 +65,7 @@ CoreTransport::~CoreTransport()
 {
     (void)Cleanup();
     IWorkerThread::Stop();
+    CloseHandle(m_upstreamProxyErrorMutex);
 }
 
 
@@ -181,6 +186,20 @@ tstring CoreTransport::GetLastTransportError() const
 }
 
 
+bool CoreTransport::Reconfigure()
+{
+    // Temporary tunnels and URL proxies run with fixed parameters, and before
+    // the first tunnel there's nothing to preserve.
+    if (m_tempConnectServerEntry != NULL || !m_hasEverConnected || !IsRunning())
+    {
+        return false;
+    }
+
+    m_reconfigureRequested = true;
+    return true;
+}
+
+
 void CoreTransport::TransportConnect()
 {
     my_print(NOT_SENSITIVE, false, _T("%s connecting..."), GetTransportDisplayName().c_str());
@@ -220,6 +239,59 @@ void CoreTransport::TransportConnectHelper()
 {
     assert(m_systemProxySettings != NULL);
 
+    StartCore(false);
+
+    // Wait and poll for first active tunnel (or stop signal)
+
+    ScopedSpan tunnelsSpan("CoreTransport::WaitForTunnels");
+    while (true)
+    {
+        // Check that the process is still running and consume output
+        if (!DoPeriodicCheck())
+        {
+            throw TransportFailed();
+        }
+
+        if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons))
+        {
+            throw Abort();
+        }
+
+        if (m_isConnected)
+        {
+            break;
+        }
+
+        Sleep(100);
+    }
+    tunnelsSpan.End();
+
+    m_systemProxySettings->SetSocksProxyPort(m_localSocksProxyPort);
+    m_systemProxySettings->SetHttpProxyPort(m_localHttpProxyPort);
+    m_systemProxySettings->SetHttpsProxyPort(m_localHttpProxyPort);
+
+    vector<tstring> ipAddresses;
+    GetLocalIPv4Addresses(ipAddresses);
+    if (Settings::ExposeLocalProxiesToLAN() && ipAddresses.size() > 0)
+    {
+        for (const auto& ipAddress : ipAddresses)
+        {
+            my_print(SENSITIVE_FORMAT_ARGS, false, _T("SOCKS proxy is running on %s port %d."), ipAddress.c_str(), m_localSocksProxyPort.load());
+            my_print(SENSITIVE_FORMAT_ARGS, false, _T("HTTP proxy is running on %s port %d."), ipAddress.c_str(), m_localHttpProxyPort.load());
+        }
+    }
+    else
+    {
+        my_print(NOT_SENSITIVE, false, _T("SOCKS proxy is running on localhost port %d."), m_localSocksProxyPort.load());
+        my_print(NOT_SENSITIVE, false, _T("HTTP proxy is running on localhost port %d."), m_localHttpProxyPort.load());
+    }
+}
+
+
+void CoreTransport::StartCore(bool keepLocalProxyPorts)
+{
+    m_authorizationIDs.clear();
+
     Json::Value encodedAuthorizations = Json::Value(Json::arrayValue);
     if (m_authorizationsProvider) {
         for (const auto& auth : m_authorizationsProvider->GetAuthorizations()) {
@@ -246,12 +318,19 @@ void CoreTransport::TransportConnectHelper()
     in.upstreamProxyAddress = GetUpstreamProxyAddress();
     in.encodedAuthorizations = encodedAuthorizations;
     in.tempConnectServerEntry = m_tempConnectServerEntry;
+    if (keepLocalProxyPorts)
+    {
+        in.localHttpProxyPort = m_localHttpProxyPort;
+        in.localSocksProxyPort = m_localSocksProxyPort;
+    }
 
+    ScopedSpan writeSpan("WriteParameterFiles");
     if (!WriteParameterFiles(in, out))
     {
         my_print(NOT_SENSITIVE, true, _T("%s:%d - WriteParameterFiles failed: %d"), __TFUNCTION__, __LINE__, GetLastError());
         throw TransportFailed(false);
     }
+    writeSpan.End();
 
     // Once a new upgrade has been paved, CoreTransport should never restart without the actual application restarting.
     // If there is a pending upgrade, when disconnect/connect is pressed (or a new region is chosen, upstream proxy settings change, etc.)
@@ -273,54 +352,43 @@ void CoreTransport::TransportConnectHelper()
 
     // Run core process; it will begin establishing a tunnel
 
+    ScopedSpan spawnSpan("SpawnCoreProcess");
     if (!SpawnCoreProcess(out.configFilePath, out.serverListFilename))
     {
         my_print(NOT_SENSITIVE, true, _T("%s:%d - SpawnCoreProcess failed: %d"), __TFUNCTION__, __LINE__, GetLastError());
         throw TransportFailed(false);
     }
+    spawnSpan.End();
+}
 
-    // Wait and poll for first active tunnel (or stop signal)
-
-    while (true)
-    {
-        // Check that the process is still running and consume output
-        if (!DoPeriodicCheck())
-        {
-            throw TransportFailed();
-        }
-
-        if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons))
-        {
-            throw Abort();
-        }
 
-        if (m_isConnected)
-        {
-            break;
-        }
+bool CoreTransport::RestartCore()
+{
+    my_print(NOT_SENSITIVE, false, _T("Applying new settings..."));
 
-        Sleep(100);
+    if (m_reconnectStateReceiver)
+    {
+        m_reconnectStateReceiver->SetReconnecting();
     }
+    m_isConnected = false;
 
-    m_systemProxySettings->SetSocksProxyPort(m_localSocksProxyPort);
-    m_systemProxySettings->SetHttpProxyPort(m_localHttpProxyPort);
-    m_systemProxySettings->SetHttpsProxyPort(m_localHttpProxyPort);
+    // Stops the current core and waits for it to exit, releasing its ports.
+    // The system proxy settings keep pointing at those ports, which the new
+    // core will listen on; the "Tunnels" notice from the new core moves us
+    // back to the connected state.
+    m_psiphonTunnelCore = nullptr;
 
-    vector<tstring> ipAddresses;
-    GetLocalIPv4Addresses(ipAddresses);
-    if (Settings::ExposeLocalProxiesToLAN() && ipAddresses.size() > 0)
+    try
     {
-        for (const auto& ipAddress : ipAddresses)
-        {
-            my_print(SENSITIVE_FORMAT_ARGS, false, _T("SOCKS proxy is running on %s port %d."), ipAddress.c_str(), m_localSocksProxyPort);
-            my_print(SENSITIVE_FORMAT_ARGS, false, _T("HTTP proxy is running on %s port %d."), ipAddress.c_str(), m_localHttpProxyPort);
-        }
+        StartCore(true);
     }
-    else
+    catch (TransportFailed&)
     {
-        my_print(NOT_SENSITIVE, false, _T("SOCKS proxy is running on localhost port %d."), m_localSocksProxyPort);
-        my_print(NOT_SENSITIVE, false, _T("HTTP proxy is running on localhost port %d."), m_localHttpProxyPort);
+        my_print(NOT_SENSITIVE, false, _T("%s - restarting core failed"), __TFUNCTION__);
+        return false;
     }
+
+    return true;
 }
 
 
@@ -436,6 +504,12 @@ bool CoreTransport::SpawnCoreProcess(const tstring& configFilename, const tstrin
 bool CoreTransport::ValidateAndPaveUpgrade(const tstring& clientUpgradeFilename) {
     bool processingSuccessful = false;
 
+    tstring stagingPath;
+    if (!GetUpgradeStagingPath(stagingPath)) {
+        my_print(NOT_SENSITIVE, false, _T("%s: GetUpgradeStagingPath failed: %d."), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
     HANDLE hFile = CreateFile(
         clientUpgradeFilename.c_str(),
         GENERIC_READ,
@@ -445,45 +519,63 @@ bool CoreTransport::ValidateAndPaveUpgrade(const tstring& clientUpgradeFilename)
         FILE_ATTRIBUTE_NORMAL,
         NULL); // no attr. template
 
-    if (hFile == INVALID_HANDLE_VALUE) {
+    HANDLE hStagingFile = CreateFile(
+        stagingPath.c_str(),
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE || hStagingFile == INVALID_HANDLE_VALUE) {
         my_print(NOT_SENSITIVE, false, _T("%s: Could not get a valid file handle: %d."), __TFUNCTION__, GetLastError());
     }
     else {
-        DWORD dwFileSize = GetFileSize(hFile, NULL);
-        unique_ptr<BYTE> inBuffer(new BYTE[dwFileSize]);
-        if (!inBuffer) {
-            processingSuccessful = false;
-            my_print(NOT_SENSITIVE, false, _T("%s: Could not allocate an input buffer."), __TFUNCTION__);
-        }
-        else {
-            DWORD dwBytesToRead = dwFileSize;
+        // Stream the package through the verifier a chunk at a time; the
+        // decoded binary goes straight to the staging file.
+        const DWORD CHUNK_SIZE = 64 * 1024;
+        unique_ptr<BYTE[]> inBuffer(new BYTE[CHUNK_SIZE]);
+        SignedDataPackageStreamVerifier verifier(UPGRADE_SIGNATURE_PUBLIC_KEY, hStagingFile);
+
+        bool readSuccessful = true;
+        while (true) {
             DWORD dwBytesRead = 0;
-            OVERLAPPED stOverlapped = { 0 };
-            string downloadFileString;
-
-            if (TRUE == ReadFile(hFile, inBuffer.get(), dwBytesToRead, &dwBytesRead, NULL)) {
-                if (verifySignedDataPackage(
-                    UPGRADE_SIGNATURE_PUBLIC_KEY,
-                    (const char *)inBuffer.get(),
-                    dwFileSize,
-                    true, // gzip compressed
-                    downloadFileString))
-                {
-                    // Data in the package is Base64 encoded
-                    downloadFileString = Base64Decode(downloadFileString);
-
-                    if (downloadFileString.length() > 0) {
-                        m_upgradePaver->PaveUpgrade(downloadFileString);
-                    }
-
-                    processingSuccessful = true;
-                }
+            if (!ReadFile(hFile, inBuffer.get(), CHUNK_SIZE, &dwBytesRead, NULL)) {
+                my_print(NOT_SENSITIVE, false, _T("%s: ReadFile failed: %d."), __TFUNCTION__, GetLastError());
+                readSuccessful = false;
+                break;
+            }
+            if (dwBytesRead == 0) {
+                break;
+            }
+            if (!verifier.Put((const char*)inBuffer.get(), dwBytesRead)) {
+                readSuccessful = false;
+                break;
             }
         }
 
+        processingSuccessful =
+            readSuccessful
+            && verifier.Finish()
+            && FlushFileBuffers(hStagingFile) != FALSE;
+    }
+
+    if (hFile != INVALID_HANDLE_VALUE) {
         CloseHandle(hFile);
     }
 
+    if (hStagingFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(hStagingFile);
+    }
+
+    if (processingSuccessful) {
+        m_upgradePaver->PaveUpgrade(stagingPath);
+    }
+    else {
+        (void)DeleteFile(stagingPath.c_str());
+    }
+
     if (!processingSuccessful) {
         // Bad package. Log and continue.
         my_print(NOT_SENSITIVE, false, _T("%s: Upgrade package verification failed! Please report this error."), __TFUNCTION__);
@@ -527,9 +619,7 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
             m_hasEverConnected = true;
         }
     }
-    else if (noticeType == "ClientUpgradeDownloaded" && m_upgradePaver != NULL && m_clientUpgradeDownloadHandled == false) {
-        m_clientUpgradeDownloadHandled = true;
-
+    else if (noticeType == "ClientUpgradeDownloaded" && m_upgradePaver != NULL && !m_clientUpgradeDownloadHandled.exchange(true)) {
         my_print(NOT_SENSITIVE, false, _T("A client upgrade has been downloaded..."));
         if (!ValidateAndPaveUpgrade(UTF8ToWString(data["filename"].asString()))) {
             m_clientUpgradeDownloadHandled = false;
@@ -539,6 +629,7 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
     else if (noticeType == "Homepage")
     {
         string url = data["url"].asString();
+        AutoMUTEX lock(m_sessionInfoMutex);
         m_sessionInfo.SetHomepage(url.c_str());
     }
     else if (noticeType == "ListeningSocksProxyPort")
@@ -584,6 +675,7 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
     {
         string message = data["message"].asString();
 
+        AutoMUTEX lock(m_upstreamProxyErrorMutex);
         if (message != m_lastUpstreamProxyErrorMessage)
         {
             // SENSITIVE_FORMAT_ARGS: "message" may contain address info that identifies user
@@ -654,6 +746,11 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
         my_print(NOT_SENSITIVE, true, _T("Traffic rate downstream limit: %S"), speed.c_str());
         // Processing this is left to main.js
     }
+    else if (noticeType == "BytesTransferred" && m_tempConnectServerEntry == NULL)
+    {
+        // Temporary and URL proxy cores don't carry the user's traffic
+        TunneledTrafficMeter::Instance().Add(data["sent"].asUInt64() + data["received"].asUInt64());
+    }
 }
 
 
@@ -665,6 +762,11 @@ bool CoreTransport::DoPeriodicCheck()
     //   a mutex. This is safe because one thread (IWorkerThread::Thread) is currently
     //   making all the calls to DoPeriodicCheck()
 
+    if (m_reconfigureRequested.exchange(false) && !RestartCore())
+    {
+        return false;
+    }
+
     // Check if the subprocess is still running, and consume any buffered output
 
     try {
@@ -684,6 +786,7 @@ bool CoreTransport::DoPeriodicCheck()
             // We'll consume the output anyway, as it might contain information
             // about why the process death occurred (such as port conflict).
             m_psiphonTunnelCore->ConsumeSubprocessOutput();
+            (void)m_psiphonTunnelCore->WaitForNoticesHandled(m_stopInfo, NOTICE_DRAIN_TIMEOUT_MS);
             return false;
         }
         else if (status == SUBPROCESS_STATUS_NO_PROCESS) {
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <atomic>
 #include "worker_thread.h"
 #include "psiphon_tunnel_core.h"
 #include "transport.h"
@@ -56,6 +57,7 @@ public:
     virtual tstring GetSessionID(const SessionInfo& sessionInfo);
     virtual int GetLocalProxyParentPort() const;
     virtual tstring GetLastTransportError() const;
+    virtual bool Reconfigure() override;
 
 protected:
     virtual void TransportConnect();
@@ -66,16 +68,27 @@ protected:
 
     bool RequestingUrlProxyWithoutTunnel();
     void TransportConnectHelper();
+    // Writes parameter files and spawns the core. If keepLocalProxyPorts is
+    // true, the core is told to listen on the current local proxy ports.
+    // Throws TransportFailed.
+    void StartCore(bool keepLocalProxyPorts);
+    // Replaces the running core with one using the current settings.
+    // Returns false on failure. Must be called on the worker thread.
+    bool RestartCore();
     bool SpawnCoreProcess(const tstring& configFilename, const tstring& serverListFilename);
     bool ValidateAndPaveUpgrade(const tstring& clientUpgradeFilename);
 
 protected:
-    int m_localSocksProxyPort;
-    int m_localHttpProxyPort;
-    bool m_hasEverConnected;
-    bool m_isConnected;
-    bool m_clientUpgradeDownloadHandled;
+    // Set by the notice handler, which runs on the core's notice thread
+    std::atomic<int> m_localSocksProxyPort;
+    std::atomic<int> m_localHttpProxyPort;
+    std::atomic<bool> m_hasEverConnected;
+    std::atomic<bool> m_isConnected;
+    std::atomic<bool> m_clientUpgradeDownloadHandled;
+    HANDLE m_upstreamProxyErrorMutex;
     string m_lastUpstreamProxyErrorMessage;
     std::vector<std::string> m_authorizationIDs;
     unique_ptr<PsiphonTunnelCore> m_psiphonTunnelCore;
+    // Set by Reconfigure; acted on by the worker thread in DoPeriodicCheck
+    std::atomic<bool> m_reconfigureRequested;
 };
@@ -25,9 +25,12 @@
 #include "systemproxysettings.h"
 #include "utilities.h"
 #include "diagnostic_info.h"
+#include "diagnostic_journal.h"
 #include "usersettings.h"
 #include "config.h"
 #include "psicashlib.h"
+#include "span_tracer.h"
+#include "metrics.h"
 #include <VersionHelpers.h>
 
 #pragma warning(push, 0)
@@ -36,10 +39,48 @@
 #pragma warning(pop)
 
 
-HANDLE g_diagnosticHistoryMutex = CreateMutex(NULL, FALSE, 0);
-Json::Value g_diagnosticHistory(Json::arrayValue);
+// Entries are kept serialized; the history is only turned back into JSON
+// values when feedback is generated.
+static DiagnosticJournal g_diagnosticHistory;
 
 
+// Appends an already-serialized `{"msg":...,"data":...}` entry. `start` is
+// when the caller began building it; the time taken to add the entry is
+// recorded in the "diagnostics.append_time_ns" histogram.
+static void AppendDiagnosticHistory(const string& entryJson, const LARGE_INTEGER& start)
+{
+    static MetricHistogram& appendTime = MetricsRegistry::Instance().Histogram("diagnostics.append_time_ns");
+
+    OutputDebugStringA(entryJson.c_str());
+    OutputDebugStringA("\n");
+
+    g_diagnosticHistory.Append(GetTimestamp(), entryJson.c_str(), entryJson.length());
+
+    static LARGE_INTEGER frequency = []() { LARGE_INTEGER f; QueryPerformanceFrequency(&f); return f; }();
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    appendTime.Record((unsigned long long)(now.QuadPart - start.QuadPart) * 1000000000ULL / (unsigned long long)frequency.QuadPart);
+}
+
+void _AddDiagnosticInfoHelper(const char* message, const Json::Value& entry)
+{
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    string entryJson = "{\"msg\":";
+    entryJson += Json::valueToQuotedString(message);
+    entryJson += ",\"data\":";
+    entryJson += Json::FastWriter().write(entry);
+    // FastWriter terminates its output with a newline
+    if (!entryJson.empty() && entryJson.back() == '\n')
+    {
+        entryJson.pop_back();
+    }
+    entryJson += '}';
+
+    AppendDiagnosticHistory(entryJson, start);
+}
+
 // This is really just a non-template wrapper around AddDiagnosticInfo, to help
 // users of it recognize that they can pass a Json::Value.
 void AddDiagnosticInfoJson(const char* message, const Json::Value& jsonValue)
@@ -51,25 +92,57 @@ void AddDiagnosticInfoJson(const char* message, const char* jsonString)
 {
     if (!jsonString) {
         AddDiagnosticInfo(message, Json::nullValue);
-
+        return;
     }
 
+    // The string is stored as-is, so it must be exactly one JSON value: no
+    // comments and nothing trailing, which the lenient Json::Reader allows.
+    unique_ptr<Json::CharReader> reader(NewStrictJSONReader());
+
+    size_t length = strlen(jsonString);
     Json::Value json;
-    Json::Reader reader;
-    bool parsingSuccessful = reader.parse(jsonString, json);
-    if (!parsingSuccessful)
+    string errors;
+    if (!reader->parse(jsonString, jsonString + length, &json, &errors))
     {
         return;
     }
 
-    AddDiagnosticInfo(message, json);
+    AddDiagnosticInfoJsonValidated(message, string(jsonString, length));
+}
+
+void AddDiagnosticInfoJsonValidated(const char* message, const string& jsonString)
+{
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    string entryJson = "{\"msg\":";
+    entryJson += Json::valueToQuotedString(message);
+    entryJson += ",\"data\":";
+    entryJson += jsonString;
+    entryJson += '}';
+
+    AppendDiagnosticHistory(entryJson, start);
+}
+
+Json::CharReader* NewStrictJSONReader()
+{
+    Json::CharReaderBuilder builder;
+    Json::CharReaderBuilder::strictMode(&builder.settings_);
+    builder["failIfExtra"] = true;
+    builder["strictRoot"] = false;
+    return builder.newCharReader();
 }
 
 void GetDiagnosticHistory(Json::Value& o_json)
 {
-    o_json.clear();
-    AutoMUTEX mutex(g_diagnosticHistoryMutex);
-    o_json = Json::Value(g_diagnosticHistory);
+    o_json = Json::Value(Json::arrayValue);
+
+    Json::Reader reader;
+    if (!reader.parse(g_diagnosticHistory.ExportJSON(), o_json, false))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: failed to parse diagnostic history: %S"), __TFUNCTION__, reader.getFormattedErrorMessages().c_str());
+        o_json = Json::Value(Json::arrayValue);
+    }
 }
 
 
@@ -1312,7 +1385,7 @@ void GetDiagnosticInfo(Json::Value& o_json)
         Json::Value messageEntry(Json::objectValue);
         messageEntry["message"] = WStringToUTF8(entry->message);
         messageEntry["debug"] = entry->debug;
-        messageEntry["timestamp!!timestamp"] = WStringToUTF8(entry->timestamp);
+        messageEntry["timestamp!!timestamp"] = FormatISO8601Timestamp(entry->timestamp);
 
         statusHistory.append(messageEntry);
     }
@@ -1383,6 +1456,10 @@ string GenerateFeedbackJSON(
         GetDiagnosticHistory(outJson["DiagnosticInfo"]["DiagnosticHistory"]);
 
         outJson["DiagnosticInfo"]["PsiCash"] = GetPsiCashDiagnosticData();
+
+        outJson["DiagnosticInfo"]["ConnectionTimeline"] = SpanTracer::Instance().GetTimelineJson();
+
+        outJson["DiagnosticInfo"]["Metrics"] = MetricsRegistry::Instance().Snapshot();
     }
 
     // Feedback
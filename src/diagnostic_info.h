@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include "timestamp.h"
+
 
 /**
 Should be called before Psiphon has attempted to connect or made any system
@@ -40,10 +42,9 @@ string GenerateFeedbackJSON(
         bool sendDiagnosticInfo);
 
 
-// Forward declarations. Do not access directly. (They're only here because the
-// template function needs them.)
-extern vector<string> g_diagnosticInfo;
-void _AddDiagnosticInfoHelper(const char* entry);
+// Forward declaration. Do not access directly. (It's only here because the
+// template function needs it.)
+void _AddDiagnosticInfoHelper(const char* message, const Json::Value& entry);
 
 
 /**
@@ -54,6 +55,19 @@ void _AddDiagnosticInfoHelper(const char* entry);
 void AddDiagnosticInfoJson(const char* message, const Json::Value& jsonValue);
 void AddDiagnosticInfoJson(const char* message, const char* jsonString);
 
+/**
+Like AddDiagnosticInfoJson, but `jsonString` must already have been parsed by
+a reader from NewStrictJSONReader, so it's stored without being parsed again.
+For hot paths, such as core notices.
+*/
+void AddDiagnosticInfoJsonValidated(const char* message, const string& jsonString);
+
+/**
+Returns a new reader that accepts exactly one JSON value, with no comments and
+nothing trailing. Strings it parses may be passed to AddDiagnosticInfoJsonValidated.
+*/
+Json::CharReader* NewStrictJSONReader();
+
 
 /**
 `message` is the identifier for this entry.
@@ -63,19 +77,12 @@ https://open-source-parsers.github.io/jsoncpp-docs/doxygen/class_json_1_1_value.
 template<typename T>
 void AddDiagnosticInfo(const char* message, const T& entry)
 {
-    Json::Value json(Json::objectValue);
-    json["timestamp!!timestamp"] = WStringToUTF8(GetISO8601DatetimeString());
-    json["msg"] = message;
-    json["data"] = entry;
-
-    Json::FastWriter jsonWriter;
-    string jsonString = jsonWriter.write(json);
-
-    OutputDebugStringA(jsonString.c_str());
-    OutputDebugStringA("\n");
+    _AddDiagnosticInfoHelper(message, Json::Value(entry));
+}
 
-    AutoMUTEX mutex(g_diagnosticHistoryMutex);
-    g_diagnosticHistory.append(json);
+inline void AddDiagnosticInfo(const char* message, const Json::Value& entry)
+{
+    _AddDiagnosticInfoHelper(message, entry);
 }
 
 
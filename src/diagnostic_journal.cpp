@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "diagnostic_journal.h"
+#include "utilities.h"
+
+
+DiagnosticJournal::DiagnosticJournal()
+    : m_count(0)
+{
+    m_mutex = CreateMutex(NULL, FALSE, 0);
+}
+
+DiagnosticJournal::~DiagnosticJournal()
+{
+    CloseHandle(m_mutex);
+}
+
+void DiagnosticJournal::Append(Timestamp timestamp, const char* jsonObject, size_t length)
+{
+    if (jsonObject == NULL || length == 0)
+    {
+        return;
+    }
+
+    RecordHeader header;
+    header.timestamp = timestamp;
+    header.length = length;
+    size_t recordSize = sizeof(header) + length;
+
+    AutoMUTEX lock(m_mutex);
+
+    if (m_chunks.empty() || m_chunks.back().capacity - m_chunks.back().used < recordSize)
+    {
+        Chunk chunk;
+        chunk.capacity = recordSize > CHUNK_SIZE ? recordSize : CHUNK_SIZE;
+        chunk.buffer.reset(new char[chunk.capacity]);
+        chunk.used = 0;
+        m_chunks.push_back(std::move(chunk));
+    }
+
+    Chunk& chunk = m_chunks.back();
+    memcpy(chunk.buffer.get() + chunk.used, &header, sizeof(header));
+    memcpy(chunk.buffer.get() + chunk.used + sizeof(header), jsonObject, length);
+    chunk.used += recordSize;
+    m_count++;
+}
+
+string DiagnosticJournal::ExportJSON() const
+{
+    AutoMUTEX lock(m_mutex);
+
+    size_t totalSize = 2;
+    for (const auto& chunk : m_chunks)
+    {
+        // Generous: the timestamp member is ~50 bytes, the header is dropped
+        totalSize += chunk.used + (chunk.used / sizeof(RecordHeader)) * 64;
+    }
+
+    string json;
+    json.reserve(totalSize);
+    json += '[';
+
+    bool first = true;
+    for (const auto& chunk : m_chunks)
+    {
+        size_t offset = 0;
+        while (offset < chunk.used)
+        {
+            RecordHeader header;
+            memcpy(&header, chunk.buffer.get() + offset, sizeof(header));
+            const char* entry = chunk.buffer.get() + offset + sizeof(header);
+            offset += sizeof(header) + header.length;
+
+            if (!first)
+            {
+                json += ',';
+            }
+            first = false;
+
+            // Splice the timestamp in as the first member of the entry object
+            json += "{\"timestamp!!timestamp\":\"";
+            json += FormatISO8601Timestamp(header.timestamp);
+            json += '"';
+            if (header.length > 2)
+            {
+                json += ',';
+            }
+            json.append(entry + 1, header.length - 1);
+        }
+    }
+
+    json += ']';
+    return json;
+}
+
+size_t DiagnosticJournal::Count() const
+{
+    AutoMUTEX lock(m_mutex);
+    return m_count;
+}
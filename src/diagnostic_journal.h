@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "timestamp.h"
+
+
+/**
+DiagnosticJournal is an append-only store of diagnostic history entries.
+
+Entries are kept already serialized, back to back in large chunks, so that
+appending an entry is a copy into the current chunk rather than building and
+retaining a JSON tree per event. Each entry is a JSON object; its timestamp is
+stored raw alongside it and only formatted on export.
+
+Thread safe.
+*/
+class DiagnosticJournal
+{
+public:
+    DiagnosticJournal();
+    virtual ~DiagnosticJournal();
+
+    /**
+    Appends an entry. `jsonObject` must be a serialized JSON object, starting
+    with its '{' (e.g., `{"msg":"x","data":1}`), of `length` bytes; it is not
+    validated. The
+    timestamp is added to the object, as "timestamp!!timestamp", on export.
+    */
+    void Append(Timestamp timestamp, const char* jsonObject, size_t length);
+
+    /**
+    Returns all entries, in the order they were appended, as a JSON array.
+    */
+    string ExportJSON() const;
+
+    size_t Count() const;
+
+private:
+    // not copyable
+    DiagnosticJournal(DiagnosticJournal const&);
+    DiagnosticJournal& operator=(DiagnosticJournal const&);
+
+    // Each record is a header followed by the entry's bytes. Records never
+    // span chunks; an entry too big for a normal chunk gets its own.
+    struct RecordHeader
+    {
+        Timestamp timestamp;
+        size_t length;
+    };
+
+    struct Chunk
+    {
+        unique_ptr<char[]> buffer;
+        size_t used;
+        size_t capacity;
+    };
+
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    HANDLE m_mutex;
+    vector<Chunk> m_chunks;
+    size_t m_count;
+};
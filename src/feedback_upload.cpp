@@ -164,12 +164,75 @@ void FeedbackUpload::SendFeedbackHelper()
 }
 
 
+// The feedback upload executable is extracted once and then shared by every
+// upload for the rest of the session, instead of being extracted and deleted
+// for each upload. Uploads are made one at a time (see
+// ConnectionManager::SendFeedback), so the file is never replaced while a
+// previous upload process is still using it.
+static HANDLE g_feedbackExeMutex = CreateMutex(NULL, FALSE, 0);
+static tstring g_feedbackExePath;
+
+static void DeleteFeedbackExe()
+{
+    AutoMUTEX lock(g_feedbackExeMutex);
+    if (!g_feedbackExePath.empty())
+    {
+        (void)DeleteFile(g_feedbackExePath.c_str());
+        g_feedbackExePath.clear();
+    }
+}
+
+// Returns the path of the already extracted executable, if it's still present.
+static bool GetExtractedFeedbackExe(tstring& o_exePath)
+{
+    AutoMUTEX lock(g_feedbackExeMutex);
+    if (g_feedbackExePath.empty() ||
+        GetFileAttributes(g_feedbackExePath.c_str()) == INVALID_FILE_ATTRIBUTES)
+    {
+        g_feedbackExePath.clear();
+        return false;
+    }
+    o_exePath = g_feedbackExePath;
+    return true;
+}
+
+static void SetExtractedFeedbackExe(const tstring& exePath)
+{
+    AutoMUTEX lock(g_feedbackExeMutex);
+    static bool registeredCleanup = false;
+    if (!registeredCleanup)
+    {
+        atexit(&DeleteFeedbackExe);
+        registeredCleanup = true;
+    }
+    g_feedbackExePath = exePath;
+}
+
+
 bool FeedbackUpload::SpawnFeedbackUploadProcess(const tstring& configFilename, const string& diagnosticData)
 {
-    // See CoreTransport::SpawnCoreProcess for an explanation of the filename logic
+    tstringstream commandLineFlags;
+    commandLineFlags << _T(" --config \"") << configFilename << _T("\" --feedbackUpload");
+
     bool startSuccess = false;
+
+    tstring extractedExePath;
+    if (GetExtractedFeedbackExe(extractedExePath))
+    {
+        m_psiphonTunnelCore = make_unique<PsiphonTunnelCore>(this, extractedExePath, false);
+        if (m_psiphonTunnelCore->SpawnSubprocess(commandLineFlags.str())) {
+            startSuccess = true;
+        }
+        else {
+            my_print(NOT_SENSITIVE, false, _T("%s:%d - SpawnSubprocess of extracted executable failed"), __TFUNCTION__, __LINE__);
+            m_psiphonTunnelCore.reset();
+            DeleteFeedbackExe();
+        }
+    }
+
+    // See CoreTransport::SpawnCoreProcess for an explanation of the filename logic
     string fileErrorDetail;
-    for (int i = -1; i < 5; i++) {
+    for (int i = -1; i < 5 && !startSuccess; i++) {
         tstring exePath;
         if (i < 0) {
             filesystem::path tempPath;
@@ -197,18 +260,16 @@ bool FeedbackUpload::SpawnFeedbackUploadProcess(const tstring& configFilename, c
             continue;
         }
 
-        tstringstream commandLineFlags;
-        commandLineFlags << _T(" --config \"") << configFilename << _T("\" --feedbackUpload");
-
-        m_psiphonTunnelCore = make_unique<PsiphonTunnelCore>(this, exePath);
+        m_psiphonTunnelCore = make_unique<PsiphonTunnelCore>(this, exePath, false);
         if (!m_psiphonTunnelCore->SpawnSubprocess(commandLineFlags.str())) {
             my_print(NOT_SENSITIVE, false, _T("%s:%d - SpawnSubprocess failed"), __TFUNCTION__, __LINE__);
-            // The PsiphonTunnelCore (Subprocess) destructor will clean up the executable file
+            m_psiphonTunnelCore.reset();
+            (void)DeleteFile(exePath.c_str());
             continue;
         }
 
+        SetExtractedFeedbackExe(exePath);
         startSuccess = true;
-        break;
     }
 
     if (!startSuccess) {
@@ -220,23 +281,37 @@ bool FeedbackUpload::SpawnFeedbackUploadProcess(const tstring& configFilename, c
         return false;
     }
 
-    // Write diagnostics to stdin of the child process
+    // Stream diagnostics to stdin of the child process in bounded chunks. The
+    // writes happen in the background; the short timeouts are only so that a
+    // stop is noticed while the child catches up.
+
+    const size_t chunkSize = 64 * 1024;
+    const DWORD waitSliceMs = 100;
+    size_t totalQueued = 0;
+    while (true) {
+        if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, false)) {
+            my_print(NOT_SENSITIVE, true, _T("%s - stop signalled while writing diagnostic data"), __TFUNCTION__);
+            (void)m_psiphonTunnelCore->CloseInputPipes(0);
+            return false;
+        }
 
-    DWORD totalNumWritten = 0;
-    while (totalNumWritten < diagnosticData.length()) {
-        DWORD numWritten = 0;
-        if (!WriteFile(m_psiphonTunnelCore->ParentInputPipe(), diagnosticData.c_str(), diagnosticData.length(), &numWritten, NULL)) {
-            my_print(NOT_SENSITIVE, false, _T("%s - failed to write diagnostic data to subprocess stdin (%d)"), __TFUNCTION__, GetLastError());
+        if (m_psiphonTunnelCore->InputFailed()) {
+            my_print(NOT_SENSITIVE, false, _T("%s - failed to write diagnostic data to subprocess stdin"), __TFUNCTION__);
             return false;
         }
 
-        if (numWritten != diagnosticData.length()) {
-            my_print(NOT_SENSITIVE, false, _T("%s - failed to write all diagnostic data to subprocess stdin, wrote %d of %d bytes"), __TFUNCTION__, numWritten, diagnosticData.length());
+        if (totalQueued < diagnosticData.length()) {
+            size_t toQueue = min(chunkSize, diagnosticData.length() - totalQueued);
+            if (m_psiphonTunnelCore->WriteInput(diagnosticData.c_str() + totalQueued, toQueue, waitSliceMs)) {
+                totalQueued += toQueue;
+            }
+        }
+        else if (m_psiphonTunnelCore->FlushInput(waitSliceMs)) {
+            break;
         }
-        totalNumWritten += numWritten;
     }
 
-    if (!m_psiphonTunnelCore->CloseInputPipes()) {
+    if (!m_psiphonTunnelCore->CloseInputPipes(0)) {
         my_print(NOT_SENSITIVE, false, _T("%s - failed to close input pipes"), __TFUNCTION__);
         return false;
     }
@@ -271,6 +346,7 @@ bool FeedbackUpload::DoPeriodicCheck()
             // The process has signalled -- which implies that it has died.
             // Consume any final output.
             m_psiphonTunnelCore->ConsumeSubprocessOutput();
+            (void)m_psiphonTunnelCore->WaitForNoticesHandled(m_stopInfo, NOTICE_DRAIN_TIMEOUT_MS);
 
             DWORD exitCode;
             if (!GetExitCodeProcess(m_psiphonTunnelCore->Process(), &exitCode)) {
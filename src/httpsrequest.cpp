@@ -31,6 +31,7 @@
 #include "transport_registry.h"
 #include "coretransport.h"
 #include "utilities.h"
+#include "metrics.h"
 
 
 // NOTE: this code depends on built-in Windows crypto services
@@ -53,8 +54,179 @@ private:
 };
 
 
+// Not defined by older SDKs. Supported from Windows 10 1607.
+#ifndef WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL
+#define WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL 133
+#endif
+#ifndef WINHTTP_PROTOCOL_FLAG_HTTP2
+#define WINHTTP_PROTOCOL_FLAG_HTTP2 0x1
+#endif
+
+
+/***********************************************************************
+HTTPSSession
+*/
+
+HTTPSSession::Connection::~Connection()
+{
+    if (connect != NULL)
+    {
+        WinHttpCloseHandle(connect);
+    }
+    if (session != NULL)
+    {
+        WinHttpCloseHandle(session);
+    }
+}
+
+HTTPSSession::HTTPSSession()
+    : m_serverWebPort(0), m_lastUsedTicks(0)
+{
+    m_mutex = CreateMutex(NULL, FALSE, 0);
+}
+
+HTTPSSession::~HTTPSSession()
+{
+    Close();
+    CloseHandle(m_mutex);
+}
+
+void HTTPSSession::Close()
+{
+    shared_ptr<Connection> connection;
+    {
+        AutoMUTEX lock(m_mutex);
+        std::swap(connection, m_connection);
+    }
+    // Closed here, outside the lock, unless a request is still using it
+}
+
+// static
+shared_ptr<HTTPSSession::Connection> HTTPSSession::Open(
+    const tstring& proxyHost,
+    const TCHAR* serverAddress,
+    int serverWebPort,
+    bool useURLProxy,
+    bool silentMode)
+{
+    shared_ptr<Connection> connection = make_shared<Connection>();
+
+    connection->session =
+                WinHttpOpen(
+                    _T("Mozilla/4.0 (compatible; MSIE 5.22)"),
+                    proxyHost.length() ? WINHTTP_ACCESS_TYPE_NAMED_PROXY : WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+                    proxyHost.length() ? proxyHost.c_str() : WINHTTP_NO_PROXY_NAME,
+                    WINHTTP_NO_PROXY_BYPASS,
+                    WINHTTP_FLAG_ASYNC);
+
+    if (NULL == connection->session)
+    {
+        my_print(NOT_SENSITIVE, silentMode, _T("WinHttpOpen failed (%d)"), GetLastError());
+        return nullptr;
+    }
+
+    if (FALSE == WinHttpSetTimeouts(connection->session, 0, HTTPS_REQUEST_CONNECT_TIMEOUT_MS,
+                            HTTPS_REQUEST_SEND_TIMEOUT_MS, HTTPS_REQUEST_RECEIVE_TIMEOUT_MS))
+    {
+        my_print(NOT_SENSITIVE, silentMode, _T("WinHttpSetTimeouts failed (%d)"), GetLastError());
+        return nullptr;
+    }
+
+    // SSLv3, TLSv1.0, TLSv1.1 all have security flaws that mean that should be avoided.
+    // Some of those flaws (like SSLv3's POODLE http://cve.mitre.org/cgi-bin/cvename.cgi?name=CVE-2014-3566)
+    // require the client side to not try to use them. So we're going to force use of
+    // TLS v1.2. We'll try to remember to update these flags when new TLS versions come
+    // out; we think it's too risky to set all bits except the bad ones (like ~(SSL|TLS1.0|TLS1.1)),
+    // as we might get something we don't want.
+    // When WinHttpSetOption gets flags it doesn't understand -- like WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2
+    // on XP and Vista -- it returns FALSE and sets errno to ERROR_INVALID_PARAMETER (87). When
+    // that happens we'll fall back to the URL proxy. That's why we're _not_ going
+    // to set the HTTPS protocol for URL proxy requests (and it's HTTP, not HTTPS).
+    DWORD dwProtocols = WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2;
+    if (!useURLProxy)
+    {
+        if (FALSE == WinHttpSetOption(
+            connection->session,
+            WINHTTP_OPTION_SECURE_PROTOCOLS,
+            &dwProtocols,
+            sizeof(DWORD)))
+        {
+            my_print(NOT_SENSITIVE, silentMode, _T("WinHttpSetOption WINHTTP_OPTION_SECURE_PROTOCOLS failed (%d)"), GetLastError());
+            return nullptr;
+        }
+    }
+
+    connection->connect =
+            WinHttpConnect(
+                connection->session,
+                serverAddress,
+                (INTERNET_PORT)serverWebPort,
+                0);
+
+    if (NULL == connection->connect)
+    {
+        my_print(NOT_SENSITIVE, silentMode, _T("WinHttpConnect failed (%d)"), GetLastError());
+        return nullptr;
+    }
+
+    return connection;
+}
+
+shared_ptr<HTTPSSession::Connection> HTTPSSession::Acquire(
+    const tstring& proxyHost,
+    const TCHAR* serverAddress,
+    int serverWebPort,
+    bool silentMode)
+{
+    static MetricCounter& sessionsOpened = MetricsRegistry::Instance().Counter("https.sessions_opened");
+    static MetricCounter& sessionsReused = MetricsRegistry::Instance().Counter("https.sessions_reused");
+
+    AutoMUTEX lock(m_mutex);
+
+    if (m_connection
+        && (m_proxyHost != proxyHost
+            || m_serverAddress != serverAddress
+            || m_serverWebPort != serverWebPort
+            || GetTickCount() - m_lastUsedTicks > HTTPS_SESSION_IDLE_TIMEOUT_MS))
+    {
+        m_connection.reset();
+    }
+
+    if (m_connection)
+    {
+        sessionsReused.Add();
+    }
+    else
+    {
+        m_connection = Open(proxyHost, serverAddress, serverWebPort, false, silentMode);
+        if (!m_connection)
+        {
+            return nullptr;
+        }
+        m_proxyHost = proxyHost;
+        m_serverAddress = serverAddress;
+        m_serverWebPort = serverWebPort;
+        sessionsOpened.Add();
+    }
+
+    m_lastUsedTicks = GetTickCount();
+    return m_connection;
+}
+
+void HTTPSSession::Touch()
+{
+    AutoMUTEX lock(m_mutex);
+    m_lastUsedTicks = GetTickCount();
+}
+
+
+/***********************************************************************
+HTTPSRequest
+*/
+
 HTTPSRequest::HTTPSRequest(bool silentMode/*=false*/)
-    : m_silentMode(silentMode), m_closedEvent(NULL)
+    : m_silentMode(silentMode), m_closedEvent(NULL), m_bodySink(NULL), m_streamBody(false),
+      m_readDeferred(false), m_readDeferredTime(0), m_readDelay(0), m_session(NULL)
 {
     m_mutex = CreateMutex(NULL, FALSE, 0);
 }
@@ -221,6 +393,8 @@ void CALLBACK WinHttpStatusCallback(
         httpRequest->ResponseSetCode(dwStatusCode);
         my_print(NOT_SENSITIVE, true, _T("HTTP request status code: %d"), dwStatusCode);
 
+        httpRequest->ResponseBeginBody();
+
         if (!WinHttpQueryDataAvailable(hRequest, 0))
         {
             my_print(NOT_SENSITIVE, httpRequest->m_silentMode, _T("WinHttpQueryDataAvailable failed (%d)"), GetLastError());
@@ -262,11 +436,23 @@ void CALLBACK WinHttpStatusCallback(
         // NOTE: response data may be binary; some relevant comments here...
         // http://stackoverflow.com/questions/441203/proper-way-to-store-binary-data-with-c-stl
 
-        httpRequest->ResponseAppendBody(string(string::const_pointer(pBuffer), string::const_pointer((char*)pBuffer + dwLen)));
+        if (!httpRequest->ResponseAppendBody((const char*)pBuffer, dwLen))
+        {
+            my_print(NOT_SENSITIVE, httpRequest->m_silentMode, _T("Response body sink failed"));
+            HeapFree(GetProcessHeap(), 0, pBuffer);
+            WinHttpCloseHandle(hRequest);
+            return;
+        }
 
         HeapFree(GetProcessHeap(), 0, pBuffer);
 
-        // Check for more data
+        // Check for more data, unless the body sink is pacing the download;
+        // then MakeRequest asks for it when it's due.
+
+        if (httpRequest->DeferRead())
+        {
+            break;
+        }
 
         if (!WinHttpQueryDataAvailable(hRequest, 0))
         {
@@ -318,18 +504,31 @@ bool HTTPSRequest::MakeRequest(
     // http://stackoverflow.com/questions/29801450/winhttp-doesnt-download-from-amazon-s3-on-winxp
     // In this case, we can use the tunnel core URL proxy to make the request using a different http client stack.
 
+    DWORD requestStartTime = GetTickCount();
+
     bool success = MakeRequestWithURLProxyOption(
         serverAddress, serverWebPort, webServerCertificate, requestPath,
         stopInfo, usePsiphonLocalProxy, response,
         false, // useURLProxy
         additionalHeaders, additionalData, additionalDataLength, httpVerb);
 
+    static MetricHistogram& requestTime = MetricsRegistry::Instance().Histogram("https.request_time_ms");
+    static MetricCounter& requestFailures = MetricsRegistry::Instance().Counter("https.request_failures");
+    requestTime.Record(GetTickCount() - requestStartTime);
+    if (!success)
+    {
+        requestFailures.Add();
+    }
+
     my_print(NOT_SENSITIVE, true, _T("%s:%d - MakeRequestWithURLProxyOption %s : %d"), __TFUNCTION__, __LINE__, (success ? _T("succeeded") : _T("failed")), GetLastError());
 
     if (!success && failoverToURLProxy)
     {
         my_print(NOT_SENSITIVE, true, _T("%s:%d - failing over to URL proxy"), __TFUNCTION__, __LINE__);
 
+        static MetricCounter& urlProxyFailovers = MetricsRegistry::Instance().Counter("https.url_proxy_failovers");
+        urlProxyFailovers.Add();
+
         // This is the broken SSL WinHTTP client case.
         // Use a URL proxy to make the HTTPS request for us instead.
 
@@ -484,64 +683,36 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
     }
     my_print(NOT_SENSITIVE, true, _T("%s: %s; proxy: {use: %d, set: %S}"), __TFUNCTION__, reqType.c_str(), usePsiphonLocalProxy, (proxyHost.length() ? "true" : "false"));
 
-    AutoHINTERNET hSession =
-                WinHttpOpen(
-                    _T("Mozilla/4.0 (compatible; MSIE 5.22)"),
-                    proxyHost.length() ? WINHTTP_ACCESS_TYPE_NAMED_PROXY : WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-                    proxyHost.length() ? proxyHost.c_str() : WINHTTP_NO_PROXY_NAME,
-                    WINHTTP_NO_PROXY_BYPASS,
-                    WINHTTP_FLAG_ASYNC);
-
-    if (NULL == hSession)
-    {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpOpen failed (%d)"), GetLastError());
-        return false;
-    }
-
-    if (FALSE == WinHttpSetTimeouts(hSession, 0, HTTPS_REQUEST_CONNECT_TIMEOUT_MS,
-                            HTTPS_REQUEST_SEND_TIMEOUT_MS, HTTPS_REQUEST_RECEIVE_TIMEOUT_MS))
-    {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpSetTimeouts failed (%d)"), GetLastError());
-        return false;
-    }
-
-    // SSLv3, TLSv1.0, TLSv1.1 all have security flaws that mean that should be avoided.
-    // Some of those flaws (like SSLv3's POODLE http://cve.mitre.org/cgi-bin/cvename.cgi?name=CVE-2014-3566)
-    // require the client side to not try to use them. So we're going to force use of
-    // TLS v1.2. We'll try to remember to update these flags when new TLS versions come
-    // out; we think it's too risky to set all bits except the bad ones (like ~(SSL|TLS1.0|TLS1.1)),
-    // as we might get something we don't want.
-    // When WinHttpSetOption gets flags it doesn't understand -- like WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2
-    // on XP and Vista -- it returns FALSE and sets errno to ERROR_INVALID_PARAMETER (87). When
-    // that happens we'll fall back to the URL proxy. That's why we're _not_ going
-    // to set the HTTPS protocol for URL proxy requests (and it's HTTP, not HTTPS).
-    DWORD dwProtocols = WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2;
-    if (!useURLProxy)
-    {
-        if (FALSE == WinHttpSetOption(
-            hSession,
-            WINHTTP_OPTION_SECURE_PROTOCOLS,
-            &dwProtocols,
-            sizeof(DWORD)))
+    // With a session, the connection is kept for later requests -- unless
+    // this one fails, in which case it may be the connection's fault.
+    bool keepAlive = m_session != NULL && !useURLProxy;
+    bool requestSucceeded = false;
+    auto sessionExit = finally([&] {
+        if (keepAlive)
         {
-            my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpSetOption WINHTTP_OPTION_SECURE_PROTOCOLS failed (%d)"), GetLastError());
-            return false;
+            if (requestSucceeded)
+            {
+                m_session->Touch();
+            }
+            else
+            {
+                m_session->Close();
+            }
         }
-    }
+    });
 
-    AutoHINTERNET hConnect =
-            WinHttpConnect(
-                hSession,
-                serverAddress,
-                (INTERNET_PORT)serverWebPort,
-                0);
+    shared_ptr<HTTPSSession::Connection> connection =
+        keepAlive
+        ? m_session->Acquire(proxyHost, serverAddress, serverWebPort, m_silentMode)
+        : HTTPSSession::Open(proxyHost, serverAddress, serverWebPort, useURLProxy, m_silentMode);
 
-    if (NULL == hConnect)
+    if (!connection)
     {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpConnect failed (%d)"), GetLastError());
         return false;
     }
 
+    HINTERNET hConnect = connection->connect;
+
     if (!httpVerb)
     {
         httpVerb = additionalData ? _T("POST") : _T("GET");
@@ -573,6 +744,14 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
         return false;
     }
 
+    if (keepAlive)
+    {
+        // Not supported before Windows 10 1607, or by every server; either way
+        // HTTP/1.1 is used, so failure is ignored.
+        DWORD dwHttpProtocols = WINHTTP_PROTOCOL_FLAG_HTTP2;
+        (void)WinHttpSetOption(hRequest, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &dwHttpProtocols, sizeof(DWORD));
+    }
+
     if (WINHTTP_INVALID_STATUS_CALLBACK == WinHttpSetStatusCallback(
                                                 hRequest,
                                                 WinHttpStatusCallback,
@@ -602,9 +781,10 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
     // For example, PsiCash's ELB idle connection timeout was 60 seconds. So
     // any repeat PsiCash request made between 30 and 60 seconds of the
     // previous one would result in a hard error (not retried anywhere).
-    // We're going to specify Connection:close in all our requests to avoid
-    // this problem.
-    wstring headers = L"Connection: close\r\n";
+    // We're going to specify Connection:close in requests without a session
+    // to avoid this problem; sessions instead discard connections well before
+    // that (see HTTPSSession).
+    wstring headers = keepAlive ? L"" : L"Connection: close\r\n";
     if (additionalHeaders)
     {
         headers += additionalHeaders;
@@ -614,6 +794,12 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
     m_expectedServerCertificate = webServerCertificate;
     m_requestSuccess = false;
     m_response = Response();
+    m_streamBody = false;
+    m_readDeferred = false;
+    if (m_bodySink)
+    {
+        m_bodySink->Reset();
+    }
 
     if (FALSE == WinHttpSendRequest(
                     hRequest,
@@ -634,7 +820,18 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
 
     while (true)
     {
-        DWORD result = WaitForSingleObject(m_closedEvent, 100);
+        DWORD waitMs = 100;
+        if (TakeDueRead(waitMs))
+        {
+            if (!WinHttpQueryDataAvailable(hRequest, 0))
+            {
+                my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpQueryDataAvailable failed (%d)"), GetLastError());
+                hRequest.WinHttpCloseHandle();
+            }
+            continue;
+        }
+
+        DWORD result = WaitForSingleObject(m_closedEvent, waitMs);
 
         if (result == WAIT_TIMEOUT)
         {
@@ -671,16 +868,24 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
     {
         response = std::move(m_response);
         m_response = Response();
+        requestSucceeded = true;
         return true;
     }
 
     return false;
 }
 
-void HTTPSRequest::ResponseAppendBody(const string& responseData)
+bool HTTPSRequest::ResponseAppendBody(const char* data, size_t length)
 {
     AutoMUTEX lock(m_mutex);
-    m_response.body.append(responseData);
+
+    if (m_streamBody)
+    {
+        return m_bodySink->Write(data, length);
+    }
+
+    m_response.body.append(data, length);
+    return true;
 }
 
 void HTTPSRequest::ResponseSetCode(int code)
@@ -695,6 +900,49 @@ void HTTPSRequest::ResponseSetHeaders(const std::map<std::string, std::vector<st
     m_response.headers = headers;
 }
 
+void HTTPSRequest::ResponseBeginBody()
+{
+    AutoMUTEX lock(m_mutex);
+    m_streamBody = m_bodySink && m_bodySink->Accept(m_response.code, m_response.headers);
+}
+
+bool HTTPSRequest::DeferRead()
+{
+    AutoMUTEX lock(m_mutex);
+
+    DWORD delay = m_streamBody ? m_bodySink->ReadDelay() : 0;
+    if (delay == 0)
+    {
+        return false;
+    }
+
+    m_readDeferred = true;
+    m_readDeferredTime = GetTickCount();
+    m_readDelay = delay;
+    return true;
+}
+
+bool HTTPSRequest::TakeDueRead(DWORD& io_waitMs)
+{
+    AutoMUTEX lock(m_mutex);
+
+    if (!m_readDeferred)
+    {
+        return false;
+    }
+
+    // Unsigned arithmetic is correct across a GetTickCount wrap
+    DWORD elapsed = GetTickCount() - m_readDeferredTime;
+    if (elapsed >= m_readDelay)
+    {
+        m_readDeferred = false;
+        return true;
+    }
+
+    io_waitMs = min(io_waitMs, m_readDelay - elapsed);
+    return false;
+}
+
 bool HTTPSRequest::ValidateServerCert(PCCERT_CONTEXT pCert)
 {
     AutoMUTEX lock(m_mutex);
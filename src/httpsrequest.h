@@ -27,6 +27,101 @@
 
 using namespace std;
 
+
+// Receives the body of a response as it arrives, instead of it being
+// accumulated in HTTPSRequest::Response::body.
+// Called from a WinHTTP callback thread.
+class IHTTPSResponseBodySink
+{
+public:
+    // Called before each request attempt. Anything received from a previous
+    // attempt (e.g., before failing over to the URL proxy) must be discarded.
+    virtual void Reset() = 0;
+
+    // Called once the status code and headers are available. Return true to
+    // have the body passed to Write, or false to have it accumulated in
+    // Response::body as usual (e.g., for error responses).
+    virtual bool Accept(int code, const map<string, vector<string>>& headers) = 0;
+
+    // Returns false to abort the request.
+    virtual bool Write(const char* data, size_t length) = 0;
+
+    // Called after each successful Write. Returns how long to wait, in
+    // milliseconds, before reading more of the body (e.g., to limit the
+    // download rate), or 0 to read on immediately. The wait is done by the
+    // thread making the request, not the WinHTTP callback thread.
+    virtual DWORD ReadDelay() = 0;
+};
+
+
+/**
+HTTPSSession keeps a WinHTTP session -- and with it, its pool of keep-alive
+connections -- open across the HTTPSRequests it's given to, so that a burst of
+requests to the same server doesn't pay for a new proxied TLS connection each
+time. HTTP/2 is requested where the OS and server support it, which lets
+requests share a connection rather than queue for one.
+
+The session is reopened when the server, port, or proxy changes; after a
+failed request; and when it has been idle for HTTPS_SESSION_IDLE_TIMEOUT_MS,
+since the local proxy drops idle connections and WinHTTP won't retry a request
+sent on one.
+
+Thread safe. Not used for URL proxy requests.
+*/
+class HTTPSSession
+{
+public:
+    HTTPSSession();
+    virtual ~HTTPSSession();
+
+    // Closes the session. Requests already using it are unaffected.
+    void Close();
+
+private:
+    // not copyable
+    HTTPSSession(HTTPSSession const&);
+    HTTPSSession& operator=(HTTPSSession const&);
+
+    friend class HTTPSRequest;
+
+    // A WinHTTP session and connect handle pair. Closed when the last
+    // request using it is done.
+    struct Connection
+    {
+        HINTERNET session;
+        HINTERNET connect;
+
+        Connection() : session(NULL), connect(NULL) {}
+        ~Connection();
+    };
+
+    // Opens a new, unshared Connection. Returns null on failure.
+    static shared_ptr<Connection> Open(
+        const tstring& proxyHost,
+        const TCHAR* serverAddress,
+        int serverWebPort,
+        bool useURLProxy,
+        bool silentMode);
+
+    // Returns the shared Connection, opening a new one if necessary.
+    shared_ptr<Connection> Acquire(
+        const tstring& proxyHost,
+        const TCHAR* serverAddress,
+        int serverWebPort,
+        bool silentMode);
+
+    // Marks the session as used now.
+    void Touch();
+
+    HANDLE m_mutex;
+    shared_ptr<Connection> m_connection;
+    tstring m_proxyHost;
+    tstring m_serverAddress;
+    int m_serverWebPort;
+    DWORD m_lastUsedTicks;
+};
+
+
 class HTTPSRequest
 {
 public:
@@ -39,13 +134,25 @@ public:
     };
 
     // HTTP status code for "OK". This will save us using the magic number everywhere,
-    // but we're not going to provide aliases for any other codes.
+    // but we're not going to provide aliases for any other codes...
     static constexpr int OK = 200;
+    // ...except for the ones needed to resume downloads.
+    static constexpr int PARTIAL_CONTENT = 206;
+    static constexpr int RANGE_NOT_SATISFIABLE = 416;
 
 public:
     HTTPSRequest(bool silentMode=false);
     virtual ~HTTPSRequest();
 
+    // If set, response bodies accepted by the sink are streamed to it and
+    // Response::body is left empty. The sink must outlive the request.
+    void SetResponseBodySink(IHTTPSResponseBodySink* sink) {m_bodySink = sink;}
+
+    // If set, requests (other than URL proxy requests) use the session's
+    // keep-alive connections instead of a new connection that is closed after
+    // the request. The session must outlive the request.
+    void SetSession(HTTPSSession* session) {m_session = session;}
+
     enum class PsiphonProxy {
         DONT_USE = 0,
         USE,
@@ -75,9 +182,16 @@ private:
     void SetClosedEvent() {SetEvent(m_closedEvent);}
     void SetRequestSuccess() {m_requestSuccess = true;}
     bool ValidateServerCert(PCCERT_CONTEXT pCert);
-    void ResponseAppendBody(const string& responseData);
+    bool ResponseAppendBody(const char* data, size_t length);
     void ResponseSetCode(int code);
     void ResponseSetHeaders(const std::map<std::string, std::vector<std::string>>& headers);
+    void ResponseBeginBody();
+    // Returns true if the body sink wants the next read delayed; the read is
+    // then issued by the MakeRequest wait loop once TakeDueRead says so.
+    bool DeferRead();
+    // Returns true, once, when a deferred read is due. Otherwise lowers
+    // io_waitMs to the time remaining until it is.
+    bool TakeDueRead(DWORD& io_waitMs);
 
     bool MakeRequestWithURLProxyOption(
         const TCHAR* serverAddress,
@@ -107,4 +221,10 @@ private:
     bool m_requestSuccess;
     string m_expectedServerCertificate;
     Response m_response;
+    IHTTPSResponseBodySink* m_bodySink;
+    bool m_streamBody;
+    bool m_readDeferred;
+    DWORD m_readDeferredTime;
+    DWORD m_readDelay;
+    HTTPSSession* m_session;
 };
@@ -26,11 +26,21 @@
 #include "systemproxysettings.h"
 #include "usersettings.h"
 #include "config.h"
+#include "traffic_meter.h"
+#include "span_tracer.h"
 #include <Shlwapi.h>
+#include <atomic>
 
 
 #define POLIPO_CONNECTION_TIMEOUT_SECONDS   20
 
+// Polipo logs this, followed by the port and a ".", once it's listening.
+// It's an L_INFO (0x4) message, and polipo's log goes to its (unbuffered)
+// stderr, so it reaches our pipe as soon as it's written.
+#define POLIPO_READY_MESSAGE                "Established listening socket on port "
+// L_ERROR | L_INFO
+#define POLIPO_LOG_LEVEL                    5
+
 
 LocalProxy::LocalProxy(
                 ILocalProxyStatsCollector* statsCollector,
@@ -88,6 +98,8 @@ void LocalProxy::UpdateSessionInfo(const SessionInfo& sessionInfo)
 
 bool LocalProxy::DoStart()
 {
+    ScopedSpan span("LocalProxy::DoStart");
+
     // Ensure we start from a disconnected/clean state
     Cleanup(false);
 
@@ -304,7 +316,7 @@ bool LocalProxy::StartPolipo(int localHttpProxyPort)
                       // Polipo is now built with -DNO_DISK_CACHE
                       // << _T(" diskCacheRoot=\"\"")
                       << _T(" disableLocalInterface=true")
-                      << _T(" logLevel=1");
+                      << _T(" logLevel=") << POLIPO_LOG_LEVEL;
 
     // Use the parent proxy, if one is available for the current transport
     // also do split tunneling if there is a parent proxy
@@ -376,25 +388,127 @@ bool LocalProxy::StartPolipo(int localHttpProxyPort)
         return false;
     }
 
-    WaitForInputIdle(m_polipoProcessInfo.hProcess, 5000);
+    return WaitForPolipoReady(localHttpProxyPort);
+}
+
+
+struct PolipoStartupOutput
+{
+    HANDLE pipe;
+    string readyMessage;
+    string output;
+    std::atomic<bool> ready;
+    std::atomic<bool> stop;
+};
+
+static DWORD WINAPI PolipoStartupReaderThread(void* data)
+{
+    PolipoStartupOutput* startup = (PolipoStartupOutput*)data;
+
+    char buffer[512];
+    while (!startup->stop)
+    {
+        // Fails when polipo exits (closing the pipe) or the read is cancelled
+        DWORD read = 0;
+        if (!ReadFile(startup->pipe, buffer, sizeof(buffer), &read, NULL) || read == 0)
+        {
+            break;
+        }
+
+        startup->output.append(buffer, read);
+        if (startup->output.find(startup->readyMessage) != string::npos)
+        {
+            startup->ready = true;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// Waits for polipo to say that it's listening, for it to exit, or for a stop
+// signal (which throws Abort), whichever comes first.
+// Returns true if polipo is ready.
+bool LocalProxy::WaitForPolipoReady(int localHttpProxyPort)
+{
+    PolipoStartupOutput startup;
+    startup.pipe = m_polipoPipe;
+    startup.ready = false;
+    startup.stop = false;
+
+    stringstream readyMessage;
+    readyMessage << POLIPO_READY_MESSAGE << localHttpProxyPort << ".";
+    startup.readyMessage = readyMessage.str();
+
+    AutoHANDLE stopEvent = CreateEvent(NULL, TRUE, FALSE, 0);
+    if (!stopEvent)
+    {
+        std::stringstream s;
+        s << __FUNCTION__ << ": CreateEvent failed (" << GetLastError() << ")";
+        throw Error(s.str().c_str());
+    }
+
+    m_stopInfo.stopSignal->RegisterStopEvent(stopEvent, m_stopInfo.stopReasons);
+    auto unregisterStopEvent = finally([&] { m_stopInfo.stopSignal->UnregisterStopEvent(stopEvent); });
+
+    DWORD result;
+    {
+        AutoHANDLE readerThread = CreateThread(0, 0, PolipoStartupReaderThread, (void*)&startup, 0, 0);
+        if (!readerThread)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s - CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
+            return false;
+        }
+
+        // The reader must be done with the pipe and `startup` before we go on.
+        // The cancel is retried in case the reader wasn't yet blocked in ReadFile.
+        auto stopReader = finally([&] {
+            startup.stop = true;
+            while (WAIT_TIMEOUT == WaitForSingleObject(readerThread, 10))
+            {
+                CancelSynchronousIo(readerThread);
+            }
+        });
 
-    DWORD connected = WaitForConnectability(
-                        (USHORT)localHttpProxyPort,
-                        POLIPO_CONNECTION_TIMEOUT_SECONDS*1000,
-                        m_polipoProcessInfo.hProcess,
-                        m_stopInfo);
+        HANDLE waitHandles[] = { readerThread, m_polipoProcessInfo.hProcess, stopEvent };
+        result = WaitForMultipleObjects(
+                    sizeof(waitHandles)/sizeof(HANDLE), waitHandles, FALSE, POLIPO_CONNECTION_TIMEOUT_SECONDS*1000);
+    }
 
-    if (ERROR_OPERATION_ABORTED == connected)
+    if (result == WAIT_OBJECT_0 + 2
+        || m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, false))
     {
         throw Abort();
     }
-    else if (ERROR_SUCCESS != connected)
+
+    if (startup.ready)
+    {
+        // Anything polipo wrote after the ready message is regular output
+        size_t readyEnd = startup.output.find(startup.readyMessage) + startup.readyMessage.length();
+        if (m_statsCollector && readyEnd < startup.output.length())
+        {
+            ParsePolipoStatsBuffer(startup.output.c_str() + readyEnd);
+        }
+        return true;
+    }
+
+    if (result == WAIT_TIMEOUT)
     {
-        my_print(NOT_SENSITIVE, false, _T("Failed to start the HTTP proxy (%d, %d)"), connected, GetLastError());
-        return false;
+        // No ready message, but polipo is still running. In case this polipo
+        // doesn't log it, see if it's accepting connections.
+        my_print(NOT_SENSITIVE, true, _T("%s - no ready message from polipo"), __TFUNCTION__);
+        if (ERROR_SUCCESS == WaitForConnectability(
+                                (USHORT)localHttpProxyPort,
+                                100,
+                                m_polipoProcessInfo.hProcess,
+                                m_stopInfo))
+        {
+            return true;
+        }
     }
 
-    return true;
+    my_print(NOT_SENSITIVE, false, _T("Failed to start the HTTP proxy (%d, %d)"), result, GetLastError());
+    return false;
 }
 
 
@@ -546,14 +660,15 @@ void LocalProxy::UpsertPageView(const string& entry)
 
     string store_entry = "(OTHER)";
 
-    for (unsigned int i = 0; i < m_pageViewRegexes.size(); i++)
+    for (unsigned int i = 0; m_pageViewRegexes && i < m_pageViewRegexes->size(); i++)
     {
-        if (regex_match(entry, m_pageViewRegexes[i].regex))
+        const RegexReplace& rx_re = (*m_pageViewRegexes)[i];
+        if (regex_match(entry, rx_re.regex))
         {
             store_entry = regex_replace(
                             entry,
-                            m_pageViewRegexes[i].regex,
-                            m_pageViewRegexes[i].replace);
+                            rx_re.regex,
+                            rx_re.replace);
             break;
         }
     }
@@ -592,14 +707,15 @@ void LocalProxy::UpsertHttpsRequest(string entry)
 
     string store_entry = "(OTHER)";
 
-    for (unsigned int i = 0; i < m_httpsRequestRegexes.size(); i++)
+    for (unsigned int i = 0; m_httpsRequestRegexes && i < m_httpsRequestRegexes->size(); i++)
     {
-        if (regex_match(entry, m_httpsRequestRegexes[i].regex))
+        const RegexReplace& rx_re = (*m_httpsRequestRegexes)[i];
+        if (regex_match(entry, rx_re.regex))
         {
             store_entry = regex_replace(
                             entry,
-                            m_httpsRequestRegexes[i].regex,
-                            m_httpsRequestRegexes[i].replace);
+                            rx_re.regex,
+                            rx_re.replace);
             break;
         }
     }
@@ -702,6 +818,7 @@ void LocalProxy::ParsePolipoStatsBuffer(const char* page_view_buffer)
             if (bytes > 0)
             {
                 m_bytesTransferred += bytes;
+                TunneledTrafficMeter::Instance().Add(bytes);
             }
         }
         else if (next == unproxied_start)
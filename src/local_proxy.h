@@ -20,9 +20,8 @@
 #pragma once
 
 #include "worker_thread.h"
+#include "sessioninfo.h"
 
-class SessionInfo;
-struct RegexReplace;
 class SystemProxySettings;
 
 
@@ -66,6 +65,7 @@ protected:
     void Cleanup(bool doStats);
 
     bool StartPolipo(int localHttpProxyPort);
+    bool WaitForPolipoReady(int localHttpProxyPort);
     bool CreatePolipoPipe(HANDLE& o_outputPipe, HANDLE& o_errorPipe);
     bool ProcessStatsAndStatus(bool final);
     void UpsertPageView(const string& entry);
@@ -85,8 +85,8 @@ private:
     map<string, int> m_pageViewEntries;
     map<string, int> m_httpsRequestEntries;
     unsigned long long m_bytesTransferred;
-    vector<RegexReplace> m_pageViewRegexes;
-    vector<RegexReplace> m_httpsRequestRegexes;
+    RegexReplaceSet m_pageViewRegexes;
+    RegexReplaceSet m_httpsRequestRegexes;
     bool m_finalStatsSent;
     string m_serverAddress;
     map<string, bool> m_reportedUnproxiedDomains;
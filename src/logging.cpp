@@ -21,6 +21,7 @@
 #include "utilities.h"
 #include "psiclient.h"
 #include "logging.h"
+#include "timestamp.h"
 
 
 /*
@@ -86,7 +87,7 @@ void AddMessageEntryToHistory(
     {
         MessageHistoryEntry entry;
         entry.message = historicalMessage;
-        entry.timestamp = GetISO8601DatetimeString();
+        entry.timestamp = GetTimestamp();
         entry.debug = bDebugMessage;
         g_messageHistory.push_back(entry);
     }
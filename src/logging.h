@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include "timestamp.h"
+
 enum LogSensitivity
 {
     /**
@@ -45,7 +47,7 @@ void my_print(LogSensitivity sensitivity, bool bDebugMessage, const string& mess
 struct MessageHistoryEntry
 {
     tstring message;
-    tstring timestamp;
+    Timestamp timestamp;  // formatted when exported
     bool debug;
 };
 
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "metrics.h"
+#include "utilities.h"
+
+
+/***********************************************************************
+ MetricCounter
+ */
+
+// Each thread is assigned a stripe round-robin on its first increment
+static std::atomic<unsigned int> g_nextCounterStripe(0);
+static thread_local int t_counterStripe = -1;
+
+MetricCounter::MetricCounter()
+{
+    for (size_t i = 0; i < STRIPES; i++)
+    {
+        m_stripes[i].value = 0;
+    }
+}
+
+void MetricCounter::Add(unsigned long long amount/*=1*/)
+{
+    if (t_counterStripe < 0)
+    {
+        t_counterStripe = (int)(g_nextCounterStripe++ % STRIPES);
+    }
+    m_stripes[t_counterStripe].value.fetch_add(amount, std::memory_order_relaxed);
+}
+
+unsigned long long MetricCounter::Value() const
+{
+    unsigned long long total = 0;
+    for (size_t i = 0; i < STRIPES; i++)
+    {
+        total += m_stripes[i].value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+
+/***********************************************************************
+ MetricHistogram
+ */
+
+static unsigned int HighestSetBit(unsigned long long value)
+{
+    // _BitScanReverse64 isn't available in 32-bit builds
+    unsigned long index = 0;
+    if (value >> 32)
+    {
+        _BitScanReverse(&index, (unsigned long)(value >> 32));
+        return index + 32;
+    }
+    _BitScanReverse(&index, (unsigned long)value);
+    return index;
+}
+
+MetricHistogram::MetricHistogram()
+    : m_count(0),
+      m_sum(0),
+      m_max(0)
+{
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        m_buckets[i] = 0;
+    }
+}
+
+// static
+size_t MetricHistogram::BucketIndex(unsigned long long value)
+{
+    if (value < LINEAR_BUCKETS)
+    {
+        return (size_t)value;
+    }
+
+    // value >= 32, so the exponent is at least 5; the 4 bits below the
+    // highest set bit select the sub-bucket.
+    unsigned int exponent = HighestSetBit(value);
+    size_t subBucket = (size_t)((value >> (exponent - 4)) & (SUB_BUCKETS - 1));
+    return LINEAR_BUCKETS + (exponent - 5) * SUB_BUCKETS + subBucket;
+}
+
+// static
+unsigned long long MetricHistogram::BucketValue(size_t index)
+{
+    if (index < LINEAR_BUCKETS)
+    {
+        return index;
+    }
+
+    // The midpoint of the bucket's range
+    unsigned int exponent = (unsigned int)((index - LINEAR_BUCKETS) / SUB_BUCKETS) + 5;
+    unsigned long long subBucket = (index - LINEAR_BUCKETS) % SUB_BUCKETS;
+    unsigned long long width = 1ULL << (exponent - 4);
+    return ((SUB_BUCKETS + subBucket) << (exponent - 4)) + width / 2;
+}
+
+void MetricHistogram::Record(unsigned long long value)
+{
+    m_buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+
+    unsigned long long maxValue = m_max.load(std::memory_order_relaxed);
+    while (value > maxValue && !m_max.compare_exchange_weak(maxValue, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+Json::Value MetricHistogram::Snapshot() const
+{
+    // Concurrent recording may make the bucket total differ slightly from
+    // m_count; percentiles are computed against the bucket total.
+    vector<unsigned long long> buckets(BUCKETS);
+    unsigned long long total = 0;
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += buckets[i];
+    }
+
+    const double quantiles[] = { 0.5, 0.9, 0.99 };
+    const char* names[] = { "p50", "p90", "p99" };
+    unsigned long long values[] = { 0, 0, 0 };
+
+    size_t q = 0;
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < BUCKETS && q < 3 && total > 0; i++)
+    {
+        seen += buckets[i];
+        while (q < 3 && seen >= (unsigned long long)(quantiles[q] * total + 0.5) && seen > 0)
+        {
+            values[q++] = BucketValue(i);
+        }
+    }
+
+    unsigned long long maxValue = m_max.load(std::memory_order_relaxed);
+
+    Json::Value json(Json::objectValue);
+    json["count"] = (Json::UInt64)m_count.load(std::memory_order_relaxed);
+    json["sum"] = (Json::UInt64)m_sum.load(std::memory_order_relaxed);
+    json["max"] = (Json::UInt64)maxValue;
+    for (size_t i = 0; i < 3; i++)
+    {
+        // A bucket midpoint can overshoot the largest recorded value
+        json[names[i]] = (Json::UInt64)min(values[i], maxValue);
+    }
+    return json;
+}
+
+
+/***********************************************************************
+ MetricsRegistry
+ */
+
+MetricsRegistry& MetricsRegistry::Instance()
+{
+    static MetricsRegistry instance;
+    return instance;
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+    m_mutex = CreateMutex(NULL, FALSE, 0);
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+    CloseHandle(m_mutex);
+}
+
+MetricCounter& MetricsRegistry::Counter(const char* name)
+{
+    AutoMUTEX lock(m_mutex);
+    auto& instrument = m_counters[name];
+    if (!instrument)
+    {
+        instrument.reset(new MetricCounter());
+    }
+    return *instrument;
+}
+
+MetricGauge& MetricsRegistry::Gauge(const char* name)
+{
+    AutoMUTEX lock(m_mutex);
+    auto& instrument = m_gauges[name];
+    if (!instrument)
+    {
+        instrument.reset(new MetricGauge());
+    }
+    return *instrument;
+}
+
+MetricHistogram& MetricsRegistry::Histogram(const char* name)
+{
+    AutoMUTEX lock(m_mutex);
+    auto& instrument = m_histograms[name];
+    if (!instrument)
+    {
+        instrument.reset(new MetricHistogram());
+    }
+    return *instrument;
+}
+
+Json::Value MetricsRegistry::Snapshot() const
+{
+    Json::Value counters(Json::objectValue);
+    Json::Value gauges(Json::objectValue);
+    Json::Value histograms(Json::objectValue);
+
+    {
+        AutoMUTEX lock(m_mutex);
+
+        for (auto it = m_counters.begin(); it != m_counters.end(); ++it)
+        {
+            counters[it->first] = (Json::UInt64)it->second->Value();
+        }
+
+        for (auto it = m_gauges.begin(); it != m_gauges.end(); ++it)
+        {
+            gauges[it->first] = (Json::Int64)it->second->Value();
+        }
+
+        for (auto it = m_histograms.begin(); it != m_histograms.end(); ++it)
+        {
+            histograms[it->first] = it->second->Snapshot();
+        }
+    }
+
+    Json::Value json(Json::objectValue);
+    json["counters"] = counters;
+    json["gauges"] = gauges;
+    json["histograms"] = histograms;
+    return json;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+
+/**
+MetricCounter is a monotonically increasing count. Increments are spread
+across cache-line-sized stripes, chosen per thread, so that concurrent
+increments from different threads don't contend. Reading sums the stripes.
+*/
+class MetricCounter
+{
+public:
+    MetricCounter();
+
+    void Add(unsigned long long amount = 1);
+    unsigned long long Value() const;
+
+private:
+    static const size_t STRIPES = 16;
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    // Padded rather than alignas'd: counters are heap-allocated, and
+    // operator new doesn't honour over-alignment before C++17 (C4316). The
+    // values are a cache line apart, so no two of them share a line.
+    struct Stripe
+    {
+        std::atomic<unsigned long long> value;
+        char padding[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned long long>)];
+    };
+
+    Stripe m_stripes[STRIPES];
+};
+
+/**
+MetricGauge is a value that can go up and down, e.g., a queue depth.
+*/
+class MetricGauge
+{
+public:
+    MetricGauge() : m_value(0) {}
+
+    void Set(long long value) { m_value.store(value, std::memory_order_relaxed); }
+    void Add(long long amount) { m_value.fetch_add(amount, std::memory_order_relaxed); }
+    long long Value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<long long> m_value;
+};
+
+/**
+MetricHistogram records a distribution of non-negative values (typically
+latencies in milliseconds) into HDR-style log-linear buckets: values below 32
+are counted exactly, and each power of two above that is split into 16 linear
+sub-buckets, so percentiles are within ~6% of the true value. Recording is a
+few relaxed atomic operations and never allocates.
+*/
+class MetricHistogram
+{
+public:
+    MetricHistogram();
+
+    void Record(unsigned long long value);
+
+    // {"count", "sum", "max", "p50", "p90", "p99"}
+    Json::Value Snapshot() const;
+
+private:
+    static const size_t LINEAR_BUCKETS = 32;
+    static const size_t SUB_BUCKETS = 16;
+    static const size_t BUCKETS = LINEAR_BUCKETS + (64 - 5) * SUB_BUCKETS;
+
+    static size_t BucketIndex(unsigned long long value);
+    static unsigned long long BucketValue(size_t index);
+
+    std::atomic<unsigned long long> m_buckets[BUCKETS];
+    std::atomic<unsigned long long> m_count;
+    std::atomic<unsigned long long> m_sum;
+    std::atomic<unsigned long long> m_max;
+};
+
+/**
+MetricsRegistry holds the named instruments registered by each subsystem.
+Instruments live for the life of the process, so callers can keep the
+returned reference, e.g.:
+
+    static MetricCounter& reconnects = MetricsRegistry::Instance().Counter("connection.reconnects");
+    reconnects.Add();
+
+Getting an instrument by a name that's already registered returns the
+existing instrument.
+*/
+class MetricsRegistry
+{
+public:
+    static MetricsRegistry& Instance();
+
+    MetricCounter& Counter(const char* name);
+    MetricGauge& Gauge(const char* name);
+    MetricHistogram& Histogram(const char* name);
+
+    // {"counters": {name: value, ...}, "gauges": {...}, "histograms": {name: {...}, ...}}
+    Json::Value Snapshot() const;
+
+private:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    // not copyable
+    MetricsRegistry(MetricsRegistry const&);
+    MetricsRegistry& operator=(MetricsRegistry const&);
+
+    HANDLE m_mutex;
+    map<string, unique_ptr<MetricCounter>> m_counters;
+    map<string, unique_ptr<MetricGauge>> m_gauges;
+    map<string, unique_ptr<MetricHistogram>> m_histograms;
+};
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "notice_recording.h"
+#include "diagnostic_info.h"
+#include "logging.h"
+#include "metrics.h"
+#include "stopsignal.h"
+#include "utilities.h"
+
+
+static unsigned long long ElapsedMicroseconds(const LARGE_INTEGER& start, const LARGE_INTEGER& frequency)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart - start.QuadPart) * 1000000ULL / (unsigned long long)frequency.QuadPart;
+}
+
+
+/***********************************************************************
+NoticeRecorder
+*/
+
+NoticeRecorder::NoticeRecorder(const tstring& filename)
+    : m_file(INVALID_HANDLE_VALUE)
+{
+    QueryPerformanceFrequency(&m_frequency);
+    QueryPerformanceCounter(&m_start);
+
+    m_file = CreateFile(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CreateFile failed (%d)"), __TFUNCTION__, GetLastError());
+        return;
+    }
+
+    my_print(NOT_SENSITIVE, true, _T("%s: recording to %s"), __TFUNCTION__, filename.c_str());
+}
+
+NoticeRecorder::~NoticeRecorder()
+{
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_file);
+    }
+}
+
+void NoticeRecorder::Record(const string& noticeType, const string& line)
+{
+    if (m_file == INVALID_HANDLE_VALUE || PsiphonTunnelCore::NoticeIsPrivate(noticeType))
+    {
+        return;
+    }
+
+    // The line has already been parsed, so the entry is written directly
+    // rather than through a Json::Value.
+    ostringstream entry;
+    entry << "{\"t\":" << ElapsedMicroseconds(m_start, m_frequency)
+          << ",\"line\":" << Json::valueToQuotedString(line.c_str()) << "}\n";
+    string entryJSON = entry.str();
+
+    DWORD written = 0;
+    if (!WriteFile(m_file, entryJSON.c_str(), (DWORD)entryJSON.length(), &written, NULL)
+        || written != entryJSON.length())
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: WriteFile failed (%d); recording stopped"), __TFUNCTION__, GetLastError());
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+}
+
+// static
+void NoticeRecorder::DeleteRecordings(const filesystem::path& dir)
+{
+    tstring pattern = dir / (tstring(NOTICE_RECORDING_FILENAME_PREFIX) + _T("*.jsonl"));
+
+    WIN32_FIND_DATA findData;
+    HANDLE find = FindFirstFile(pattern.c_str(), &findData);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        tstring path = dir / findData.cFileName;
+        if (!DeleteFile(path.c_str()))
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: DeleteFile failed (%d)"), __TFUNCTION__, GetLastError());
+        }
+    } while (FindNextFile(find, &findData));
+
+    FindClose(find);
+}
+
+
+/***********************************************************************
+NoticeReplay
+*/
+
+// A PsiphonTunnelCore with no core process, whose notices aren't recorded or
+// passed to the UI, the log or diagnostics.
+class ReplayTunnelCore : public PsiphonTunnelCore
+{
+public:
+    ReplayTunnelCore(IPsiphonTunnelCoreNoticeHandler* noticeHandler)
+        : PsiphonTunnelCore(noticeHandler, _T(""), false, true)
+    {
+    }
+};
+
+// Times each replayed notice from when its line was fed in until it has been
+// handled, then passes it on. Runs on the notice thread; notices arrive in
+// the order their lines were fed in, one per line.
+class ReplayTimingHandler : public IPsiphonTunnelCoreNoticeHandler
+{
+public:
+    struct TypeStats
+    {
+        unsigned long long count;
+        unsigned long long latencyTotalUs;
+        unsigned long long latencyMaxUs;
+        TypeStats() : count(0), latencyTotalUs(0), latencyMaxUs(0) {}
+    };
+
+    ReplayTimingHandler(IPsiphonTunnelCoreNoticeHandler* next, size_t notices, const LARGE_INTEGER& start, const LARGE_INTEGER& frequency)
+        : m_next(next),
+          m_fedUs(notices, 0),
+          m_handled(0),
+          m_start(start),
+          m_frequency(frequency),
+          m_latencyTotalUs(0),
+          m_latencyMaxUs(0)
+    {
+    }
+
+    // Must be called, on the replaying thread, before the line for notice
+    // `index` is fed in. The notice queue orders this before the notice
+    // thread reads it.
+    void SetFed(size_t index, unsigned long long fedUs) { m_fedUs[index] = fedUs; }
+
+    void HandlePsiphonTunnelCoreNotice(const string& noticeType, const string& timestamp, const Json::Value& data)
+    {
+        static MetricHistogram& latency = MetricsRegistry::Instance().Histogram("notice.latency_us");
+
+        auto recordLatency = finally([&] {
+            if (m_handled >= m_fedUs.size())
+            {
+                return;
+            }
+
+            unsigned long long latencyUs = ElapsedMicroseconds(m_start, m_frequency) - m_fedUs[m_handled++];
+            latency.Record(latencyUs);
+            m_latencyTotalUs += latencyUs;
+            m_latencyMaxUs = max(m_latencyMaxUs, latencyUs);
+
+            TypeStats& stats = m_typeStats[noticeType];
+            stats.count++;
+            stats.latencyTotalUs += latencyUs;
+            stats.latencyMaxUs = max(stats.latencyMaxUs, latencyUs);
+        });
+
+        if (m_next)
+        {
+            m_next->HandlePsiphonTunnelCoreNotice(noticeType, timestamp, data);
+        }
+    }
+
+    // Only valid once the replayed notices have been handled
+    unsigned long long LatencyTotalUs() const { return m_latencyTotalUs; }
+    unsigned long long LatencyMaxUs() const { return m_latencyMaxUs; }
+    const map<string, TypeStats>& GetTypeStats() const { return m_typeStats; }
+
+private:
+    IPsiphonTunnelCoreNoticeHandler* m_next;
+    vector<unsigned long long> m_fedUs;
+    size_t m_handled;
+    LARGE_INTEGER m_start;
+    LARGE_INTEGER m_frequency;
+    unsigned long long m_latencyTotalUs;
+    unsigned long long m_latencyMaxUs;
+    map<string, TypeStats> m_typeStats;
+};
+
+
+NoticeReplay::NoticeReplay()
+{
+}
+
+// Returns true if `line` parses as a notice with `noticeReader`
+static bool IsNotice(Json::CharReader* noticeReader, const string& line)
+{
+    Json::Value notice;
+    string errors;
+    return noticeReader->parse(line.c_str(), line.c_str() + line.length(), &notice, &errors)
+        && notice.isObject()
+        && notice["noticeType"].isString();
+}
+
+bool NoticeReplay::Load(const tstring& filename)
+{
+    m_entries.clear();
+
+    AutoHANDLE file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CreateFile failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    string contents;
+    const DWORD CHUNK_SIZE = 64 * 1024;
+    unique_ptr<char[]> buffer(new char[CHUNK_SIZE]);
+    while (true)
+    {
+        DWORD read = 0;
+        if (!ReadFile(file, buffer.get(), CHUNK_SIZE, &read, NULL))
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: ReadFile failed (%d)"), __TFUNCTION__, GetLastError());
+            return false;
+        }
+        if (read == 0)
+        {
+            break;
+        }
+        contents.append(buffer.get(), read);
+    }
+
+    // Each line must be a notice, as PsiphonTunnelCore would parse it, so that
+    // replayed lines and handled notices correspond one to one.
+    Json::Reader reader;
+    unique_ptr<Json::CharReader> noticeReader(NewStrictJSONReader());
+    size_t skipped = 0;
+    size_t start = 0;
+    while (start < contents.length())
+    {
+        size_t end = contents.find('\n', start);
+        if (end == string::npos)
+        {
+            end = contents.length();
+        }
+
+        Json::Value entry;
+        if (end > start
+            && reader.parse(contents.c_str() + start, contents.c_str() + end, entry, false)
+            && entry.isObject()
+            && entry["t"].isUInt64()
+            && entry["line"].isString()
+            && IsNotice(noticeReader.get(), entry["line"].asString()))
+        {
+            Entry e;
+            e.offsetUs = entry["t"].asUInt64();
+            e.line = entry["line"].asString();
+            m_entries.push_back(e);
+        }
+        else if (end > start)
+        {
+            skipped++;
+        }
+
+        start = end + 1;
+    }
+
+    my_print(NOT_SENSITIVE, true, _T("%s: loaded %d notices (%d skipped)"), __TFUNCTION__, (int)m_entries.size(), (int)skipped);
+
+    return true;
+}
+
+Json::Value NoticeReplay::Run(IPsiphonTunnelCoreNoticeHandler* noticeHandler, double speed, const StopInfo& stopInfo) const
+{
+    static MetricHistogram& ingestTime = MetricsRegistry::Instance().Histogram("notice.ingest_time_us");
+
+    LARGE_INTEGER frequency, start;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    ReplayTimingHandler timingHandler(noticeHandler, m_entries.size(), start, frequency);
+    ReplayTunnelCore core(&timingHandler);
+    ISubprocessOutputHandler* outputHandler = &core;
+
+    unsigned long long ingestTotalUs = 0;
+    unsigned long long ingestMaxUs = 0;
+    unsigned long long maxLagUs = 0;
+    size_t notices = 0;
+
+    for (const auto& entry : m_entries)
+    {
+        if (stopInfo.stopSignal != NULL && stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons))
+        {
+            break;
+        }
+
+        if (speed > 0)
+        {
+            unsigned long long dueUs = (unsigned long long)((double)entry.offsetUs / speed);
+            unsigned long long nowUs = ElapsedMicroseconds(start, frequency);
+            if (dueUs > nowUs)
+            {
+                // Sleep in short slices so that a stop is noticed promptly
+                DWORD waitMs = (DWORD)((dueUs - nowUs) / 1000);
+                while (waitMs > 0
+                       && (stopInfo.stopSignal == NULL || !stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons)))
+                {
+                    DWORD slice = min(waitMs, (DWORD)100);
+                    Sleep(slice);
+                    waitMs -= slice;
+                }
+            }
+            else
+            {
+                maxLagUs = max(maxLagUs, nowUs - dueUs);
+            }
+        }
+
+        unsigned long long fedUs = ElapsedMicroseconds(start, frequency);
+        timingHandler.SetFed(notices, fedUs);
+        outputHandler->HandleSubprocessOutputLine(entry.line);
+        unsigned long long ingestUs = ElapsedMicroseconds(start, frequency) - fedUs;
+
+        ingestTime.Record(ingestUs);
+        ingestTotalUs += ingestUs;
+        ingestMaxUs = max(ingestMaxUs, ingestUs);
+        notices++;
+    }
+
+    // Rethrows anything the notice handler threw
+    if (!core.WaitForNoticesHandled(stopInfo, NOTICE_DRAIN_TIMEOUT_MS))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: not all replayed notices were handled"), __TFUNCTION__);
+    }
+
+    Json::Value result(Json::objectValue);
+    result["notices"] = (Json::UInt64)notices;
+    result["elapsedUs"] = (Json::UInt64)ElapsedMicroseconds(start, frequency);
+    result["maxLagUs"] = (Json::UInt64)maxLagUs;
+    result["ingest"]["totalUs"] = (Json::UInt64)ingestTotalUs;
+    result["ingest"]["maxUs"] = (Json::UInt64)ingestMaxUs;
+    result["latency"]["totalUs"] = (Json::UInt64)timingHandler.LatencyTotalUs();
+    result["latency"]["maxUs"] = (Json::UInt64)timingHandler.LatencyMaxUs();
+
+    Json::Value types(Json::objectValue);
+    for (const auto& entry : timingHandler.GetTypeStats())
+    {
+        Json::Value stats(Json::objectValue);
+        stats["count"] = (Json::UInt64)entry.second.count;
+        stats["latencyTotalUs"] = (Json::UInt64)entry.second.latencyTotalUs;
+        stats["latencyMaxUs"] = (Json::UInt64)entry.second.latencyMaxUs;
+        types[entry.first] = stats;
+    }
+    result["noticeTypes"] = types;
+
+    return result;
+}
+
+// static
+void NoticeReplay::Benchmark(const tstring& filename)
+{
+    NoticeReplay replay;
+    if (!replay.Load(filename))
+    {
+        return;
+    }
+
+    Json::Value result = replay.Run(NULL, 0, StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_EXIT));
+
+    my_print(NOT_SENSITIVE, true, _T("%s: replayed %d notices in %llu us (ingest %llu us, handling latency max %llu us)"),
+        __TFUNCTION__,
+        result["notices"].asInt(),
+        result["elapsedUs"].asUInt64(),
+        result["ingest"]["totalUs"].asUInt64(),
+        result["latency"]["maxUs"].asUInt64());
+
+    AddDiagnosticInfoJson("CoreNoticeReplay", result);
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "psiphon_tunnel_core.h"
+
+struct StopInfo;
+
+// Recordings are written to the temp directory, named
+// <prefix><pid>-<n>.jsonl
+#define NOTICE_RECORDING_FILENAME_PREFIX    _T("psiphon-core-notices-")
+
+
+/**
+NoticeRecorder appends core notices to a recording file, along with the time
+each was received. PsiphonTunnelCore passes it each notice it has parsed, so
+output that isn't a notice is never recorded. As with diagnostics, notices
+that may contain private user data (see PsiphonTunnelCore::NoticeIsPrivate)
+are not recorded.
+
+The recording is JSON Lines: one {"t": <microseconds since recording start>,
+"line": "<raw notice line>"} object per line. Each entry is written as soon as
+it is received, so a recording survives a crash.
+
+Not thread safe; called on the thread reading the core's output.
+*/
+class NoticeRecorder
+{
+public:
+    /**
+    Opens (truncating) `filename` for recording. If the file can't be opened,
+    nothing is recorded.
+    */
+    NoticeRecorder(const tstring& filename);
+    virtual ~NoticeRecorder();
+
+    bool IsRecording() const { return m_file != INVALID_HANDLE_VALUE; }
+
+    /// Records `line`, which has been parsed as a notice of type `noticeType`.
+    void Record(const string& noticeType, const string& line);
+
+    /// Deletes any recordings in `dir`.
+    static void DeleteRecordings(const filesystem::path& dir);
+
+private:
+    // not copyable
+    NoticeRecorder(NoticeRecorder const&);
+    NoticeRecorder& operator=(NoticeRecorder const&);
+
+    HANDLE m_file;
+    LARGE_INTEGER m_frequency;
+    LARGE_INTEGER m_start;
+};
+
+
+/**
+NoticeReplay loads a NoticeRecorder recording and feeds it back, line by
+line, through the ISubprocessOutputHandler of a PsiphonTunnelCore that has no
+core process. The lines go through the same parsing, notice queue and notice
+thread as live core output, and on to an IPsiphonTunnelCoreNoticeHandler, so
+notice handling can be exercised and timed without the core or a network.
+Replayed notices aren't passed to the UI, the log or diagnostics.
+*/
+class NoticeReplay
+{
+public:
+    NoticeReplay();
+
+    /**
+    Loads a recording, replacing anything previously loaded. Malformed
+    entries, and entries that aren't core notices, are skipped. Returns false
+    if the file couldn't be read.
+    */
+    bool Load(const tstring& filename);
+
+    size_t Size() const { return m_entries.size(); }
+
+    /**
+    Replays the loaded recording and waits for every notice to be handled.
+    `noticeHandler` may be NULL, to time the notice pipeline alone.
+    `speed` scales the original inter-notice gaps: 1.0 replays in real time,
+    10.0 replays ten times faster, and 0 replays with no delay at all.
+    Replay stops early if stopInfo is signalled. Exceptions thrown by
+    `noticeHandler` are rethrown once the replayed notices have been handled.
+
+    Returns replay statistics:
+    {"notices": N, "elapsedUs": N, "maxLagUs": N,
+     "ingest": {"totalUs": N, "maxUs": N},
+     "latency": {"totalUs": N, "maxUs": N},
+     "noticeTypes": {"<noticeType>": {"count": N, "latencyTotalUs": N, "latencyMaxUs": N}, ...}}
+    "ingest" is the time spent parsing and queueing each line on the replaying
+    thread; "latency" is the time from a line being fed in to its handler
+    returning, which for state-changing notices (e.g., "Tunnels") is the
+    state-transition latency. "maxLagUs" is the furthest any notice was fed in
+    behind its scaled schedule. Ingest times and latencies are also recorded
+    in the "notice.ingest_time_us" and "notice.latency_us" histograms.
+    */
+    Json::Value Run(IPsiphonTunnelCoreNoticeHandler* noticeHandler, double speed, const StopInfo& stopInfo) const;
+
+    /**
+    Loads and replays `filename` as fast as possible, with no notice handler,
+    and adds the statistics to diagnostics as "CoreNoticeReplay". Used to
+    benchmark notice handling; see Settings::CoreNoticeReplayFilename.
+    */
+    static void Benchmark(const tstring& filename);
+
+private:
+    struct Entry
+    {
+        unsigned long long offsetUs;
+        string line;
+    };
+
+    vector<Entry> m_entries;
+};
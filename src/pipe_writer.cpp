@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "pipe_writer.h"
+#include "logging.h"
+#include "utilities.h"
+
+
+static ULONGLONG DeadlineFromTimeout(DWORD timeoutMs)
+{
+    return timeoutMs == INFINITE ? ULLONG_MAX : GetTickCount64() + timeoutMs;
+}
+
+
+PipeWriter::PipeWriter(HANDLE pipe, size_t capacity/*=DEFAULT_CAPACITY*/)
+    : m_pipe(pipe),
+      m_capacity(capacity),
+      m_thread(NULL),
+      m_queuedBytes(0),
+      m_closed(false),
+      m_failed(false)
+{
+    if (pipe == NULL || pipe == INVALID_HANDLE_VALUE) {
+        throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) "invalid pipe");
+    }
+
+    m_thread = CreateThread(0, 0, WriterThread, (void*)this, 0, 0);
+    if (m_thread == NULL) {
+        throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) "CreateThread failed");
+    }
+}
+
+PipeWriter::~PipeWriter()
+{
+    (void)Close(0);
+}
+
+template<typename Predicate>
+bool PipeWriter::WaitUntil(std::unique_lock<std::mutex>& lock, ULONGLONG deadline, Predicate done)
+{
+    while (!done())
+    {
+        if (deadline == ULLONG_MAX)
+        {
+            m_changed.wait(lock);
+            continue;
+        }
+
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline)
+        {
+            return false;
+        }
+        m_changed.wait_for(lock, std::chrono::milliseconds(deadline - now));
+    }
+    return true;
+}
+
+bool PipeWriter::Write(const char* data, size_t length, DWORD timeoutMs/*=INFINITE*/)
+{
+    if (length == 0)
+    {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    bool ready = WaitUntil(lock, DeadlineFromTimeout(timeoutMs), [&]() {
+        return m_closed || m_failed
+               || m_queuedBytes == 0
+               || m_queuedBytes + length <= m_capacity;
+    });
+
+    if (!ready || m_closed || m_failed)
+    {
+        return false;
+    }
+
+    m_queue.push_back(string(data, length));
+    m_queuedBytes += length;
+    m_changed.notify_all();
+    return true;
+}
+
+bool PipeWriter::Flush(DWORD timeoutMs/*=INFINITE*/)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    bool drained = WaitUntil(lock, DeadlineFromTimeout(timeoutMs), [&]() {
+        return m_failed || m_queuedBytes == 0;
+    });
+
+    return drained && !m_failed;
+}
+
+bool PipeWriter::Close(DWORD timeoutMs)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (m_thread == NULL)
+        {
+            return m_queuedBytes == 0 && !m_failed;
+        }
+        m_closed = true;
+        m_changed.notify_all();
+    }
+
+    bool flushed = Flush(timeoutMs);
+
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (!flushed)
+        {
+            // Give up on whatever hasn't been written
+            m_queue.clear();
+        }
+        m_changed.notify_all();
+    }
+
+    // If the reader isn't reading, the writer thread may be blocked in
+    // WriteFile; cancel that until the thread notices it's closed.
+    while (WAIT_TIMEOUT == WaitForSingleObject(m_thread, 10))
+    {
+        (void)CancelSynchronousIo(m_thread);
+    }
+    CloseHandle(m_thread);
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_thread = NULL;
+    if (!flushed)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: %d bytes not written"), __TFUNCTION__, (int)m_queuedBytes);
+    }
+    return flushed;
+}
+
+bool PipeWriter::Failed()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    return m_failed;
+}
+
+// static
+DWORD WINAPI PipeWriter::WriterThread(void* object)
+{
+    PipeWriter* _this = (PipeWriter*)object;
+    _this->WriteQueued();
+    return 0;
+}
+
+void PipeWriter::WriteQueued()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (true)
+    {
+        m_changed.wait(lock, [&]() { return m_closed || !m_queue.empty(); });
+
+        if (m_queue.empty())
+        {
+            // Closed, and nothing left to write
+            return;
+        }
+
+        string data;
+        data.swap(m_queue.front());
+        m_queue.pop_front();
+
+        lock.unlock();
+
+        size_t offset = 0;
+        bool success = true;
+        while (offset < data.length())
+        {
+            DWORD toWrite = (DWORD)min((size_t)MAX_WRITE_SIZE, data.length() - offset);
+            DWORD written = 0;
+            if (!WriteFile(m_pipe, data.c_str() + offset, toWrite, &written, NULL))
+            {
+                // ERROR_OPERATION_ABORTED if Close cancelled the write
+                my_print(NOT_SENSITIVE, false, _T("%s: WriteFile failed (%d)"), __TFUNCTION__, GetLastError());
+                success = false;
+                break;
+            }
+            offset += written;
+        }
+
+        lock.lock();
+
+        m_queuedBytes -= data.length();
+        if (!success)
+        {
+            m_failed = true;
+            for (const auto& queued : m_queue)
+            {
+                m_queuedBytes -= queued.length();
+            }
+            m_queue.clear();
+        }
+        m_changed.notify_all();
+
+        if (m_failed)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+/**
+PipeWriter streams data into a pipe (or any synchronous file handle) from its
+own thread, so that callers aren't blocked while the reader on the other end
+catches up.
+
+Writes are queued, up to `capacity` bytes, and written out in bounded chunks,
+with partial writes resumed. When the queue is full, Write waits -- up to its
+timeout -- for room, which is how a slow reader pushes back on the caller.
+
+The pipe handle is not owned; it must stay open until Close has returned.
+Thread safe.
+*/
+class PipeWriter
+{
+public:
+    PipeWriter(HANDLE pipe, size_t capacity = DEFAULT_CAPACITY);
+    virtual ~PipeWriter();
+
+    /**
+    Queues `length` bytes of `data`, waiting up to `timeoutMs` for room in the
+    queue. Data bigger than the whole queue is accepted once the queue is
+    empty. Either all of the data is queued (returns true) or none of it is
+    (returns false: timed out, closed, or a previous write failed).
+    */
+    bool Write(const char* data, size_t length, DWORD timeoutMs = INFINITE);
+    bool Write(const string& data, DWORD timeoutMs = INFINITE) { return Write(data.c_str(), data.length(), timeoutMs); }
+
+    /**
+    Waits up to `timeoutMs` for everything queued so far to be written.
+    Returns false on timeout or if a write failed.
+    */
+    bool Flush(DWORD timeoutMs = INFINITE);
+
+    /**
+    Stops accepting data and waits up to `timeoutMs` for the queue to drain.
+    After that, anything still unwritten is discarded and a write that is
+    blocked on the pipe is cancelled. Returns true if everything queued was
+    written. The pipe can be closed once this returns.
+    */
+    bool Close(DWORD timeoutMs);
+
+    // True if a write to the pipe has failed; nothing more will be written.
+    bool Failed();
+
+    static const size_t DEFAULT_CAPACITY = 1024 * 1024;
+
+private:
+    // not copyable
+    PipeWriter(PipeWriter const&);
+    PipeWriter& operator=(PipeWriter const&);
+
+    static DWORD WINAPI WriterThread(void* object);
+    void WriteQueued();
+
+    // Waits on m_changed until `done` or the deadline. `lock` must hold m_lock.
+    template<typename Predicate>
+    bool WaitUntil(std::unique_lock<std::mutex>& lock, ULONGLONG deadline, Predicate done);
+
+    static const size_t MAX_WRITE_SIZE = 64 * 1024;
+
+    HANDLE m_pipe;
+    size_t m_capacity;
+    HANDLE m_thread;
+
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::deque<string> m_queue;
+    size_t m_queuedBytes; // includes the chunk being written
+    bool m_closed;
+    bool m_failed;
+};
@@ -14,7 +14,7 @@ namespace psicash {
 static constexpr bool TESTING = false;
 static constexpr auto USER_AGENT = "Psiphon-PsiCash-Windows";
 
-psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo);
+psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo, HTTPSSession& session);
 
 Lib::Lib()
     : m_requestStopInfo(StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_ANY_STOP_TUNNEL)),
@@ -43,7 +43,7 @@ error::Error Lib::Init(bool forceReset) {
     }
 
     auto err = PsiCash::Init(
-        USER_AGENT, WStringToNarrow(dataDirShort).c_str(), GetHTTPReqFn(m_requestStopInfo), forceReset, TESTING);
+        USER_AGENT, WStringToNarrow(dataDirShort).c_str(), GetHTTPReqFn(m_requestStopInfo, m_httpSession), forceReset, TESTING);
     if (err) {
         return WrapError(err, "PsiCash::Init failed");
     }
@@ -72,6 +72,28 @@ error::Error Lib::UpdateClientRegion(const string& region) {
     return error::nullerr;
 }
 
+Lib::UIState Lib::GetUIState() const {
+    AutoMUTEX lock(m_mutex);
+
+    UIState state;
+    state.isAccount = IsAccount();
+    state.hasTokens = HasTokens();
+    state.balance = Balance();
+    state.purchasePrices = GetPurchasePrices();
+    state.purchases = GetPurchases();
+    state.accountSignupURL = GetUserSiteURL(UserSiteURLType::AccountSignup, false);
+    state.accountManagementURL = GetUserSiteURL(UserSiteURLType::AccountManagement, false);
+    state.forgotAccountURL = GetUserSiteURL(UserSiteURLType::ForgotAccount, false);
+    state.accountUsername = AccountUsername();
+
+    auto buyPsiURL = GetBuyPsiURL();
+    if (buyPsiURL) {
+        state.buyPsiURL = *buyPsiURL;
+    }
+
+    return state;
+}
+
 enum class RequestType : int {
     RefreshState,
     NewExpiringPurchase,
@@ -139,33 +161,38 @@ void Lib::AccountLogout(
 }
 
 // Note that this _requires_ a Psiphon tunnel to be in place.
-psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo) {
-    psicash::MakeHTTPRequestFn httpReqFn = [&stopInfo](const psicash::HTTPParams& params) ->psicash::HTTPResult {
+// Requests share `session`, so that PsiCash's bursts of requests reuse a
+// connection through the local proxy.
+psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo, HTTPSSession& session) {
+    psicash::MakeHTTPRequestFn httpReqFn = [&stopInfo, &session](const psicash::HTTPParams& params) ->psicash::HTTPResult {
         // NOTE: This makes only HTTPS requests and ignores params.scheme
 
         my_print(NOT_SENSITIVE, true, _T("%s: PsiCashLib starting request for: %hs"), __TFUNCTION__, params.path.c_str());
 
-        wstringstream requestPath;
-        requestPath << UTF8ToWString(params.path);
-        if (!params.query.empty()) {
-            requestPath << L"?";
-        }
+        // Built up in UTF-8 and converted once
+        string utf8RequestPath = params.path;
         for (size_t i = 0; i < params.query.size(); i++) {
-            auto qp = params.query[i];
-            if (i != 0) {
-                requestPath << "&";
-            }
-            requestPath << UTF8ToWString(qp.first) << L"=" << UTF8ToWString(qp.second);
+            const auto& qp = params.query[i];
+            utf8RequestPath += (i == 0) ? "?" : "&";
+            utf8RequestPath += qp.first;
+            utf8RequestPath += "=";
+            utf8RequestPath += qp.second;
         }
-
-        wstringstream headers;
-        for (auto header : params.headers) {
-            headers << UTF8ToWString(header.first) << L": " << UTF8ToWString(header.second) << L"\r\n";
+        wstring requestPath = UTF8ToWString(utf8RequestPath);
+
+        string utf8Headers;
+        for (const auto& header : params.headers) {
+            utf8Headers += header.first;
+            utf8Headers += ": ";
+            utf8Headers += header.second;
+            utf8Headers += "\r\n";
         }
+        wstring headers = UTF8ToWString(utf8Headers);
 
         HTTPResult result;
 
         HTTPSRequest httpsRequest(/*silentMode=*/true);
+        httpsRequest.SetSession(&session);
         HTTPSRequest::Response httpsResponse;
 
         try
@@ -174,12 +201,12 @@ psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo) {
                     UTF8ToWString(params.hostname).c_str(),
                     params.port,
                     "",         // webServerCertificate
-                    requestPath.str().c_str(),
+                    requestPath.c_str(),
                     stopInfo,
                     HTTPSRequest::PsiphonProxy::REQUIRE,
                     httpsResponse,
                     true,       // failoverToURLProxy -- required for old WinXP
-                    headers.str().empty() ? NULL : headers.str().c_str(),
+                    headers.empty() ? NULL : headers.c_str(),
                     params.body.empty() ? NULL : (LPVOID)params.body.c_str(),
                     params.body.length(),
                     UTF8ToWString(params.method).c_str()))
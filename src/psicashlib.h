@@ -5,6 +5,7 @@
 #include "tstring.h"
 #include "stopsignal.h"
 #include "dispatch_queue.h"
+#include "httpsrequest.h"
 
 
 namespace psicash {
@@ -14,6 +15,20 @@ namespace psicash {
 /// Uses and respects the GlobalStopSignal.
 class Lib : public PsiCash {
 public:
+    /// The PsiCash state that the UI displays.
+    struct UIState {
+        bool isAccount;
+        bool hasTokens;
+        int64_t balance;
+        PurchasePrices purchasePrices;
+        Purchases purchases;
+        std::string accountSignupURL;
+        std::string accountManagementURL;
+        std::string forgotAccountURL;
+        nonstd::optional<std::string> accountUsername;
+        nonstd::optional<std::string> buyPsiURL;
+    };
+
     static Lib& _()
     {
         // Instantiated on first use.
@@ -38,6 +53,10 @@ public:
     /// Update the client region (in the request metadata) as it's better known.
     error::Error UpdateClientRegion(const string& region);
 
+    /// Reads all of the state the UI displays in one go, so that it's consistent
+    /// and isn't interleaved with Init.
+    UIState GetUIState() const;
+
     /// Makes a RefreshState request. If `localOnly` is true, no network request will be
     /// attempted -- the refresh will only examine local data.
     /// Network and callback will happen on a separate thread.
@@ -73,6 +92,9 @@ private:
     HANDLE m_mutex;
     const StopInfo m_requestStopInfo;
 
+    // Shared by all requests; must outlive m_requestQueue
+    HTTPSSession m_httpSession;
+
     dispatch_queue m_requestQueue;
 };
 
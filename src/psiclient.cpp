@@ -36,6 +36,8 @@
 #include "systemproxysettings.h"
 #include "embeddedvalues.h"
 #include "usersettings.h"
+#include "timestamp.h"
+#include "notice_recording.h"
 
 //==== Globals ================================================================
 
@@ -51,6 +53,8 @@ static bool g_windowRestored = false;
 
 ConnectionManager g_connectionManager;
 
+StartupOrchestrator g_startup;
+
 LimitSingleInstance g_singleInstanceObject(TEXT("Global\\{B88F6262-9CC8-44EF-887D-FB77DC89BB8C}"));
 
 // The HTML control has a bad habit of sending messages after we've posted WM_QUIT,
@@ -79,6 +83,50 @@ void OnCreate(HWND hWndParent)
 }
 
 
+//==== Startup =================================================================
+
+// Declares the work done at startup, other than creating the window itself.
+// Anything that doesn't need the UI thread runs in the background while the
+// HTML UI loads; see StartupOrchestrator.
+static void AddStartupTasks()
+{
+    // These must both complete before Psiphon connects or changes any system
+    // network settings. The diagnostics record the system proxy settings, so
+    // they must be collected after any leftover Psiphon proxy settings have
+    // been reverted.
+    g_startup.AddTask(STARTUP_TASK_SYSTEM_PROXY, StartupTaskThread::Background, {}, DoStartupSystemProxyWork);
+    g_startup.AddTask(STARTUP_TASK_DIAGNOSTICS, StartupTaskThread::Background, { STARTUP_TASK_SYSTEM_PROXY }, DoStartupDiagnosticCollection);
+
+    // Benchmarks notice handling against a recording, off to the side of
+    // everything else; see NoticeReplay::Benchmark.
+    tstring noticeReplayFilename = Settings::CoreNoticeReplayFilename();
+    if (!noticeReplayFilename.empty())
+    {
+        g_startup.AddTask(STARTUP_TASK_CORE_NOTICE_REPLAY, StartupTaskThread::Background, {}, [=]() {
+            NoticeReplay::Benchmark(noticeReplayFilename);
+        });
+    }
+
+    g_startup.AddMilestone(STARTUP_MILESTONE_HTML_UI_READY);
+    g_startup.AddMilestone(STARTUP_MILESTONE_WINDOW_SHOWN);
+
+    AddPsiCashStartupTasks();
+
+    g_startup.AddTask(
+        STARTUP_TASK_AUTO_CONNECT,
+        StartupTaskThread::UI,
+        { STARTUP_TASK_SYSTEM_PROXY, STARTUP_TASK_DIAGNOSTICS, STARTUP_TASK_PSICASH_INIT_DONE, STARTUP_MILESTONE_WINDOW_SHOWN },
+        []() {
+            // The user may have already started a connection themselves
+            if (!Settings::SkipAutoConnect()
+                && g_connectionManager.GetState() == CONNECTION_MANAGER_STATE_STOPPED)
+            {
+                g_connectionManager.Toggle();
+            }
+        });
+}
+
+
 //==== Win32 boilerplate ======================================================
 
 ATOM MyRegisterClass(HINSTANCE hInstance);
@@ -111,9 +159,8 @@ int APIENTRY _tWinMain(
     HACCEL hAccelTable;
     hAccelTable = LoadAccelerators(hInstance, MAKEINTRESOURCE(IDC_PSICLIENT));
 
-    // If this set of calls gets any longer, we may want to do something generic.
-    DoStartupSystemProxyWork();
-    DoStartupDiagnosticCollection();
+    AddStartupTasks();
+    g_startup.Start(g_hWnd);
 
     // Main message loop
 
@@ -342,14 +389,19 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         // Set initial state.
         UI_SetStateStopped();
 
-        // Start a connection
-        if (!Settings::SkipAutoConnect())
-        {
-            g_connectionManager.Toggle();
-        }
+        // Both only take effect the first time; this message is also posted
+        // whenever the HTML UI reloads.
+        g_startup.RecordTimeToInteractive();
+
+        // Lets the auto-connect task run once the rest of startup is done
+        g_startup.Complete(STARTUP_MILESTONE_WINDOW_SHOWN);
         break;
     }
 
+    case WM_PSIPHON_STARTUP_TASK:
+        g_startup.RunUITask(wParam);
+        break;
+
     case WM_DPICHANGED:
     {
         // This message is received when the window is moved between monitors
@@ -400,6 +452,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     case WM_PSIPHON_HTMLUI_UPDATEDPISCALING:
     case WM_PSIPHON_HTMLUI_PSICASHMESSAGE:
     case WM_PSIPHON_HTMLUI_DEEPLINK:
+    case WM_PSIPHON_HTMLUI_METRICS:
         HTMLControlWndProc(message, wParam, lParam);
         break;
 
@@ -460,7 +513,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         int priority = (int)wParam;
         TCHAR* log = (TCHAR*)lParam;
         HtmlUI_AddLog(priority, log);
-        auto timestamp = UTF8ToWString(psicash::datetime::DateTime::Now().ToISO8601() + ": ");
+        auto timestamp = FormatISO8601TimestampW(GetTimestamp()) + L": ";
         OutputDebugString(timestamp.c_str());
         OutputDebugString(log);
         OutputDebugString(L"\n");
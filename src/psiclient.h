@@ -21,6 +21,7 @@
 
 #include "resource.h"
 #include "connectionmanager.h"
+#include "startup_orchestrator.h"
 
 
 //==== global state ===================================================
@@ -32,6 +33,8 @@ extern std::tstring g_appTitle;
 // TODO: wrap this in a singleton interface?
 extern ConnectionManager g_connectionManager;
 
+extern StartupOrchestrator g_startup;
+
 
 //==== global window message constants =================================
 
@@ -39,6 +42,27 @@ extern ConnectionManager g_connectionManager;
 #define WM_PSIPHON_FEEDBACK_SUCCESS             WM_USER + 101
 #define WM_PSIPHON_FEEDBACK_FAILED              WM_USER + 102
 #define WM_PSIPHON_CREATED                      WM_USER + 103
+#define WM_PSIPHON_STARTUP_TASK                 WM_USER + 104
+
+
+//==== startup task names ==============================================
+
+// Restores system proxy settings left behind by a crash (background)
+#define STARTUP_TASK_SYSTEM_PROXY               "SystemProxy"
+// Collects network info before Psiphon changes anything (background)
+#define STARTUP_TASK_DIAGNOSTICS                "StartupDiagnostics"
+// Initializes the PsiCash library from disk (background)
+#define STARTUP_TASK_PSICASH_INIT               "PsiCashInit"
+// Tells the HTML UI the PsiCash init result (UI)
+#define STARTUP_TASK_PSICASH_INIT_DONE          "PsiCashInitDone"
+// Starts the initial connection, if enabled (UI)
+#define STARTUP_TASK_AUTO_CONNECT               "AutoConnect"
+// Replays a core notice recording, if configured (background)
+#define STARTUP_TASK_CORE_NOTICE_REPLAY         "CoreNoticeReplay"
+// Milestone: the HTML UI has loaded and called back
+#define STARTUP_MILESTONE_HTML_UI_READY         "HtmlUiReady"
+// Milestone: the main window has been shown
+#define STARTUP_MILESTONE_WINDOW_SHOWN          "WindowShown"
 
 
 //==== UI Interaction ==================================================
@@ -28,7 +28,10 @@
 #include "logging.h"
 #include <mCtrl/html.h>
 #include "webbrowser.h"
+#include "metrics.h"
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 
 
 // Set to TRUE to force the debug pane to be visible
@@ -40,9 +43,20 @@ static wstring g_queuedDeeplink;
 static bool g_psiCashInitializd = false;
 static string g_uiLocale;
 
+// Set by the PsiCash init task on its background thread; only read once that
+// task is done.
+static bool g_psiCashLibInitialized = false;
+static nlohmann::json g_psiCashInitPayload;
+
+// The last PsiCash refresh payload given to the UI, serialized; empty for
+// none. Cleared when the UI (re)loads.
+static string g_lastPsiCashRefresh;
+static HANDLE g_lastPsiCashRefreshMutex = CreateMutex(NULL, FALSE, 0);
+
 
 // Forward declarations
-void InitPsiCash();
+void InitPsiCashLib();
+void FinishPsiCashInit();
 bool HandlePsiCashCommand(const string&);
 
 
@@ -308,8 +322,61 @@ void SendCommandLineToWnd(HWND hWnd, wchar_t* lpCmdLine) {
 
 //==== String Table helpers ==================================================
 
-static map<string, wstring> g_stringTable;
+// String tables are cached per locale for the life of the process, so that
+// switching back to a previously used locale only requires the UI to name it
+// (see ActivateStringTableLocale) rather than re-send every string. Keys are
+// interned, so each key string is stored once no matter how many locale tables
+// contain it. Entries are stored as received (UTF-8) and converted to UTF-16
+// the first time they're looked up.
+//
+// Only accessed from the UI thread.
+
+struct StringTableEntry
+{
+    string utf8;
+    wstring wide;
+    bool converted;
+    StringTableEntry() : converted(false) {}
+    StringTableEntry(const string& utf8) : utf8(utf8), converted(false) {}
+};
+
+typedef unordered_map<const string*, StringTableEntry> StringTable;
+
+static unordered_set<string> g_stringTableKeys;
+static map<string, StringTable> g_stringTables;
+static StringTable* g_activeStringTable = NULL;
+
+static const string* InternStringTableKey(const string& key)
+{
+    return &*g_stringTableKeys.insert(key).first;
+}
+
+static void SetActiveStringTableLocale(const string& locale)
+{
+    g_activeStringTable = &g_stringTables[locale];
+
+    if (locale != g_uiLocale) {
+        g_uiLocale = locale;
+
+        SetUiLocale(UTF8ToWString(locale)); // used in feedback
+
+        if (g_psiCashInitializd) {
+            if (auto err = psicash::Lib::_().SetLocale(locale)) {
+                // Log and carry on
+                my_print(NOT_SENSITIVE, false, _T("%s: PsiCashLib::SetLocale failed, %hs"), __TFUNCTION__, err.ToString().c_str());
+            }
+        }
+    }
 
+    // As soon as the OS_UNSUPPORTED string is available, do the OS check.
+    wstring osUnsupported;
+    if (GetStringTableEntry(STRING_KEY_OS_UNSUPPORTED, osUnsupported)) {
+        EnforceOSSupport(g_hWnd, osUnsupported);
+    }
+}
+
+// Handles a single {"locale", "key", "string"} entry. Retained for UIs that
+// send the table one string at a time.
 static void AddStringTableEntry(const string& utf8EntryJson)
 {
     Json::Value json;
@@ -347,40 +414,125 @@ static void AddStringTableEntry(const string& utf8EntryJson)
         return;
     }
 
-    auto wideStr = UTF8ToWString(narrowStr);
-    g_stringTable[key] = wideStr;
+    g_stringTables[locale][InternStringTableKey(key)] = StringTableEntry(narrowStr);
 
-    if (locale != g_uiLocale) {
-        g_uiLocale = locale;
+    if (locale != g_uiLocale || key == STRING_KEY_OS_UNSUPPORTED) {
+        SetActiveStringTableLocale(locale);
+    }
+    else if (!g_activeStringTable) {
+        g_activeStringTable = &g_stringTables[locale];
+    }
+}
 
-        SetUiLocale(UTF8ToWString(locale)); // used in feedback
+// Handles a chunk of a locale table, {"locale": ..., "strings": {key: string, ...},
+// "last": bool}. The UI splits tables so each message fits in a URL; the chunk
+// with "last" set (or a message without it) completes the table and makes it
+// the active one.
+static void SetStringTable(const string& utf8TableJson)
+{
+    Json::Value json;
+    Json::Reader reader;
+    bool parsingSuccessful = reader.parse(utf8TableJson, json);
+    if (!parsingSuccessful)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s:%d: Failed to parse string table"), __TFUNCTION__, __LINE__);
+        return;
+    }
 
-        if (g_psiCashInitializd) {
-            if (auto err = psicash::Lib::_().SetLocale(locale)) {
-                // Log and carry on
-                my_print(NOT_SENSITIVE, false, _T("%s: PsiCashLib::SetLocale failed, %hs"), __TFUNCTION__, err.ToString().c_str());
+    string locale;
+    bool last = true;
+
+    try
+    {
+        const Json::Value& strings = json["strings"];
+        if (!strings.isObject())
+        {
+            return;
+        }
+
+        locale = json.get("locale", "").asString();
+        last = json.get("last", true).asBool();
+
+        StringTable& table = g_stringTables[locale];
+        table.reserve(table.size() + strings.size());
+
+        for (auto it = strings.begin(); it != strings.end(); ++it)
+        {
+            string key = it.key().asString();
+            string narrowStr = it->asString();
+            if (key.empty() || narrowStr.empty())
+            {
+                continue;
             }
+
+            table[InternStringTableKey(key)] = StringTableEntry(narrowStr);
         }
     }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s:%d: JSON parse exception: %S"), __TFUNCTION__, __LINE__, e.what());
+        return;
+    }
 
-    // As soon as the OS_UNSUPPORTED string is available, do the OS check.
-    if (key == STRING_KEY_OS_UNSUPPORTED) {
-        EnforceOSSupport(g_hWnd, wideStr);
+    if (last)
+    {
+        SetActiveStringTableLocale(locale);
     }
 }
 
+// Switches to a locale whose table has already been sent. Returns false if
+// there is no cached table for the locale.
+static bool ActivateStringTableLocale(const string& utf8LocaleJson)
+{
+    Json::Value json;
+    Json::Reader reader;
+    if (!reader.parse(utf8LocaleJson, json) || !json.isObject())
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s:%d: Failed to parse string table locale"), __TFUNCTION__, __LINE__);
+        return false;
+    }
+
+    string locale = json.get("locale", "").asString();
+    if (g_stringTables.find(locale) == g_stringTables.end())
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s:%d: No cached string table for locale"), __TFUNCTION__, __LINE__);
+        return false;
+    }
+
+    SetActiveStringTableLocale(locale);
+    return true;
+}
+
 // Returns true if the string table entry is found, false otherwise.
 bool GetStringTableEntry(const string& key, wstring& o_entry)
 {
     o_entry.clear();
 
-    map<string, wstring>::const_iterator iter = g_stringTable.find(key);
-    if (iter == g_stringTable.end())
+    if (!g_activeStringTable)
     {
         return false;
     }
 
-    o_entry = iter->second;
+    auto internedKey = g_stringTableKeys.find(key);
+    if (internedKey == g_stringTableKeys.end())
+    {
+        return false;
+    }
+
+    auto iter = g_activeStringTable->find(&*internedKey);
+    if (iter == g_activeStringTable->end())
+    {
+        return false;
+    }
+
+    StringTableEntry& entry = iter->second;
+    if (!entry.converted)
+    {
+        entry.wide = UTF8ToWString(entry.utf8);
+        entry.converted = true;
+    }
+
+    o_entry = entry.wide;
 
     return true;
 }
@@ -593,16 +745,48 @@ static void HTMLUI_DeeplinkHandler(LPCWSTR deeplinkJSON) {
 
 static void HtmlUI_PsiCashMessage(const string& psicashJSON)
 {
-    wstring wJson = UTF8ToWString(psicashJSON.c_str());
+    // Refresh payloads can be large, so convert straight into the buffer that
+    // is handed to the UI thread, rather than via a temporary wstring.
+    int wLen = MultiByteToWideChar(CP_UTF8, 0, psicashJSON.c_str(), (int)psicashJSON.length(), NULL, 0);
+    wchar_t* buf = new wchar_t[wLen + 1];
+    MultiByteToWideChar(CP_UTF8, 0, psicashJSON.c_str(), (int)psicashJSON.length(), buf, wLen);
+    buf[wLen] = L'\0';
+    PostMessage(g_hWnd, WM_PSIPHON_HTMLUI_PSICASHMESSAGE, (WPARAM)buf, 0);
+}
+
+static void HtmlUI_PsiCashMessageHandler(LPCWSTR json)
+{
+    if (!g_htmlUiReady)
+    {
+        delete[] json;
+        return;
+    }
+
+    MC_HMCALLSCRIPTFUNC argStruct = { 0 };
+    argStruct.cbSize = sizeof(MC_HMCALLSCRIPTFUNC);
+    argStruct.cArgs = 1;
+    argStruct.pszArg1 = json;
+    if (!SendMessage(
+        g_hHtmlCtrl, MC_HM_CALLSCRIPTFUNC,
+        (WPARAM)_T("HtmlCtrlInterface_PsiCashMessage"), (LPARAM)&argStruct))
+    {
+        throw std::exception("UI: HtmlCtrlInterface_PsiCashMessage not found");
+    }
+    delete[] json;
+}
+
+static void HtmlUI_Metrics(const string& metricsJSON)
+{
+    wstring wJson = UTF8ToWString(metricsJSON.c_str());
 
     size_t bufLen = wJson.length() + 1;
     wchar_t* buf = new wchar_t[bufLen];
     wcsncpy_s(buf, bufLen, wJson.c_str(), bufLen);
     buf[bufLen - 1] = L'\0';
-    PostMessage(g_hWnd, WM_PSIPHON_HTMLUI_PSICASHMESSAGE, (WPARAM)buf, 0);
+    PostMessage(g_hWnd, WM_PSIPHON_HTMLUI_METRICS, (WPARAM)buf, 0);
 }
 
-static void HtmlUI_PsiCashMessageHandler(LPCWSTR json)
+static void HtmlUI_MetricsHandler(LPCWSTR json)
 {
     if (!g_htmlUiReady)
     {
@@ -616,9 +800,9 @@ static void HtmlUI_PsiCashMessageHandler(LPCWSTR json)
     argStruct.pszArg1 = json;
     if (!SendMessage(
         g_hHtmlCtrl, MC_HM_CALLSCRIPTFUNC,
-        (WPARAM)_T("HtmlCtrlInterface_PsiCashMessage"), (LPARAM)&argStruct))
+        (WPARAM)_T("HtmlCtrlInterface_Metrics"), (LPARAM)&argStruct))
     {
-        throw std::exception("UI: HtmlCtrlInterface_PsiCashMessage not found");
+        throw std::exception("UI: HtmlCtrlInterface_Metrics not found");
     }
     delete[] json;
 }
@@ -654,6 +838,10 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
     const LPCTSTR appReady = PSIPHON_LINK_PREFIX _T("ready");
     const LPCTSTR appStringTable = PSIPHON_LINK_PREFIX _T("stringtable?");
     const size_t appStringTableLen = _tcslen(appStringTable);
+    const LPCTSTR appStringTableSet = PSIPHON_LINK_PREFIX _T("stringtableset?");
+    const size_t appStringTableSetLen = _tcslen(appStringTableSet);
+    const LPCTSTR appStringTableLocale = PSIPHON_LINK_PREFIX _T("stringtablelocale?");
+    const size_t appStringTableLocaleLen = _tcslen(appStringTableLocale);
     const LPCTSTR appLogCommand = PSIPHON_LINK_PREFIX _T("log?");
     const size_t appLogCommandLen = _tcslen(appLogCommand);
     const LPCTSTR appStart = PSIPHON_LINK_PREFIX _T("start");
@@ -670,14 +858,26 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
     const LPCTSTR psicashCommand = PSIPHON_LINK_PREFIX _T("psicash?");
     const size_t psicashCommandLen = _tcslen(psicashCommand);
     const LPCTSTR disallowedTraffic = PSIPHON_LINK_PREFIX _T("disallowedtraffic");
+    const LPCTSTR appMetrics = PSIPHON_LINK_PREFIX _T("metrics");
 
     if (url == appReady)
     {
         my_print(NOT_SENSITIVE, true, _T("%s: Ready requested"), __TFUNCTION__);
         g_htmlUiReady = true;
-        InitPsiCash();
+        {
+            AutoMUTEX lock(g_lastPsiCashRefreshMutex);
+            g_lastPsiCashRefresh.clear();
+        }
+        g_startup.Complete(STARTUP_MILESTONE_HTML_UI_READY);
         PostMessage(g_hWnd, WM_PSIPHON_CREATED, 0, 0);
 
+        // The startup task tells the first page load about PsiCash init; a
+        // reloaded page has to be told again. If the task hasn't run yet, it
+        // will tell this page.
+        if (g_startup.IsDone(STARTUP_TASK_PSICASH_INIT_DONE)) {
+            FinishPsiCashInit();
+        }
+
         if (!g_queuedDeeplink.empty()) {
             my_print(NOT_SENSITIVE, true, _T("%s: Opening queued deeplink"), __TFUNCTION__);
             DoDeeplink(g_queuedDeeplink);
@@ -691,6 +891,20 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
         string stringJSON = uiURLParams(url, appStringTableLen);
         AddStringTableEntry(stringJSON);
     }
+    else if (url.find(appStringTableSet) == 0 && url.length() > appStringTableSetLen)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: String table set requested"), __TFUNCTION__);
+
+        string tableJSON = uiURLParams(url, appStringTableSetLen);
+        SetStringTable(tableJSON);
+    }
+    else if (url.find(appStringTableLocale) == 0 && url.length() > appStringTableLocaleLen)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: String table locale change requested"), __TFUNCTION__);
+
+        string localeJSON = uiURLParams(url, appStringTableLocaleLen);
+        (void)ActivateStringTableLocale(localeJSON);
+    }
     else if (url.find(appLogCommand) == 0 && url.length() > appLogCommandLen)
     {
         string log = uiURLParams(url, appLogCommandLen);
@@ -718,10 +932,10 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
         my_print(NOT_SENSITIVE, true, _T("%s: Save settings requested"), __TFUNCTION__);
 
         string stringJSON = uiURLParams(url, appSaveSettingsLen);
-        bool reconnectRequired = false;
-        bool success = Settings::FromJson(stringJSON, reconnectRequired);
+        DWORD changes = SETTINGS_CHANGE_NONE;
+        bool success = Settings::FromJson(stringJSON, changes);
 
-        bool doReconnect = success && reconnectRequired &&
+        bool doReconnect = success && changes != SETTINGS_CHANGE_NONE &&
             (g_connectionManager.GetState() == CONNECTION_MANAGER_STATE_CONNECTED
                 || g_connectionManager.GetState() == CONNECTION_MANAGER_STATE_STARTING);
 
@@ -742,8 +956,7 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
         {
             // Instead of reconnecting here, we could let the JS see that it's
             // required and then trigger it. But that seems like an unnecessary round-trip.
-            my_print(NOT_SENSITIVE, false, _T("Settings change detected. Reconnecting."));
-            g_connectionManager.Reconnect(false);
+            g_connectionManager.ApplySettingsChanges(changes);
         }
     }
     else if (url.find(appSendFeedback) == 0 && url.length() > appSendFeedbackLen)
@@ -797,6 +1010,11 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
 
         UpdateSystrayIcon(NULL, infoTitle, infoBody);
     }
+    else if (url == appMetrics)
+    {
+        // The debug pane is asking for a metrics snapshot
+        HtmlUI_Metrics(Json::FastWriter().write(MetricsRegistry::Instance().Snapshot()));
+    }
     else {
         // Not one of our links. Open it in an external browser.
         OpenBrowser(url);
@@ -936,16 +1154,29 @@ struct PsiCashMessage {
     }
 };
 
-// Initialize the PsiCash library. Must be called after the UI is ready.
-void InitPsiCash() {
-    PsiCashMessage evt(PsiCashMessageType::INIT_DONE, "");
+// Exported function.
+void AddPsiCashStartupTasks()
+{
+    // Library init is only disk I/O, so it can start right away; the UI has
+    // to be ready to be told about the result.
+    g_startup.AddTask(STARTUP_TASK_PSICASH_INIT, StartupTaskThread::Background, {}, InitPsiCashLib);
+    g_startup.AddTask(
+        STARTUP_TASK_PSICASH_INIT_DONE,
+        StartupTaskThread::UI,
+        { STARTUP_TASK_PSICASH_INIT, STARTUP_MILESTONE_HTML_UI_READY },
+        FinishPsiCashInit);
+}
+
+// Initialize the PsiCash library. Run as a background startup task.
+void InitPsiCashLib() {
+    g_psiCashLibInitialized = false;
+    g_psiCashInitPayload = {};
 
-    g_psiCashInitializd = false;
     if (auto err = psicash::Lib::_().Init(false)) {
         // Init failed, indicating file corruption or disk access problems.
         // We'll try to reset.
         auto retryErr = psicash::Lib::_().Init(true);
-        g_psiCashInitializd = !retryErr;
+        g_psiCashLibInitialized = !retryErr;
 
         // At this point Init may have failed again, and we'll be proceeding without any PsiCash support
 
@@ -955,14 +1186,22 @@ void InitPsiCash() {
         nlohmann::json jsonResult;
         jsonResult["error"] = err.ToString(); // display the origin error, even if the retry succeeded
         jsonResult["recovered"] = retryErr ? false : true;
-        evt.payload = jsonResult;
+        g_psiCashInitPayload = jsonResult;
     }
     else
     {
-        g_psiCashInitializd = true;
+        g_psiCashLibInitialized = true;
         my_print(NOT_SENSITIVE, true, _T("%s: PsiCashLib initialization succeeded"), __TFUNCTION__);
     }
+}
 
+// Finish PsiCash initialization. Run on the UI thread, after InitPsiCashLib
+// and once the UI is ready.
+void FinishPsiCashInit() {
+    PsiCashMessage evt(PsiCashMessageType::INIT_DONE, "");
+    evt.payload = g_psiCashInitPayload;
+
+    g_psiCashInitializd = g_psiCashLibInitialized;
     if (g_psiCashInitializd) {
         if (auto err = psicash::Lib::_().SetLocale(g_uiLocale)) {
             // Log and carry on
@@ -979,31 +1218,49 @@ void InitPsiCash() {
     HtmlUI_PsiCashMessage(jsonString);
 }
 
-nlohmann::json MakeRefreshPsiCashPayload() {
+// Records `refresh` as the last refresh payload given to the UI. Returns
+// false if it's the same as the previous one.
+static bool RecordPsiCashRefresh(const nlohmann::json& refresh) {
+    string serialized = refresh.dump();
+
+    AutoMUTEX lock(g_lastPsiCashRefreshMutex);
+    bool changed = serialized != g_lastPsiCashRefresh;
+    g_lastPsiCashRefresh = std::move(serialized);
+    return changed;
+}
+
+// If o_changed is non-null, it's set to false if the payload is the same as
+// the last one given to the UI.
+nlohmann::json MakeRefreshPsiCashPayload(bool* o_changed = NULL) {
+    auto state = psicash::Lib::_().GetUIState();
+
     nlohmann::json res = {
-        { "is_account", psicash::Lib::_().IsAccount() },
-        { "has_tokens", psicash::Lib::_().HasTokens() },
-        { "has_tokens", psicash::Lib::_().HasTokens() },
-        { "balance",  psicash::Lib::_().Balance() },
-        { "purchase_prices", psicash::Lib::_().GetPurchasePrices() },
-        { "purchases", psicash::Lib::_().GetPurchases() },
-        { "account_signup_url", psicash::Lib::_().GetUserSiteURL(psicash::PsiCash::UserSiteURLType::AccountSignup, false) },
-        { "account_management_url", psicash::Lib::_().GetUserSiteURL(psicash::PsiCash::UserSiteURLType::AccountManagement, false) },
-        { "forgot_account_url", psicash::Lib::_().GetUserSiteURL(psicash::PsiCash::UserSiteURLType::ForgotAccount, false) },
+        { "is_account", state.isAccount },
+        { "has_tokens", state.hasTokens },
+        { "balance",  state.balance },
+        { "purchase_prices", state.purchasePrices },
+        { "purchases", state.purchases },
+        { "account_signup_url", state.accountSignupURL },
+        { "account_management_url", state.accountManagementURL },
+        { "forgot_account_url", state.forgotAccountURL },
 
         // Trying to use ternary conditionals for these will cause a crash
         { "account_username", nullptr },
         { "buy_psi_url", nullptr }
     };
 
-    nonstd::optional<string> accountUsernameOpt = psicash::Lib::_().AccountUsername();
-    if (accountUsernameOpt) {
-        res["account_username"] = *accountUsernameOpt;
+    if (state.accountUsername) {
+        res["account_username"] = *state.accountUsername;
     }
 
-    auto buyPsiURLOpt = psicash::Lib::_().GetBuyPsiURL();
-    if (buyPsiURLOpt) {
-        res["buy_psi_url"] = *buyPsiURLOpt;
+    if (state.buyPsiURL) {
+        res["buy_psi_url"] = *state.buyPsiURL;
+    }
+
+    // Every refresh payload that's built is sent to the UI, one way or another
+    bool changed = RecordPsiCashRefresh(res);
+    if (o_changed) {
+        *o_changed = changed;
     }
 
     return res;
@@ -1013,8 +1270,18 @@ nlohmann::json MakeRefreshPsiCashPayload() {
 // commandID may be empty if not needed.
 void UI_RefreshPsiCash(const string& commandID, bool reconnect_required)
 {
+    static MetricCounter& skipped = MetricsRegistry::Instance().Counter("psicash.refresh_skipped");
+
     PsiCashMessage evt(PsiCashMessageType::REFRESH, commandID);
-    evt.payload = MakeRefreshPsiCashPayload();
+    bool changed = true;
+    evt.payload = MakeRefreshPsiCashPayload(&changed);
+
+    // A command expects a response, but an unprompted refresh of what the UI
+    // is already showing is pointless.
+    if (commandID.empty() && !reconnect_required && !changed) {
+        skipped.Add();
+        return;
+    }
 
     evt.payload["reconnect_required"] = reconnect_required;
 
@@ -1257,5 +1524,8 @@ void HTMLControlWndProc(UINT message, WPARAM wParam, LPARAM lParam) {
     case WM_PSIPHON_HTMLUI_PSICASHMESSAGE:
         HtmlUI_PsiCashMessageHandler((LPCWSTR)wParam);
         break;
+    case WM_PSIPHON_HTMLUI_METRICS:
+        HtmlUI_MetricsHandler((LPCWSTR)wParam);
+        break;
     };
 }
@@ -28,6 +28,7 @@
 #define WM_PSIPHON_HTMLUI_UPDATEDPISCALING  WM_USER + 205
 #define WM_PSIPHON_HTMLUI_DEEPLINK          WM_USER + 206
 #define WM_PSIPHON_HTMLUI_PSICASHMESSAGE    WM_USER + 207
+#define WM_PSIPHON_HTMLUI_METRICS           WM_USER + 208
 
 /// Should be called during app initialization
 void InitHTMLLib();
@@ -57,6 +58,10 @@ void ProcessCommandLineMessage(WPARAM wParam, LPARAM lParam);
 /// that should process the command line.
 void SendCommandLineToWnd(HWND hWnd, wchar_t* lpCmdLine);
 
+/// Declares the PsiCash initialization tasks with g_startup (STARTUP_TASK_PSICASH_INIT
+/// and STARTUP_TASK_PSICASH_INIT_DONE). Must be called before g_startup.Start.
+void AddPsiCashStartupTasks();
+
 /// Should be called from HandleNotify when hdr->idFrom == IDC_HTML_CTRL to process
 /// notifications belonging to the main HTML control.
 LRESULT HandleNotifyHTMLControl(HWND hWnd, NMHDR* hdr);
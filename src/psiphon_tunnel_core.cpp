@@ -20,40 +20,159 @@
 #include "stdafx.h"
 #include <shlwapi.h>
 #pragma comment(lib,"shlwapi.lib")
+#include <atomic>
 
 #include "psiphon_tunnel_core.h"
+#include "notice_recording.h"
 #include "diagnostic_info.h"
 #include "logging.h"
 #include "psiclient.h"
+#include "usersettings.h"
 #include "utilities.h"
+#include "metrics.h"
+#include "stopsignal.h"
 
 
-PsiphonTunnelCore::PsiphonTunnelCore(IPsiphonTunnelCoreNoticeHandler* noticeHandler, const tstring& exePath)
-    : Subprocess(exePath, this),
-      m_panicked(false)
+PsiphonTunnelCore::PsiphonTunnelCore(IPsiphonTunnelCoreNoticeHandler* noticeHandler, const tstring& exePath, bool deleteExe/*=true*/)
+    : PsiphonTunnelCore(noticeHandler, exePath, deleteExe, false)
+{
+}
+
+
+PsiphonTunnelCore::PsiphonTunnelCore(IPsiphonTunnelCoreNoticeHandler* noticeHandler, const tstring& exePath, bool deleteExe, bool replaying)
+    : Subprocess(exePath, this, deleteExe),
+      m_replaying(replaying),
+      m_noticeReader(NewStrictJSONReader()),
+      m_panicked(false),
+      m_noticesQueued(0),
+      m_noticesHandled(0),
+      m_noticeThread(NULL),
+      m_stopNoticeThread(false),
+      m_destroying(false)
 {
     if (noticeHandler == NULL) {
         throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) "noticeHandler null");
     }
     m_noticeHandler = noticeHandler;
+
+    m_noticeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_handlerExceptionMutex = CreateMutex(NULL, FALSE, 0);
+    m_noticeThread = CreateThread(0, 0, NoticeThread, (void*)this, 0, 0);
+    if (m_noticeThread == NULL) {
+        CloseHandle(m_noticeEvent);
+        CloseHandle(m_handlerExceptionMutex);
+        throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) "CreateThread failed");
+    }
+
+    if (m_replaying)
+    {
+        return;
+    }
+
+    // Recordings are kept for the rest of the run, so that they can be
+    // collected after a problem, and deleted when the next run starts a core.
+    static std::atomic<bool> oldRecordingsDeleted(false);
+    filesystem::path tempPath;
+    if (!oldRecordingsDeleted.exchange(true) && GetSysTempPath(tempPath))
+    {
+        NoticeRecorder::DeleteRecordings(tempPath);
+    }
+
+    if (Settings::CoreNoticeRecording())
+    {
+        if (GetSysTempPath(tempPath))
+        {
+            static std::atomic<unsigned int> recordingCount(0);
+            tstringstream filename;
+            filename << NOTICE_RECORDING_FILENAME_PREFIX << GetCurrentProcessId() << _T("-") << recordingCount++ << _T(".jsonl");
+
+            m_recorder.reset(new NoticeRecorder(tempPath / filename.str()));
+        }
+    }
 }
 
 
 PsiphonTunnelCore::~PsiphonTunnelCore()
 {
+    // Stop the core while the notice queue and thread still exist: the core
+    // prints notices as it shuts down, and Cleanup consumes them. (If this
+    // were left to ~Subprocess, they'd be queued into destroyed members.)
+    // Handler exceptions are meant for the consuming thread, which has moved
+    // on, so they're dropped.
+    m_destroying = true;
+    try
+    {
+        (void)Subprocess::Cleanup();
+        (void)WaitForNoticesHandled(StopInfo(), NOTICE_DRAIN_TIMEOUT_MS);
+    }
+    catch (...)
+    {
+    }
+
+    // Anything still queued after the drain timeout is dropped
+    m_stopNoticeThread = true;
+    SetEvent(m_noticeEvent);
+    WaitForSingleObject(m_noticeThread, INFINITE);
+    CloseHandle(m_noticeThread);
+    CloseHandle(m_noticeEvent);
+    CloseHandle(m_handlerExceptionMutex);
 }
 
-void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
+
+void PsiphonTunnelCore::ConsumeSubprocessOutput()
 {
-    // Notices are logged to diagnostics. Some notices are excluded from
-    // diagnostics if they may contain private user data.
-    bool logOutputToDiagnostics = true;
+    Subprocess::ConsumeSubprocessOutput();
 
-    // Parse output to extract data
+    FlushNoticeOverflow();
 
+    // Cleanup consumes output too; don't let it be interrupted in the destructor
+    if (!m_destroying)
+    {
+        RethrowHandlerException();
+    }
+}
+
+
+bool PsiphonTunnelCore::WaitForNoticesHandled(const StopInfo& stopInfo, DWORD timeoutMs)
+{
+    DWORD start = GetTickCount();
+    bool handled = false;
+
+    while (true)
+    {
+        FlushNoticeOverflow();
+        if (m_noticeOverflow.empty() && m_noticesHandled.load() == m_noticesQueued)
+        {
+            handled = true;
+            break;
+        }
+
+        if ((stopInfo.stopSignal != NULL && stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons))
+            || GetTickCount() - start >= timeoutMs)
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: gave up with %llu notices unhandled"), __TFUNCTION__, m_noticesQueued - m_noticesHandled.load());
+            break;
+        }
+
+        Sleep(10);
+    }
+
+    RethrowHandlerException();
+
+    return handled;
+}
+
+
+void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
+{
+    // Runs on the thread reading the core's output, so only parsing is done
+    // here. Everything else -- the UI, diagnostics, and the notice handler,
+    // any of which may block -- is done on the notice thread.
+
+    // Parsed strictly, so that the line can go into diagnostics as-is
     Json::Value notice;
-    Json::Reader reader;
-    if (!reader.parse(line, notice))
+    string parseErrors;
+    if (!m_noticeReader->parse(line.c_str(), line.c_str() + line.length(), &notice, &parseErrors))
     {
         // If the line contains "panic" or "fatal error", assume the core is crashing and add all further output to diagnostics
         vector<string> PANIC_HEADERS = { "panic", "fatal error" };
@@ -73,7 +192,7 @@ void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
         }
         else
         {
-            my_print(SENSITIVE_FORMAT_ARGS, false, _T("%s: core notice JSON parse failed: %S"), __TFUNCTION__, reader.getFormattedErrorMessages().c_str());
+            my_print(SENSITIVE_FORMAT_ARGS, false, _T("%s: core notice JSON parse failed: %S"), __TFUNCTION__, parseErrors.c_str());
             // This line was not JSON. It's not included in diagnostics
             // as we can't be sure it doesn't include user private data.
         }
@@ -89,52 +208,176 @@ void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
         return;
     }
 
+    CoreNotice coreNotice;
     try
     {
-        string noticeType = notice["noticeType"].asString();
-        string timestamp = notice["timestamp"].asString();
-        Json::Value data = notice["data"];
+        coreNotice.noticeType = notice["noticeType"].asString();
+        coreNotice.timestamp = notice["timestamp"].asString();
+        coreNotice.data = notice["data"];
+    }
+    catch (exception& e)
+    {
+        my_print(SENSITIVE_FORMAT_ARGS, false, _T("%s: core notice JSON parse exception: %S"), __TFUNCTION__, e.what());
+        return;
+    }
+    coreNotice.line = line;
+
+    if (m_recorder)
+    {
+        m_recorder->Record(coreNotice.noticeType, coreNotice.line);
+    }
 
-        // Let the UI know about it and decide if something needs to be shown to the user.
-        if (noticeType != "Info")
+    EnqueueNotice(std::move(coreNotice));
+}
+
+
+void PsiphonTunnelCore::EnqueueNotice(CoreNotice&& notice)
+{
+    static MetricGauge& queueHighWater = MetricsRegistry::Instance().Gauge("core_notices.queue_high_water");
+    static MetricCounter& overflowed = MetricsRegistry::Instance().Counter("core_notices.overflowed");
+
+    m_noticesQueued++;
+
+    // If the ring is full, hold notices here (in order) rather than block
+    // reading the pipe; they're moved to the ring as it drains.
+    if (!m_noticeOverflow.empty() || !m_noticeQueue.TryPush(std::move(notice)))
+    {
+        m_noticeOverflow.push_back(std::move(notice));
+        overflowed.Add();
+        FlushNoticeOverflow();
+    }
+
+    long long depth = (long long)(m_noticeQueue.Size() + m_noticeOverflow.size());
+    if (depth > queueHighWater.Value())
+    {
+        queueHighWater.Set(depth);
+    }
+
+    SetEvent(m_noticeEvent);
+}
+
+
+void PsiphonTunnelCore::FlushNoticeOverflow()
+{
+    while (!m_noticeOverflow.empty() && m_noticeQueue.TryPush(std::move(m_noticeOverflow.front())))
+    {
+        m_noticeOverflow.pop_front();
+    }
+}
+
+
+void PsiphonTunnelCore::RethrowHandlerException()
+{
+    std::exception_ptr handlerException;
+    {
+        AutoMUTEX lock(m_handlerExceptionMutex);
+        std::swap(handlerException, m_handlerException);
+    }
+
+    if (handlerException)
+    {
+        std::rethrow_exception(handlerException);
+    }
+}
+
+
+// static
+DWORD WINAPI PsiphonTunnelCore::NoticeThread(void* object)
+{
+    PsiphonTunnelCore* _this = (PsiphonTunnelCore*)object;
+
+    CoreNotice notice;
+    while (true)
+    {
+        WaitForSingleObject(_this->m_noticeEvent, INFINITE);
+
+        while (!_this->m_stopNoticeThread && _this->m_noticeQueue.TryPop(notice))
         {
-            UI_Notice(line);
+            _this->HandleNotice(notice);
+            _this->m_noticesHandled++;
         }
 
-        // Ensure any sensitive notices are not logged.
-        if (noticeType == "ClientUpgradeDownloaded")
+        if (_this->m_stopNoticeThread)
         {
-            // Don't include in diagnostics as "filename" field in notice data
-            // is private user data
-            logOutputToDiagnostics = false;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+// static
+bool PsiphonTunnelCore::NoticeIsPrivate(const string& noticeType)
+{
+    // ClientUpgradeDownloaded: the "filename" field is private user data
+    // Untunneled: the "address" field is private user data
+    // UpstreamProxyError: the "message" field may contain private user data
+    return noticeType == "ClientUpgradeDownloaded"
+        || noticeType == "Untunneled"
+        || noticeType == "UpstreamProxyError";
+}
+
+
+void PsiphonTunnelCore::HandleNotice(const CoreNotice& notice)
+{
+    // Notices are logged to diagnostics. Some notices are excluded from
+    // diagnostics if they may contain private user data.
+    bool logOutputToDiagnostics = true;
+
+    try
+    {
+        const string& noticeType = notice.noticeType;
+
+        // Let the UI know about it and decide if something needs to be shown to the user.
+        // BytesTransferred is emitted every second and is of no interest to the UI.
+        if (!m_replaying && noticeType != "Info" && noticeType != "BytesTransferred")
+        {
+            UI_Notice(notice.line);
         }
-        else if (noticeType == "Untunneled")
+
+        // Ensure any sensitive notices are not logged.
+        if (NoticeIsPrivate(noticeType))
         {
-            // Don't include in diagnostics as "address" field in notice data
-            // is private user data
             logOutputToDiagnostics = false;
         }
-        else if (noticeType == "UpstreamProxyError")
+        else if (noticeType == "BytesTransferred")
         {
-            // Don't include in diagnostics as "message" field in notice data
-            // may contain private user data
+            // Too frequent to be useful in diagnostics
             logOutputToDiagnostics = false;
         }
 
-        m_noticeHandler->HandlePsiphonTunnelCoreNotice(noticeType, timestamp, data);
+        m_noticeHandler->HandlePsiphonTunnelCoreNotice(noticeType, notice.timestamp, notice.data);
     }
     catch (exception& e)
     {
         my_print(SENSITIVE_FORMAT_ARGS, false, _T("%s: core notice JSON parse exception: %S"), __TFUNCTION__, e.what());
         return;
     }
+    catch (...)
+    {
+        // Other exceptions (e.g., ITransport::TransportFailed) are meant for
+        // the thread consuming output; they're rethrown there. Only the first
+        // is kept.
+        AutoMUTEX lock(m_handlerExceptionMutex);
+        if (!m_handlerException)
+        {
+            m_handlerException = std::current_exception();
+        }
+        return;
+    }
+
+    if (m_replaying)
+    {
+        return;
+    }
 
     // Debug output, flag sensitive to exclude from feedback
-    my_print(SENSITIVE_LOG, true, _T("core notice: %S"), line.c_str());
+    my_print(SENSITIVE_LOG, true, _T("core notice: %S"), notice.line.c_str());
 
     // Add to diagnostics
     if (logOutputToDiagnostics)
     {
-        AddDiagnosticInfoJson("CoreNotice", line.c_str());
+        AddDiagnosticInfoJsonValidated("CoreNotice", notice.line);
     }
 }
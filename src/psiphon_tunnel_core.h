@@ -19,7 +19,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <exception>
 #include "subprocess.h"
+#include "spsc_queue.h"
+
+struct StopInfo;
+class NoticeRecorder;
+
+// How long to wait for queued notices to be handled once the core has exited
+#define NOTICE_DRAIN_TIMEOUT_MS     5000
 
 class IPsiphonTunnelCoreNoticeHandler
 {
@@ -28,6 +38,10 @@ public:
     Called for each Psiphon Tunnel Core notice read from the Psiphon Tunnel
     Core process when ConsumeSubprocessOutput is invoked on a PsiphonTunnelCore
     instance. See ConsumeSubprocessOutput in subprocess.h.
+    Notices are delivered in order, but on the PsiphonTunnelCore's own notice
+    thread rather than the thread calling ConsumeSubprocessOutput. Exceptions
+    other than std::exception are rethrown from ConsumeSubprocessOutput (or
+    WaitForNoticesHandled).
     */
     virtual void HandlePsiphonTunnelCoreNotice(const string& noticeType, const string& timestamp, const Json::Value& data) = 0;
 };
@@ -41,15 +55,81 @@ class PsiphonTunnelCore : public Subprocess, ISubprocessOutputHandler
 public:
     /**
     Initialize a new instance. Throws std::exception if outputHandler is null.
+    If deleteExe is true, the file at exePath will be deleted on cleanup.
     */
-    PsiphonTunnelCore(IPsiphonTunnelCoreNoticeHandler* noticeHandler, const tstring& exePath);
+    PsiphonTunnelCore(IPsiphonTunnelCoreNoticeHandler* noticeHandler, const tstring& exePath, bool deleteExe=true);
     ~PsiphonTunnelCore();
 
+    /**
+    Reads available output and queues the notices for handling (see
+    Subprocess::ConsumeSubprocessOutput). Doesn't wait for the notices to be
+    handled, but rethrows any exception the notice handler has thrown since
+    the last call.
+    */
+    void ConsumeSubprocessOutput();
+
+    /**
+    Waits until every notice queued so far has been handled, then rethrows
+    any exception the notice handler threw. Gives up (returning false) if
+    stopInfo is signalled or timeoutMs passes first, e.g. if the handler is
+    blocked. Must be called on the same thread as ConsumeSubprocessOutput.
+    */
+    bool WaitForNoticesHandled(const StopInfo& stopInfo, DWORD timeoutMs);
+
     // ISubprocessOutputHandler implementation
     void HandleSubprocessOutputLine(const string& line);
 
+    /**
+    Returns true if notices of this type may contain private user data, and so
+    must be kept out of diagnostics and recordings.
+    */
+    static bool NoticeIsPrivate(const string& noticeType);
+
 protected:
+    /**
+    If `replaying`, no core is run (see NoticeReplay): notices are fed in
+    through HandleSubprocessOutputLine, and aren't recorded or passed to the
+    UI, the log or diagnostics.
+    */
+    PsiphonTunnelCore(IPsiphonTunnelCoreNoticeHandler* noticeHandler, const tstring& exePath, bool deleteExe, bool replaying);
+
+    struct CoreNotice
+    {
+        string line;
+        string noticeType;
+        string timestamp;
+        Json::Value data;
+    };
+
+    void EnqueueNotice(CoreNotice&& notice);
+    void FlushNoticeOverflow();
+    void RethrowHandlerException();
+    void HandleNotice(const CoreNotice& notice);
+    static DWORD WINAPI NoticeThread(void* object);
+
     IPsiphonTunnelCoreNoticeHandler *m_noticeHandler;
+    bool m_replaying;
+    // Used only on the thread reading the core's output
+    unique_ptr<Json::CharReader> m_noticeReader;
     bool m_panicked;
+
+    // Notices are parsed on the thread reading the core's output and handed,
+    // through this ring, to the notice thread. The reading thread never waits
+    // on the handler: if the ring is full, notices wait in m_noticeOverflow
+    // (which only the reading thread touches).
+    SPSCQueue<CoreNotice, 256> m_noticeQueue;
+    std::deque<CoreNotice> m_noticeOverflow;
+    unsigned long long m_noticesQueued;
+    std::atomic<unsigned long long> m_noticesHandled;
+    HANDLE m_noticeEvent;
+    HANDLE m_noticeThread;
+    std::atomic<bool> m_stopNoticeThread;
+    bool m_destroying;
+    HANDLE m_handlerExceptionMutex;
+    std::exception_ptr m_handlerException;
+
+    // When Settings::CoreNoticeRecording() is set, each parsed notice is
+    // passed to this, on the thread reading the core's output.
+    unique_ptr<NoticeRecorder> m_recorder;
 };
 
@@ -97,6 +97,9 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
     config["EmitDiagnosticNotices"] = true;
     config["EmitDiagnosticNetworkParameters"] = true;
     config["EmitServerAlerts"] = true;
+    // Feeds TunneledTrafficMeter, which background downloads use to yield to
+    // the user. Only the core carrying the user's tunnel feeds it.
+    config["EmitBytesTransferred"] = (in.tempConnectServerEntry == NULL);
 
     // Don't use an upstream proxy when in VPN mode. If the proxy is on a private network,
     // we may not be able to route to it. If the proxy is on a public network we prefer not
@@ -196,11 +199,19 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
 
         unsigned int localHttpProxyPortSetting = Settings::LocalHttpProxyPort();
         unsigned int localSocksProxyPortSetting = Settings::LocalSocksProxyPort();
-        if (localHttpProxyPortSetting > 0)
+        if (in.localHttpProxyPort > 0)
+        {
+            localHttpProxyPortSetting = in.localHttpProxyPort;
+        }
+        else if (localHttpProxyPortSetting > 0)
         {
             my_print(NOT_SENSITIVE, true, _T("Setting LocalHttpProxyPort to a user configured value"));
         }
-        if (localSocksProxyPortSetting > 0)
+        if (in.localSocksProxyPort > 0)
+        {
+            localSocksProxyPortSetting = in.localSocksProxyPort;
+        }
+        else if (localSocksProxyPortSetting > 0)
         {
             my_print(NOT_SENSITIVE, true, _T("Setting LocalSocksProxyPort to a user configured value"));
         }
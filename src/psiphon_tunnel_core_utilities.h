@@ -43,6 +43,10 @@ struct WriteParameterFilesIn {
     string upstreamProxyAddress;
     Json::Value encodedAuthorizations;
     const ServerEntry* tempConnectServerEntry;
+    // If non-zero, used in place of the user configured local proxy ports.
+    // Used to keep the ports unchanged when the core is restarted in place.
+    unsigned int localHttpProxyPort = 0;
+    unsigned int localSocksProxyPort = 0;
 };
 
 // Ouput information from WriteParameterFiles
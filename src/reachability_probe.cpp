@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include <WinSock2.h>
+#include <random>
+#include "reachability_probe.h"
+#include "logging.h"
+#include "metrics.h"
+#include "usersettings.h"
+#include "utilities.h"
+
+
+/***********************************************************************
+Probes
+*/
+
+// Connecting is all that's checked. This is the only option for OSSH, which
+// waits for the client to speak and doesn't answer malformed input.
+class TCPConnectProbe : public ReachabilityProbe
+{
+public:
+    const char* Name() const { return "tcp"; }
+    DWORD TimeoutMs() const { return 3000; }
+    string Request(const ServerEntry&) const { return ""; }
+    Response CheckResponse(const string&, bool) const { return RESPONSE_OK; }
+};
+
+
+// Sends a TLS ClientHello and expects a TLS record back: a ServerHello, or
+// at least an alert. Either shows the TLS stack is answering.
+class TLSClientHelloProbe : public ReachabilityProbe
+{
+public:
+    const char* Name() const { return "tls"; }
+    DWORD TimeoutMs() const { return 4000; }
+
+    string Request(const ServerEntry&) const
+    {
+        static const unsigned char CIPHER_SUITES[] = {
+            0xc0, 0x2f, 0xc0, 0x30, 0xc0, 0x2b, 0xc0, 0x2c,
+            0x00, 0x9c, 0x00, 0x9d, 0x00, 0x2f, 0x00, 0x35 };
+        static const unsigned char EXTENSIONS[] = {
+            // supported_groups: secp256r1, secp384r1
+            0x00, 0x0a, 0x00, 0x06, 0x00, 0x04, 0x00, 0x17, 0x00, 0x18,
+            // ec_point_formats: uncompressed
+            0x00, 0x0b, 0x00, 0x02, 0x01, 0x00,
+            // signature_algorithms: rsa_pkcs1 and ecdsa with sha256/384, rsa_pkcs1_sha1
+            0x00, 0x0d, 0x00, 0x0a, 0x00, 0x08,
+            0x04, 0x01, 0x05, 0x01, 0x04, 0x03, 0x05, 0x03, 0x02, 0x01 };
+
+        string body;
+        body += "\x03\x03"; // TLS 1.2
+        std::random_device random;
+        for (int i = 0; i < 32; i++)
+        {
+            body += (char)(random() & 0xFF);
+        }
+        body += '\x00'; // no session ID
+        AppendLength(body, sizeof(CIPHER_SUITES), 2);
+        body.append((const char*)CIPHER_SUITES, sizeof(CIPHER_SUITES));
+        body += "\x01\x00"; // null compression only
+        AppendLength(body, sizeof(EXTENSIONS), 2);
+        body.append((const char*)EXTENSIONS, sizeof(EXTENSIONS));
+
+        string handshake;
+        handshake += '\x01'; // ClientHello
+        AppendLength(handshake, body.length(), 3);
+        handshake += body;
+
+        string record;
+        record += "\x16\x03\x01"; // handshake record
+        AppendLength(record, handshake.length(), 2);
+        record += handshake;
+        return record;
+    }
+
+    Response CheckResponse(const string& received, bool closed) const
+    {
+        // A record header is content type, version (3, x), length
+        if (received.length() >= 5)
+        {
+            unsigned char contentType = (unsigned char)received[0];
+            bool isTLS = (contentType == 0x16 || contentType == 0x15) && received[1] == '\x03';
+            return isTLS ? RESPONSE_OK : RESPONSE_BAD;
+        }
+        return closed ? RESPONSE_BAD : RESPONSE_INCOMPLETE;
+    }
+
+private:
+    static void AppendLength(string& s, size_t length, int bytes)
+    {
+        for (int i = bytes - 1; i >= 0; i--)
+        {
+            s += (char)((length >> (8 * i)) & 0xFF);
+        }
+    }
+};
+
+
+// Sends an HTTP HEAD request, as a meek client's first request would be
+// over plain HTTP, and expects an HTTP response of any status.
+class HTTPHeadProbe : public ReachabilityProbe
+{
+public:
+    const char* Name() const { return "http"; }
+    DWORD TimeoutMs() const { return 4000; }
+
+    string Request(const ServerEntry& entry) const
+    {
+        const string& host = entry.meekFrontingHost.empty() ? entry.serverAddress : entry.meekFrontingHost;
+        return "HEAD / HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+    }
+
+    Response CheckResponse(const string& received, bool closed) const
+    {
+        static const string STATUS_LINE_PREFIX = "HTTP/1.";
+        if (received.length() >= STATUS_LINE_PREFIX.length())
+        {
+            return received.compare(0, STATUS_LINE_PREFIX.length(), STATUS_LINE_PREFIX) == 0 ? RESPONSE_OK : RESPONSE_BAD;
+        }
+        return closed ? RESPONSE_BAD : RESPONSE_INCOMPLETE;
+    }
+};
+
+
+static const TCPConnectProbe g_tcpConnectProbe;
+static const TLSClientHelloProbe g_tlsClientHelloProbe;
+static const HTTPHeadProbe g_httpHeadProbe;
+
+
+const ReachabilityProbe* ChooseReachabilityProbe(const ServerEntry& entry, DWORD reorderProbes, int& o_port)
+{
+    o_port = -1;
+
+    if (reorderProbes != REORDER_PROBES_TCP_ONLY)
+    {
+        // Meek runs over HTTP(S), so the probe can exercise the server's
+        // actual web stack. (FRONTED-MEEK isn't probed this way: the
+        // connection would be to the CDN, not the server.)
+        if (entry.meekServerPort > 0 && entry.HasCapability("UNFRONTED-MEEK-HTTPS"))
+        {
+            o_port = entry.meekServerPort;
+            return &g_tlsClientHelloProbe;
+        }
+        if (entry.meekServerPort > 0 && entry.HasCapability("UNFRONTED-MEEK"))
+        {
+            o_port = entry.meekServerPort;
+            return &g_httpHeadProbe;
+        }
+        // The web server used for handshakes is HTTPS
+        if (!entry.HasCapability("OSSH") && !entry.HasCapability("SSH")
+            && entry.HasCapability("handshake") && entry.webServerPort > 0)
+        {
+            o_port = entry.webServerPort;
+            return &g_tlsClientHelloProbe;
+        }
+    }
+
+    o_port = entry.GetPreferredReachablityTestPort();
+    return o_port == -1 ? NULL : &g_tcpConnectProbe;
+}
+
+
+/***********************************************************************
+Engine
+*/
+
+enum ProbeState
+{
+    PROBE_CONNECTING,
+    PROBE_SENDING,
+    PROBE_RECEIVING,
+    PROBE_DONE
+};
+
+struct ProbeIO
+{
+    SOCKET sock;
+    ProbeState state;
+    DWORD startTime;
+    string request;
+    size_t sent;
+    string received;
+};
+
+static void FinishProbe(ReachabilityProbeTask& task, ProbeIO& io, bool success)
+{
+    static MetricHistogram& probeRTT = MetricsRegistry::Instance().Histogram("reorder.probe_rtt_ms");
+
+    task.responded = success;
+    task.responseTime = GetTickCountDiff(io.startTime, GetTickCount());
+    if (success)
+    {
+        probeRTT.Record(task.responseTime);
+    }
+
+    if (io.sock != INVALID_SOCKET)
+    {
+        closesocket(io.sock);
+        io.sock = INVALID_SOCKET;
+    }
+    io.state = PROBE_DONE;
+}
+
+static void CheckProbeResponse(ReachabilityProbeTask& task, ProbeIO& io, bool closed)
+{
+    ReachabilityProbe::Response response = task.probe->CheckResponse(io.received, closed);
+    if (response != ReachabilityProbe::RESPONSE_INCOMPLETE)
+    {
+        FinishProbe(task, io, response == ReachabilityProbe::RESPONSE_OK);
+    }
+    else if (closed)
+    {
+        FinishProbe(task, io, false);
+    }
+}
+
+void RunReachabilityProbes(vector<ReachabilityProbeTask>& tasks, const StopInfo& stopInfo)
+{
+    WSADATA wsaData;
+    if (0 != WSAStartup(MAKEWORD(2, 2), &wsaData))
+    {
+        return;
+    }
+
+    vector<ProbeIO> ios(tasks.size());
+    size_t remaining = 0;
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        ReachabilityProbeTask& task = tasks[i];
+        ProbeIO& io = ios[i];
+        io.startTime = GetTickCount();
+        io.sent = 0;
+        io.state = PROBE_CONNECTING;
+        io.sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        sockaddr_in serverAddr;
+        ZeroMemory(&serverAddr, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = inet_addr(task.entry.serverAddress.c_str());
+        serverAddr.sin_port = htons((unsigned short)task.port);
+
+        u_long nonBlocking = 1;
+        if (INVALID_SOCKET == io.sock
+            || 0 != ioctlsocket(io.sock, FIONBIO, &nonBlocking)
+            || (SOCKET_ERROR == connect(io.sock, (SOCKADDR*)&serverAddr, sizeof(serverAddr))
+                && WSAEWOULDBLOCK != WSAGetLastError()))
+        {
+            FinishProbe(task, io, false);
+            continue;
+        }
+
+        io.request = task.probe->Request(task.entry);
+        remaining++;
+    }
+
+    // select() handles at most FD_SETSIZE sockets per set; callers keep the
+    // task count well under that.
+    assert(tasks.size() <= FD_SETSIZE);
+
+    while (remaining > 0)
+    {
+        if (stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, false))
+        {
+            break;
+        }
+
+        fd_set readSet, writeSet, exceptSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        FD_ZERO(&exceptSet);
+
+        DWORD now = GetTickCount();
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            ProbeIO& io = ios[i];
+            if (io.state == PROBE_DONE)
+            {
+                continue;
+            }
+            if (GetTickCountDiff(io.startTime, now) >= tasks[i].probe->TimeoutMs())
+            {
+                FinishProbe(tasks[i], io, false);
+                remaining--;
+                continue;
+            }
+
+            if (io.state == PROBE_CONNECTING)
+            {
+                FD_SET(io.sock, &writeSet);
+                // Windows reports a failed connect in the except set
+                FD_SET(io.sock, &exceptSet);
+            }
+            else if (io.state == PROBE_SENDING)
+            {
+                FD_SET(io.sock, &writeSet);
+            }
+            else
+            {
+                FD_SET(io.sock, &readSet);
+            }
+        }
+
+        if (remaining == 0)
+        {
+            break;
+        }
+
+        // Short, so that stop signals and timeouts are noticed promptly
+        timeval timeout = { 0, 100 * 1000 };
+        int ready = select(0, &readSet, &writeSet, &exceptSet, &timeout);
+        if (ready == SOCKET_ERROR)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s: select failed (%d)"), __TFUNCTION__, WSAGetLastError());
+            break;
+        }
+        if (ready == 0)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            ReachabilityProbeTask& task = tasks[i];
+            ProbeIO& io = ios[i];
+            if (io.state == PROBE_DONE)
+            {
+                continue;
+            }
+
+            if (FD_ISSET(io.sock, &exceptSet))
+            {
+                FinishProbe(task, io, false);
+            }
+            else if (io.state == PROBE_CONNECTING && FD_ISSET(io.sock, &writeSet))
+            {
+                if (io.request.empty())
+                {
+                    FinishProbe(task, io, task.probe->CheckResponse("", false) == ReachabilityProbe::RESPONSE_OK);
+                }
+                else
+                {
+                    io.state = PROBE_SENDING;
+                }
+            }
+            else if (io.state == PROBE_SENDING && FD_ISSET(io.sock, &writeSet))
+            {
+                int sent = send(io.sock, io.request.c_str() + io.sent, (int)(io.request.length() - io.sent), 0);
+                if (sent == SOCKET_ERROR)
+                {
+                    if (WSAGetLastError() != WSAEWOULDBLOCK)
+                    {
+                        FinishProbe(task, io, false);
+                    }
+                }
+                else
+                {
+                    io.sent += sent;
+                    if (io.sent == io.request.length())
+                    {
+                        io.state = PROBE_RECEIVING;
+                    }
+                }
+            }
+            else if (io.state == PROBE_RECEIVING && FD_ISSET(io.sock, &readSet))
+            {
+                char buffer[512];
+                int received = recv(io.sock, buffer, sizeof(buffer), 0);
+                if (received == SOCKET_ERROR)
+                {
+                    if (WSAGetLastError() != WSAEWOULDBLOCK)
+                    {
+                        FinishProbe(task, io, false);
+                    }
+                }
+                else
+                {
+                    io.received.append(buffer, received);
+                    CheckProbeResponse(task, io, received == 0);
+                }
+            }
+
+            if (io.state == PROBE_DONE)
+            {
+                remaining--;
+            }
+        }
+    }
+
+    // Stopped: whatever hasn't finished has failed
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        if (ios[i].state != PROBE_DONE)
+        {
+            FinishProbe(tasks[i], ios[i], false);
+        }
+    }
+
+    WSACleanup();
+}
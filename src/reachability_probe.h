@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include "serverlist.h"
+#include "stopsignal.h"
+
+
+/**
+A ReachabilityProbe is a way of checking that a server is responsive: a TCP
+connect, optionally followed by a request whose response shows that the
+server's protocol stack -- not just its TCP listener -- is working.
+Probes are stateless; RunReachabilityProbes does the I/O.
+*/
+class ReachabilityProbe
+{
+public:
+    enum Response
+    {
+        RESPONSE_INCOMPLETE, // keep reading
+        RESPONSE_OK,
+        RESPONSE_BAD
+    };
+
+    virtual ~ReachabilityProbe() {}
+
+    // For logs and diagnostics
+    virtual const char* Name() const = 0;
+
+    // The whole probe, connect included, must complete within this time
+    virtual DWORD TimeoutMs() const = 0;
+
+    // Bytes to send once connected. If empty, connecting is success.
+    virtual string Request(const ServerEntry& entry) const = 0;
+
+    // Called with everything received so far. `closed` is true if the server
+    // has closed the connection, in which case there's no more to come.
+    virtual Response CheckResponse(const string& received, bool closed) const = 0;
+};
+
+
+/**
+Returns the probe to use for the server, and the port to probe, according to
+the server's capabilities and `reorderProbes` (the value of
+Settings::ReorderProbes()). Returns NULL if the server can't be probed.
+*/
+const ReachabilityProbe* ChooseReachabilityProbe(const ServerEntry& entry, DWORD reorderProbes, int& o_port);
+
+
+struct ReachabilityProbeTask
+{
+    ReachabilityProbeTask(const ServerEntry& entry, const ReachabilityProbe* probe, int port)
+        : entry(entry), probe(probe), port(port), responded(false), responseTime(UINT_MAX)
+    {
+    }
+
+    ServerEntry entry;
+    const ReachabilityProbe* probe;
+    int port;
+
+    // Results
+    bool responded;
+    unsigned int responseTime;  // milliseconds
+};
+
+
+/**
+Runs all the probes at once, on the calling thread, using non-blocking
+sockets. Returns when every probe has completed or timed out, or when
+stopInfo is signalled (in which case unfinished probes have failed).
+*/
+void RunReachabilityProbes(vector<ReachabilityProbeTask>& tasks, const StopInfo& stopInfo);
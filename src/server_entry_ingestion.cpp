@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "server_entry_ingestion.h"
+#include "config.h"
+#include "logging.h"
+#include "metrics.h"
+#include "transport_registry.h"
+#include "utilities.h"
+
+#pragma warning(push, 0)
+#include "sha.h"
+#pragma warning(pop)
+
+
+// Bounds the memory used to remember ingested entries; a long session with
+// many fetches will just re-decode a few entries after it's reset.
+static const size_t MAX_INGESTED_DIGESTS = 8192;
+
+
+// Entries are deduped by a cryptographic digest rather than std::hash, so
+// that a collision can't cause a valid entry to be dropped.
+static string EncodedEntryDigest(const string& encoded)
+{
+    byte digest[CryptoPP::SHA256::DIGESTSIZE];
+    CryptoPP::SHA256().CalculateDigest(digest, (const byte*)encoded.data(), encoded.length());
+    return string((const char*)digest, sizeof(digest));
+}
+
+
+// static
+ServerEntryIngestion& ServerEntryIngestion::Instance()
+{
+    static ServerEntryIngestion instance;
+    return instance;
+}
+
+ServerEntryIngestion::ServerEntryIngestion()
+    : m_thread(NULL),
+      m_submitted(0),
+      m_ingested(0),
+      m_stop(false)
+{
+    m_thread = CreateThread(0, 0, IngestionThread, (void*)this, 0, 0);
+    if (m_thread == NULL)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d); ingesting synchronously"), __TFUNCTION__, GetLastError());
+    }
+}
+
+ServerEntryIngestion::~ServerEntryIngestion()
+{
+    if (m_thread != NULL)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_stop = true;
+            m_changed.notify_all();
+        }
+        // Pending entries are merged before the thread exits
+        WaitForSingleObject(m_thread, TERMINATE_PROCESS_WAIT_MS);
+        CloseHandle(m_thread);
+    }
+}
+
+void ServerEntryIngestion::Submit(const vector<string>& encodedServerEntries, const ServerEntry* serverEntry)
+{
+    if (encodedServerEntries.empty() && !serverEntry)
+    {
+        return;
+    }
+
+    Submission submission;
+    submission.encodedServerEntries = encodedServerEntries;
+    submission.hasServerEntry = (serverEntry != NULL);
+    if (serverEntry)
+    {
+        submission.serverEntry = *serverEntry;
+    }
+
+    if (m_thread == NULL)
+    {
+        deque<Submission> batch;
+        batch.push_back(std::move(submission));
+        std::unique_lock<std::mutex> lock(m_lock);
+        Ingest(batch);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_pending.push_back(std::move(submission));
+    m_submitted++;
+    m_changed.notify_all();
+}
+
+bool ServerEntryIngestion::Flush(DWORD timeoutMs/*=INFINITE*/)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    unsigned long long target = m_submitted;
+    auto done = [&]() { return m_ingested >= target; };
+
+    if (timeoutMs == INFINITE)
+    {
+        m_changed.wait(lock, done);
+        return true;
+    }
+    return m_changed.wait_for(lock, std::chrono::milliseconds(timeoutMs), done);
+}
+
+// static
+DWORD WINAPI ServerEntryIngestion::IngestionThread(void* object)
+{
+    ServerEntryIngestion* _this = (ServerEntryIngestion*)object;
+    _this->Run();
+    return 0;
+}
+
+void ServerEntryIngestion::Run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (true)
+    {
+        m_changed.wait(lock, [&]() { return m_stop || !m_pending.empty(); });
+
+        if (m_pending.empty())
+        {
+            // Stopped, and nothing left to ingest
+            return;
+        }
+
+        // Let submissions that arrive close together -- e.g., a handshake
+        // and a remote server list fetch at connect time -- share a merge.
+        if (!m_stop)
+        {
+            m_changed.wait_for(
+                lock,
+                std::chrono::milliseconds(SERVER_ENTRY_INGESTION_BATCH_WINDOW_MS),
+                [&]() { return m_stop; });
+        }
+
+        deque<Submission> batch;
+        batch.swap(m_pending);
+
+        lock.unlock();
+        Ingest(batch);
+        lock.lock();
+
+        m_ingested += batch.size();
+        m_changed.notify_all();
+    }
+}
+
+void ServerEntryIngestion::Ingest(deque<Submission>& batch)
+{
+    static MetricCounter& batches = MetricsRegistry::Instance().Counter("server_entries.ingest_batches");
+    static MetricCounter& duplicates = MetricsRegistry::Instance().Counter("server_entries.duplicates_dropped");
+    static MetricCounter& invalid = MetricsRegistry::Instance().Counter("server_entries.invalid_dropped");
+    static MetricHistogram& mergeTime = MetricsRegistry::Instance().Histogram("server_entries.merge_ms");
+
+    batches.Add();
+
+    std::unordered_set<string> newDigests;
+    ServerEntries decoded;
+    ServerEntries submittedEntries;
+
+    for (const auto& submission : batch)
+    {
+        for (const auto& encoded : submission.encodedServerEntries)
+        {
+            // Dedupe
+            string digest = EncodedEntryDigest(encoded);
+            if (m_ingestedDigests.count(digest) > 0 || newDigests.count(digest) > 0)
+            {
+                duplicates.Add();
+                continue;
+            }
+
+            // Decode
+            ServerEntry entry;
+            try
+            {
+                entry = ServerList::ParseServerEntry(encoded);
+            }
+            catch (std::exception& ex)
+            {
+                my_print(NOT_SENSITIVE, false, string("Dropping corrupt server entry: ") + ex.what());
+                invalid.Add();
+                continue;
+            }
+
+            // Validate
+            if (entry.serverAddress.empty() || entry.webServerCertificate == "None")
+            {
+                invalid.Add();
+                continue;
+            }
+
+            newDigests.insert(std::move(digest));
+            decoded.push_back(entry);
+        }
+
+        if (submission.hasServerEntry)
+        {
+            submittedEntries.push_back(submission.serverEntry);
+        }
+    }
+
+    // Entries given to us already decoded are the current server's, with the
+    // most recent info, so they go last and win the by-address dedupe.
+    decoded.insert(decoded.end(), submittedEntries.begin(), submittedEntries.end());
+
+    // Later entries for the same address supersede earlier ones, as they
+    // would have if merged one submission at a time.
+    ServerEntries entries;
+    std::unordered_set<string> addresses;
+    for (auto it = decoded.rbegin(); it != decoded.rend(); ++it)
+    {
+        if (addresses.insert(it->serverAddress).second)
+        {
+            entries.push_back(*it);
+        }
+    }
+
+    if (entries.empty())
+    {
+        return;
+    }
+
+    // Merge and persist
+    DWORD start = GetTickCount();
+    try
+    {
+        TransportRegistry::MergeServerEntries(entries);
+    }
+    catch (std::exception& ex)
+    {
+        my_print(NOT_SENSITIVE, false, string("Server entry merge failed: ") + ex.what());
+        return;
+    }
+    mergeTime.Record(GetTickCount() - start);
+
+    if (m_ingestedDigests.size() + newDigests.size() > MAX_INGESTED_DIGESTS)
+    {
+        m_ingestedDigests.clear();
+    }
+    m_ingestedDigests.insert(newDigests.begin(), newDigests.end());
+}
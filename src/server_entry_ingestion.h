@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_set>
+#include "serverlist.h"
+
+
+/**
+ServerEntryIngestion is the single path by which newly received server
+entries (remote server list fetches, handshake discovery, the current
+server's own entry) get into the transports' server lists.
+
+Sources submit entries and return immediately. A background thread runs the
+stages:
+  dedupe -- exact duplicate encoded entries are dropped by SHA-256 digest,
+            before they're decoded
+  decode -- hex-encoded entries are parsed; corrupt entries are dropped
+  validate -- entries without an address, or that are disabled, are dropped
+  merge -- submissions that arrive within a short window of each other are
+           merged together, once per transport, by TransportRegistry
+  persist -- each transport's list is written once per batch
+*/
+class ServerEntryIngestion
+{
+public:
+    static ServerEntryIngestion& Instance();
+
+    /**
+    Queues encoded entries, and optionally an already decoded entry, for
+    ingestion. Doesn't block on decoding or merging.
+    */
+    void Submit(const vector<string>& encodedServerEntries, const ServerEntry* serverEntry);
+
+    /**
+    Waits up to `timeoutMs` for everything submitted so far to be merged.
+    Returns false on timeout.
+    */
+    bool Flush(DWORD timeoutMs = INFINITE);
+
+private:
+    ServerEntryIngestion();
+    virtual ~ServerEntryIngestion();
+
+    // not copyable
+    ServerEntryIngestion(ServerEntryIngestion const&);
+    ServerEntryIngestion& operator=(ServerEntryIngestion const&);
+
+    struct Submission
+    {
+        vector<string> encodedServerEntries;
+        bool hasServerEntry;
+        ServerEntry serverEntry;
+    };
+
+    static DWORD WINAPI IngestionThread(void* object);
+    void Run();
+    void Ingest(deque<Submission>& batch);
+
+    HANDLE m_thread;
+
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    deque<Submission> m_pending;
+    unsigned long long m_submitted;
+    unsigned long long m_ingested;
+    bool m_stop;
+
+    // SHA-256 digests of encoded entries that have already been merged. Only
+    // touched by the ingestion thread (or under m_lock, if there isn't one).
+    std::unordered_set<string> m_ingestedDigests;
+};
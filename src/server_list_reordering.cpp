@@ -18,22 +18,173 @@
  */
 
 #include "stdafx.h"
-#include <WinSock2.h>
 #include "logging.h"
 #include "config.h"
 #include "psiclient.h"
 #include "utilities.h"
 #include "diagnostic_info.h"
 #include "server_list_reordering.h"
-
-
-const int MAX_WORKER_THREADS = 30;
-const int MAX_CHECK_TIME_MILLISECONDS = 5000;
+#include "reachability_probe.h"
+#include "span_tracer.h"
+#include "metrics.h"
+#include "usersettings.h"
+#include <algorithm>
+
+
+// The probe budget for a pass adapts between these bounds (the upper one is
+// under select()'s FD_SETSIZE), aiming to find TARGET_FAST_RESPONDERS.
+const size_t MIN_PROBES = 15;
+const size_t DEFAULT_PROBES = 30;
+const size_t MAX_PROBES = 60;
+const size_t TARGET_FAST_RESPONDERS = 5;
+// This fraction of the budget goes to the head of the list, which holds the
+// servers most recently found to be good.
+const size_t HEAD_PROBES_DIVISOR = 4;
 const int RESPONSE_TIME_THRESHOLD_FACTOR = 2;
 
 void ReorderServerList(ServerList& serverList, const StopInfo& stopInfo);
 
 
+/*
+ReorderSamplePlanner picks which servers a reorder pass probes.
+
+Beyond the head of the list, candidates are grouped into strata by region and
+probe kind (which follows from capabilities), and the budget is dealt out
+round-robin across strata, taking the least recently measured server from
+each. Over successive passes this works through the whole list while keeping
+every region and kind represented in each pass.
+
+Measurement times and the budget live for the life of the process.
+*/
+class ReorderSamplePlanner
+{
+public:
+    ReorderSamplePlanner() : m_budget(DEFAULT_PROBES)
+    {
+        m_mutex = CreateMutex(NULL, FALSE, 0);
+    }
+
+    virtual ~ReorderSamplePlanner()
+    {
+        CloseHandle(m_mutex);
+    }
+
+    vector<ReachabilityProbeTask> Plan(const ServerEntries& serverEntries, DWORD reorderProbes)
+    {
+        AutoMUTEX lock(m_mutex);
+
+        vector<ReachabilityProbeTask> tasks;
+
+        struct Candidate
+        {
+            size_t index;
+            const ReachabilityProbe* probe;
+            int port;
+            ULONGLONG lastMeasured;
+        };
+        map<string, vector<Candidate>> strata;
+
+        size_t headProbes = m_budget / HEAD_PROBES_DIVISOR;
+
+        for (size_t i = 0; i < serverEntries.size(); i++)
+        {
+            const ServerEntry& entry = serverEntries[i];
+            int port;
+            const ReachabilityProbe* probe = ChooseReachabilityProbe(entry, reorderProbes, port);
+            if (probe == NULL)
+            {
+                continue;
+            }
+
+            if (tasks.size() < headProbes)
+            {
+                tasks.push_back(ReachabilityProbeTask(entry, probe, port));
+                continue;
+            }
+
+            Candidate candidate = { i, probe, port, 0 };
+            auto measured = m_lastMeasured.find(entry.serverAddress);
+            if (measured != m_lastMeasured.end())
+            {
+                candidate.lastMeasured = measured->second;
+            }
+            strata[entry.region + "/" + probe->Name()].push_back(candidate);
+        }
+
+        // Least recently measured (never measured being least) first, with
+        // ties in random order.
+        vector<vector<Candidate>*> queues;
+        for (auto& stratum : strata)
+        {
+            vector<Candidate>& candidates = stratum.second;
+            ShuffleVector(candidates.begin(), candidates.end());
+            stable_sort(candidates.begin(), candidates.end(),
+                [](const Candidate& a, const Candidate& b) { return a.lastMeasured < b.lastMeasured; });
+            // Taken from the back
+            reverse(candidates.begin(), candidates.end());
+            queues.push_back(&candidates);
+        }
+        ShuffleVector(queues.begin(), queues.end());
+
+        while (tasks.size() < m_budget)
+        {
+            bool added = false;
+            for (auto queue : queues)
+            {
+                if (queue->empty() || tasks.size() >= m_budget)
+                {
+                    continue;
+                }
+                const Candidate& candidate = queue->back();
+                tasks.push_back(ReachabilityProbeTask(serverEntries[candidate.index], candidate.probe, candidate.port));
+                queue->pop_back();
+                added = true;
+            }
+            if (!added)
+            {
+                break;
+            }
+        }
+
+        my_print(NOT_SENSITIVE, true, _T("%s: probing %d of %d servers in %d strata"), __TFUNCTION__, (int)tasks.size(), (int)serverEntries.size(), (int)strata.size());
+
+        return tasks;
+    }
+
+    void Completed(const vector<ReachabilityProbeTask>& tasks, size_t fastResponders)
+    {
+        AutoMUTEX lock(m_mutex);
+
+        ULONGLONG now = GetTickCount64();
+        for (const auto& task : tasks)
+        {
+            m_lastMeasured[task.entry.serverAddress] = now;
+        }
+
+        // Widen the net when the pass found few good servers; narrow it when
+        // good servers are plentiful.
+        if (fastResponders < TARGET_FAST_RESPONDERS)
+        {
+            m_budget = min(MAX_PROBES, m_budget + m_budget / 2);
+        }
+        else if (fastResponders > TARGET_FAST_RESPONDERS * 3)
+        {
+            m_budget = max(MIN_PROBES, m_budget - m_budget / 4);
+        }
+
+        static MetricGauge& budget = MetricsRegistry::Instance().Gauge("reorder.probe_budget");
+        budget.Set((long long)m_budget);
+    }
+
+private:
+    HANDLE m_mutex;
+    size_t m_budget;
+    map<string, ULONGLONG> m_lastMeasured;
+};
+
+static ReorderSamplePlanner g_reorderSamplePlanner;
+
+
 ServerListReorder::ServerListReorder()
     : m_thread(NULL), m_serverList(0)
 {
@@ -114,160 +265,18 @@ DWORD WINAPI ServerListReorder::ReorderServerListThread(void* data)
 }
 
 
-struct WorkerThreadData
-{
-    ServerEntry m_entry;
-    bool m_responded;
-    unsigned int m_responseTime;
-    StopInfo m_stopInfo;
-
-    WorkerThreadData(ServerEntry entry, StopInfo stopInfo)
-        : m_entry(entry),
-          m_responded(false),
-          m_responseTime(UINT_MAX),
-          m_stopInfo(stopInfo)
-    {
-    }
-};
-
-
-DWORD WINAPI CheckServerReachabilityThread(void* object)
-{
-    WorkerThreadData* data = (WorkerThreadData*)object;
-
-    // Test for reachability by establishing a TCP socket
-    // connection to the specified port on the target host.
-
-    DWORD start_time = GetTickCount();
-
-    bool success = true;
-
-    WSADATA wsaData;
-    WSAStartup(MAKEWORD(2, 2), &wsaData);
-    sockaddr_in serverAddr;
-    WSAEVENT connectedEvent = NULL;
-    WSANETWORKEVENTS networkEvents;
-    SOCKET sock = INVALID_SOCKET;
-
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = inet_addr(data->m_entry.serverAddress.c_str());
-    // NOTE: we've already checked for the presence of a reachability port below
-    serverAddr.sin_port = htons((unsigned short)data->m_entry.GetPreferredReachablityTestPort());
-
-    connectedEvent = WSACreateEvent();
-
-    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-    if (INVALID_SOCKET == sock ||
-        0 != WSAEventSelect(sock, connectedEvent, FD_CONNECT) ||
-        SOCKET_ERROR != connect(sock, (SOCKADDR*)&serverAddr, sizeof(serverAddr)) ||
-        WSAEWOULDBLOCK != WSAGetLastError())
-    {
-        success = false;
-    }
-
-    while (success)
-    {
-        DWORD waitResult = WSAWaitForMultipleEvents(1, &connectedEvent, TRUE, 100, FALSE);
-
-        if (WSA_WAIT_EVENT_0 == waitResult
-            && 0 == WSAEnumNetworkEvents(sock, connectedEvent, &networkEvents)
-            && (networkEvents.lNetworkEvents & FD_CONNECT)
-            && networkEvents.iErrorCode[FD_CONNECT_BIT] == 0)
-        {
-            // Successfully connected
-            break;
-        }
-
-        // Check for stop (abort) signal
-        if (data->m_stopInfo.stopSignal->CheckSignal(data->m_stopInfo.stopReasons, false))
-        {
-            success = false;
-            break;
-        }
-    }
-
-    closesocket(sock);
-    WSACloseEvent(connectedEvent);
-    WSACleanup();
-
-    DWORD end_time = GetTickCount(); // GetTickCount can wrap
-
-    data->m_responseTime = (end_time >= start_time) ?
-                           (end_time - start_time) :
-                           (0xFFFFFFFF - start_time + end_time);
-
-    data->m_responded = success;
-
-    return 0;
-}
-
-
 void ReorderServerList(ServerList& serverList, const StopInfo& stopInfo)
 {
-    ServerEntries serverEntries = serverList.GetList();
+    ScopedSpan span("ReorderServerList");
 
-    // Check response time from each server (in parallel).
-    // At most the first MAX_WORKER_THREADS servers in the
-    // current server list will be checked. We select the
-    // first MAX/2 server from the top of the list (they
-    // may be better/fresher) and then MAX/2 random servers
-    // from the rest of the list (they may be underused).
-
-    // TODO: use a thread pool?
-
-    vector<HANDLE> threadHandles;
-    vector<WorkerThreadData*> threadData;
-
-    if (serverEntries.size() > MAX_WORKER_THREADS)
-    {
-        ShuffleVector(serverEntries.begin() + MAX_WORKER_THREADS / 2, serverEntries.end());
-    }
-
-    for (ServerEntryIterator entry = serverEntries.begin(); entry != serverEntries.end(); ++entry)
-    {
-        if (-1 != entry->GetPreferredReachablityTestPort())
-        {
-            WorkerThreadData* data = new WorkerThreadData(*entry, stopInfo);
-
-            HANDLE threadHandle = CreateThread(0, 0, CheckServerReachabilityThread, (void*)data, 0, 0);
-            if (!threadHandle)
-            {
-                continue;
-            }
-
-            threadHandles.push_back(threadHandle);
-            threadData.push_back(data);
-
-            if (threadHandles.size() >= MAX_WORKER_THREADS)
-            {
-                break;
-            }
-        }
-    }
-
-    // Wait for all threads to finish
-
-    // TODO: stop waiting early if all threads finish?
+    ServerEntries serverEntries = serverList.GetList();
 
-    for (int waits = 0; waits < MAX_CHECK_TIME_MILLISECONDS/100; waits++)
-    {
-        Sleep(100);
+    // Check response time from a sample of servers (in parallel).
+    // See ReorderSamplePlanner.
 
-        if (stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons))
-        {
-            // Stop waiting early if exiting the app, etc.
-            // NOTE: we still process results in this case
-            break;
-        }
-    }
-    stopInfo.stopSignal->SignalStop(STOP_REASON_CANCEL);
+    vector<ReachabilityProbeTask> tasks = g_reorderSamplePlanner.Plan(serverEntries, Settings::ReorderProbes());
 
-    for (vector<HANDLE>::iterator handle = threadHandles.begin(); handle != threadHandles.end(); ++handle)
-    {
-        WaitForSingleObject(*handle, INFINITE);
-        CloseHandle(*handle);
-    }
+    RunReachabilityProbes(tasks, stopInfo);
 
     // Build a list of all servers that responded within the threshold
     // time (+100%) of the best server. Using the best server as a base
@@ -276,42 +285,57 @@ void ReorderServerList(ServerList& serverList, const StopInfo& stopInfo)
     // resulting list for some client-side load balancing. Any server
     // that meets the threshold is considered equally qualified for
     // any position towards the top of the list.
+    // The best server is taken per kind of probe, as a TLS or HTTP round
+    // trip naturally takes longer than a bare TCP connect.
 
-    unsigned int fastestResponseTime = UINT_MAX;
+    map<string, unsigned int> fastestResponseTimes;
 
-    for (vector<WorkerThreadData*>::iterator data = threadData.begin(); data != threadData.end(); ++data)
+    for (vector<ReachabilityProbeTask>::const_iterator task = tasks.begin(); task != tasks.end(); ++task)
     {
         my_print(
             SENSITIVE_LOG,
             true,
-            _T("server: %s, responded: %s, response time: %d"),
-            UTF8ToWString((*data)->m_entry.serverAddress).c_str(),
-            (*data)->m_responded ? L"yes" : L"no",
-            (*data)->m_responseTime);
+            _T("server: %s, probe: %S, responded: %s, response time: %d"),
+            UTF8ToWString(task->entry.serverAddress).c_str(),
+            task->probe->Name(),
+            task->responded ? L"yes" : L"no",
+            task->responseTime);
 
-        if ((*data)->m_responded && (*data)->m_responseTime < fastestResponseTime)
+        if (task->responded)
         {
-            fastestResponseTime = (*data)->m_responseTime;
+            auto fastest = fastestResponseTimes.find(task->probe->Name());
+            if (fastest == fastestResponseTimes.end() || task->responseTime < fastest->second)
+            {
+                fastestResponseTimes[task->probe->Name()] = task->responseTime;
+            }
         }
 
         Json::Value json;
-        json["ipAddress"] = (*data)->m_entry.serverAddress;
-        json["responded"] = (*data)->m_responded;
-        json["responseTime"] = (*data)->m_responseTime;
+        json["ipAddress"] = task->entry.serverAddress;
+        json["probe"] = task->probe->Name();
+        json["port"] = task->port;
+        json["responded"] = task->responded;
+        json["responseTime"] = task->responseTime;
         AddDiagnosticInfoJson("ServerResponseCheck", json);
     }
 
     ServerEntries respondingServers;
 
-    for (vector<WorkerThreadData*>::iterator data = threadData.begin(); data != threadData.end(); ++data)
+    for (vector<ReachabilityProbeTask>::const_iterator task = tasks.begin(); task != tasks.end(); ++task)
     {
-        if ((*data)->m_responded && (*data)->m_responseTime <=
-                fastestResponseTime*RESPONSE_TIME_THRESHOLD_FACTOR)
+        if (task->responded && task->responseTime <=
+                fastestResponseTimes[task->probe->Name()]*RESPONSE_TIME_THRESHOLD_FACTOR)
         {
-            respondingServers.push_back((*data)->m_entry);
+            respondingServers.push_back(task->entry);
         }
     }
 
+    // Only a full pass says anything about the budget
+    if (!stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, false))
+    {
+        g_reorderSamplePlanner.Completed(tasks, respondingServers.size());
+    }
+
     ShuffleVector(respondingServers.begin(), respondingServers.end());
 
     // Merge back into server entry list. MoveEntriesToFront will move
@@ -327,11 +351,4 @@ void ReorderServerList(ServerList& serverList, const StopInfo& stopInfo)
 
         my_print(NOT_SENSITIVE, true, _T("Preferred servers: %d"), respondingServers.size());
     }
-
-    // Cleanup
-
-    for (vector<WorkerThreadData*>::iterator data = threadData.begin(); data != threadData.end(); ++data)
-    {
-        delete *data;
-    }
 }
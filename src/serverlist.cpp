@@ -28,6 +28,82 @@
 #include <sstream>
 
 
+// Known server snapshots, by list name. Guarded by g_knownServersMutex.
+static map<string, shared_ptr<const KnownServers>> g_knownServers;
+static HANDLE g_knownServersMutex = CreateMutex(NULL, FALSE, 0);
+
+
+static bool ParseIPv4Address(const string& address, unsigned int& o_address)
+{
+    unsigned int a, b, c, d;
+    char extra;
+    if (sscanf_s(address.c_str(), "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra, 1) != 4
+        || a > 255 || b > 255 || c > 255 || d > 255)
+    {
+        return false;
+    }
+    o_address = (a << 24) | (b << 16) | (c << 8) | d;
+    return true;
+}
+
+
+KnownServers::KnownServers(const ServerEntries& serverEntries)
+{
+    m_ipv4.reserve(serverEntries.size());
+    for (const auto& entry : serverEntries)
+    {
+        unsigned int address;
+        if (ParseIPv4Address(entry.serverAddress, address))
+        {
+            m_ipv4.push_back(address);
+        }
+        else if (!entry.serverAddress.empty())
+        {
+            m_other.push_back(entry.serverAddress);
+        }
+    }
+
+    sort(m_ipv4.begin(), m_ipv4.end());
+    m_ipv4.erase(unique(m_ipv4.begin(), m_ipv4.end()), m_ipv4.end());
+    sort(m_other.begin(), m_other.end());
+    m_other.erase(unique(m_other.begin(), m_other.end()), m_other.end());
+
+    // Neighbouring addresses are common, so most deltas fit in 1-3 bytes
+    // rather than 4, before base64.
+    vector<unsigned char> varints;
+    varints.reserve(m_ipv4.size() * 3);
+    unsigned int previous = 0;
+    for (auto address : m_ipv4)
+    {
+        unsigned int delta = address - previous;
+        previous = address;
+        do
+        {
+            unsigned char byte = delta & 0x7F;
+            delta >>= 7;
+            varints.push_back(delta ? (byte | 0x80) : byte);
+        } while (delta);
+    }
+    if (!varints.empty())
+    {
+        m_ipv4Digest = Base64Encode(&varints[0], varints.size());
+    }
+
+    tstringstream queryString;
+    for (auto address : m_ipv4)
+    {
+        queryString << _T("&known_server=")
+                    << (address >> 24) << _T(".") << ((address >> 16) & 0xFF) << _T(".")
+                    << ((address >> 8) & 0xFF) << _T(".") << (address & 0xFF);
+    }
+    for (const auto& address : m_other)
+    {
+        queryString << _T("&known_server=") << UTF8ToWString(address);
+    }
+    m_queryString = queryString.str();
+}
+
+
 ServerList::ServerList(LPCSTR listName)
 {
     assert(listName && strlen(listName));
@@ -48,20 +124,11 @@ size_t ServerList::AddEntriesToList(
                     const vector<string>& newServerEntryList,
                     const ServerEntry* serverEntry)
 {
-    AutoMUTEX lock(m_mutex);
-
-    size_t entriesAdded = 0;
-
     if (newServerEntryList.size() < 1 && !serverEntry)
     {
-        return entriesAdded;
+        return 0;
     }
 
-    // We're going to loop through the server entries twice -- once to decode
-    // them and once to process them (after adding in serverEntry). This is
-    // not optimally efficient, but the array will never be very large and the
-    // code will be cleaner.
-
     vector<ServerEntry> decodedServerEntries;
     vector<string>::const_iterator entryStringIter;
     for (entryStringIter = newServerEntryList.begin();
@@ -73,6 +140,22 @@ size_t ServerList::AddEntriesToList(
 
     if (serverEntry) decodedServerEntries.push_back(*serverEntry);
 
+    return AddEntriesToList(decodedServerEntries);
+}
+
+size_t ServerList::AddEntriesToList(const ServerEntries& newServerEntries)
+{
+    AutoMUTEX lock(m_mutex);
+
+    size_t entriesAdded = 0;
+
+    if (newServerEntries.size() < 1)
+    {
+        return entriesAdded;
+    }
+
+    vector<ServerEntry> decodedServerEntries(newServerEntries);
+
     // This list may contain more than one discovered server
     // Randomize this list for load-balancing
     ShuffleVector(decodedServerEntries.begin(), decodedServerEntries.end());
@@ -112,7 +195,7 @@ size_t ServerList::AddEntriesToList(
         }
     }
 
-    WriteListToSystem(oldServerEntryList);
+    WriteListToSystem(oldServerEntryList, entriesAdded > 0);
 
     return entriesAdded;
 }
@@ -122,6 +205,7 @@ void ServerList::MoveEntriesToFront(const ServerEntries& entries, bool veryFront
     AutoMUTEX lock(m_mutex);
 
     ServerEntries persistentServerEntryList = GetList();
+    bool entryAdded = false;
 
     // Insert entries in input order
 
@@ -134,6 +218,7 @@ void ServerList::MoveEntriesToFront(const ServerEntries& entries, bool veryFront
         // in its current position.
 
         bool existingEntryChanged = false;
+        bool existingEntryFound = false;
 
         // If we replace the head item, we want to make sure we insert at the head.
         bool forceHead = false;
@@ -144,6 +229,7 @@ void ServerList::MoveEntriesToFront(const ServerEntries& entries, bool veryFront
         {
             if (entry->serverAddress == persistentEntry->serverAddress)
             {
+                existingEntryFound = true;
                 if (entry->ToString() != persistentEntry->ToString())
                 {
                     existingEntryChanged = true;
@@ -172,10 +258,11 @@ void ServerList::MoveEntriesToFront(const ServerEntries& entries, bool veryFront
             }
 
             persistentServerEntryList.insert(insertionPoint, *entry);
+            entryAdded = entryAdded || !existingEntryFound;
         }
     }
 
-    WriteListToSystem(persistentServerEntryList);
+    WriteListToSystem(persistentServerEntryList, entryAdded);
 }
 
 void ServerList::MoveEntryToFront(const ServerEntry& serverEntry, bool veryFront/*=false*/)
@@ -224,7 +311,8 @@ void ServerList::MarkServersFailed(const ServerEntries& failedServerEntries)
 
     if (changeMade)
     {
-        WriteListToSystem(serverEntryList);
+        // Failed servers are only moved
+        WriteListToSystem(serverEntryList, false);
     }
     else
     {
@@ -260,6 +348,8 @@ ServerEntries ServerList::GetList()
         }
     }
 
+    bool embeddedEntryAdded = false;
+
     // Add embedded list to system list.
     // Cases:
     // - This may be a new client run on a system with an existing registry entry; we want the new embedded values
@@ -311,12 +401,13 @@ ServerEntries ServerList::GetList()
                                             systemServerEntryList.begin() + 1 :
                                             systemServerEntryList.begin(),
                                          *embeddedServerEntry);
+            embeddedEntryAdded = true;
         }
     }
 
     // Write this out immediately, so the next time we'll get it from the system
     // (Also so MarkCurrentServerFailed reads the same list we're returning)
-    WriteListToSystem(systemServerEntryList);
+    WriteListToSystem(systemServerEntryList, embeddedEntryAdded);
 
     // WriteListToSystem could truncate the list if it is too long to write to the registry.
     // Try to return what is stored in the system for consistency.
@@ -331,6 +422,37 @@ ServerEntries ServerList::GetList()
     }
 }
 
+shared_ptr<const KnownServers> ServerList::GetKnownServers()
+{
+    {
+        AutoMUTEX lock(g_knownServersMutex);
+        auto entry = g_knownServers.find(m_name);
+        if (entry != g_knownServers.end())
+        {
+            return entry->second;
+        }
+    }
+
+    // Loading the list writes it back, which populates the snapshot
+    ServerEntries serverEntries = GetList();
+
+    AutoMUTEX lock(g_knownServersMutex);
+    auto entry = g_knownServers.find(m_name);
+    if (entry == g_knownServers.end())
+    {
+        entry = g_knownServers.insert(make_pair(m_name, make_shared<const KnownServers>(serverEntries))).first;
+    }
+    return entry->second;
+}
+
+void ServerList::UpdateKnownServers(const ServerEntries& serverEntryList)
+{
+    shared_ptr<const KnownServers> knownServers = make_shared<const KnownServers>(serverEntryList);
+
+    AutoMUTEX lock(g_knownServersMutex);
+    g_knownServers[m_name] = knownServers;
+}
+
 string ServerList::GetListName() const
 {
     return string(LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS) + m_name;
@@ -397,7 +519,7 @@ ServerEntry ServerList::ParseServerEntry(const string& serverEntry)
 }
 
 // NOTE: This function does not throw because we don't want a failure to prevent a connection attempt.
-void ServerList::WriteListToSystem(const ServerEntries& serverEntryList)
+void ServerList::WriteListToSystem(const ServerEntries& serverEntryList, bool addressesChanged)
 {
     string encodedServerEntryList = EncodeServerEntries(serverEntryList);
 
@@ -416,7 +538,7 @@ void ServerList::WriteListToSystem(const ServerEntries& serverEntryList)
                 my_print(NOT_SENSITIVE, true, _T("%s: List is too long to write to registry, truncating"), __TFUNCTION__);
                 ServerEntries truncatedServerEntryList(serverEntryList.begin(),
                                                        serverEntryList.begin() + bisect);
-                WriteListToSystem(truncatedServerEntryList);
+                WriteListToSystem(truncatedServerEntryList, true);
             }
             else
             {
@@ -425,6 +547,14 @@ void ServerList::WriteListToSystem(const ServerEntries& serverEntryList)
                     __TFUNCTION__, serverEntryList.size());
             }
         }
+        return;
+    }
+
+    // Most writes only reorder the list, and rebuilding the snapshot means
+    // sorting every address, so it's only done when the addresses change.
+    if (addressesChanged)
+    {
+        UpdateKnownServers(serverEntryList);
     }
 }
 
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 
 using namespace std;
 
@@ -73,6 +74,41 @@ struct ServerEntry
 typedef vector<ServerEntry> ServerEntries;
 typedef ServerEntries::const_iterator ServerEntryIterator;
 
+// A server that advertises this capability accepts the known server list
+// as a KnownServers digest in the /handshake request body.
+#define KNOWN_SERVERS_DIGEST_CAPABILITY "handshake-known-servers-digest"
+
+/*
+KnownServers is an immutable snapshot of the set of addresses in a server
+list, in the forms used to report known servers in /handshake. Snapshots are
+rebuilt when a write changes the list's addresses, so building a request
+doesn't depend on the size of the list.
+*/
+class KnownServers
+{
+public:
+    KnownServers(const ServerEntries& serverEntries);
+
+    size_t Size() const { return m_ipv4.size() + m_other.size(); }
+
+    // Sorted IPv4 addresses, each the difference from the previous one (the
+    // first from zero) as an unsigned LEB128 varint, base64 encoded.
+    const string& GetIPv4Digest() const { return m_ipv4Digest; }
+
+    // Addresses that aren't IPv4 dotted quads, sorted.
+    const vector<string>& GetOtherAddresses() const { return m_other; }
+
+    // "&known_server=<address>" for each address, for servers that don't
+    // accept the digest.
+    const tstring& GetQueryString() const { return m_queryString; }
+
+private:
+    vector<unsigned int> m_ipv4;
+    vector<string> m_other;
+    string m_ipv4Digest;
+    tstring m_queryString;
+};
+
 class ServerList
 {
 public:
@@ -88,6 +124,9 @@ public:
         const vector<string>& newServerEntryList,
         const ServerEntry* serverEntry);
 
+    // As above, for entries that have already been decoded.
+    size_t AddEntriesToList(const ServerEntries& newServerEntries);
+
     void MarkServersFailed(const ServerEntries& failedServerEntries);
     void MarkServerFailed(const ServerEntry& failedServerEntry);
 
@@ -96,16 +135,27 @@ public:
     void MoveEntriesToFront(const ServerEntries& entries, bool veryFront=false);
     void MoveEntryToFront(const ServerEntry& serverEntry, bool veryFront=false);
 
+    // Returns the addresses in the list. Cheap unless this is the first use
+    // of this list in the process, in which case the list is loaded.
+    shared_ptr<const KnownServers> GetKnownServers();
+
     static ServerEntries GetListFromSystem(const char* listName);
     static string EncodeServerEntries(const ServerEntries& serverEntryList);
 
+    // Decodes a single hex-encoded server entry. Throws std::exception if the
+    // entry is corrupt.
+    static ServerEntry ParseServerEntry(const string& serverEntry);
+
 private:
     string GetListName() const;
     ServerEntries GetListFromEmbeddedValues();
     ServerEntries GetListFromSystem();
     static ServerEntries ParseServerEntries(const char* serverEntryListString);
-    static ServerEntry ParseServerEntry(const string& serverEntry);
-    void WriteListToSystem(const ServerEntries& serverEntryList);
+    // addressesChanged may only be false if serverEntryList has the same
+    // addresses as the list it was read from (i.e., it has only been
+    // reordered, or had entries updated in place).
+    void WriteListToSystem(const ServerEntries& serverEntryList, bool addressesChanged);
+    void UpdateKnownServers(const ServerEntries& serverEntryList);
 
     HANDLE m_mutex;
     string m_name;
@@ -23,6 +23,8 @@
 #include "psiclient.h"
 #include "config.h"
 #include "utilities.h"
+#include "metrics.h"
+#include <algorithm>
 #include <sstream>
 
 
@@ -31,6 +33,83 @@
 // we won't, if it's something like 60000, then we will.
 #define PREEMPTIVE_RECONNECT_LIFETIME_MILLISECONDS_DEFAULT MAXDWORD
 
+// The number of distinct compiled regex sets kept for reuse. Servers almost
+// always send the same page view and HTTPS request regexes, so this only
+// needs to cover a few variants.
+#define REGEX_REPLACE_SET_CACHE_SIZE 8
+
+
+/*
+Compiles a page_view_regexes or https_request_regexes config array, reusing
+a previously compiled set if the array is the same as one seen before.
+Compiling with regex::optimize is expensive, and the regexes rarely change
+between handshakes. Throws on an invalid regex, like regex's constructor.
+*/
+static RegexReplaceSet CompileRegexReplaceSet(const Json::Value& regexes)
+{
+    static MetricCounter& cacheHits = MetricsRegistry::Instance().Counter("session.regex_set_cache_hits");
+    static MetricHistogram& compileTime = MetricsRegistry::Instance().Histogram("session.regex_set_compile_ms");
+
+    // Keyed by the canonical serialization of the array (which is small), so
+    // there's no risk of collisions. Entries hold a use count for eviction.
+    typedef map<string, pair<RegexReplaceSet, unsigned long long>> RegexReplaceSetCache;
+    static HANDLE cacheMutex = CreateMutex(NULL, FALSE, 0);
+    static RegexReplaceSetCache cache;
+    static unsigned long long useCount = 0;
+
+    if (regexes.empty())
+    {
+        return RegexReplaceSet();
+    }
+
+    string key = Json::FastWriter().write(regexes);
+
+    {
+        AutoMUTEX lock(cacheMutex);
+        auto entry = cache.find(key);
+        if (entry != cache.end())
+        {
+            entry->second.second = ++useCount;
+            cacheHits.Add();
+            return entry->second.first;
+        }
+    }
+
+    // Compile outside the lock; concurrent misses on the same key just
+    // compile it twice.
+    DWORD startTime = GetTickCount();
+
+    auto compiled = make_shared<vector<RegexReplace>>();
+    compiled->reserve(regexes.size());
+    for (Json::Value::ArrayIndex i = 0; i < regexes.size(); i++)
+    {
+        RegexReplace rx_re;
+        rx_re.regex = regex(
+                        regexes[i].get("regex", "").asString(),
+                        regex::ECMAScript | regex::icase | regex::optimize);
+        rx_re.replace = regexes[i].get("replace", "").asString();
+
+        compiled->push_back(rx_re);
+    }
+
+    compileTime.Record(GetTickCount() - startTime);
+
+    RegexReplaceSet result = compiled;
+
+    AutoMUTEX lock(cacheMutex);
+    if (cache.size() >= REGEX_REPLACE_SET_CACHE_SIZE)
+    {
+        auto leastRecentlyUsed = min_element(cache.begin(), cache.end(),
+            [](const RegexReplaceSetCache::value_type& a, const RegexReplaceSetCache::value_type& b) {
+                return a.second.second < b.second.second;
+            });
+        cache.erase(leastRecentlyUsed);
+    }
+    cache[key] = make_pair(result, ++useCount);
+
+    return result;
+}
+
 
 SessionInfo::SessionInfo()
 {
@@ -56,8 +135,8 @@ void SessionInfo::Clear()
     m_meekFrontingHost.clear();
     m_homepages.clear();
     m_servers.clear();
-    m_pageViewRegexes.clear();
-    m_httpsRequestRegexes.clear();
+    m_pageViewRegexes.reset();
+    m_httpsRequestRegexes.reset();
     m_preemptiveReconnectLifetimeMilliseconds = PREEMPTIVE_RECONNECT_LIFETIME_MILLISECONDS_DEFAULT;
     m_localHttpProxyPort = 0;
     m_localHttpsProxyPort = 0;
@@ -127,8 +206,8 @@ bool SessionInfo::ProcessConfig(const string& config_json)
     m_sshObfuscatedKey.clear();
     m_homepages.clear();
     m_servers.clear();
-    m_pageViewRegexes.clear();
-    m_httpsRequestRegexes.clear();
+    m_pageViewRegexes.reset();
+    m_httpsRequestRegexes.reset();
     m_preemptiveReconnectLifetimeMilliseconds = PREEMPTIVE_RECONNECT_LIFETIME_MILLISECONDS_DEFAULT;
     m_localHttpProxyPort = 0;
     m_localHttpsProxyPort = 0;
@@ -176,30 +255,10 @@ bool SessionInfo::ProcessConfig(const string& config_json)
         m_psk = config.get("l2tp_ipsec_psk", "").asString();
 
         // Page view regexes
-        Json::Value regexes = config["page_view_regexes"];
-        for (Json::Value::ArrayIndex i = 0; i < regexes.size(); i++)
-        {
-            RegexReplace rx_re;
-            rx_re.regex = regex(
-                            regexes[i].get("regex", "").asString(),
-                            regex::ECMAScript | regex::icase | regex::optimize);
-            rx_re.replace = regexes[i].get("replace", "").asString();
-
-            m_pageViewRegexes.push_back(rx_re);
-        }
+        m_pageViewRegexes = CompileRegexReplaceSet(config["page_view_regexes"]);
 
         // HTTPS request regexes
-        regexes = config["https_request_regexes"];
-        for (Json::Value::ArrayIndex i = 0; i < regexes.size(); i++)
-        {
-            RegexReplace rx_re;
-            rx_re.regex = regex(
-                            regexes[i].get("regex", "").asString(),
-                            regex::ECMAScript | regex::icase | regex::optimize);
-            rx_re.replace = regexes[i].get("replace", "").asString();
-
-            m_httpsRequestRegexes.push_back(rx_re);
-        }
+        m_httpsRequestRegexes = CompileRegexReplaceSet(config["https_request_regexes"]);
 
         // Preemptive Reconnect Lifetime Milliseconds
         m_preemptiveReconnectLifetimeMilliseconds = (DWORD)config.get("preemptive_reconnect_lifetime_milliseconds", 0).asUInt();
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include "serverlist.h"
 #include "tstring.h"
 
@@ -29,6 +30,12 @@ struct RegexReplace
     string replace;
 };
 
+// A compiled set of regexes from the handshake config. Sets are shared
+// between SessionInfo copies, LocalProxy, and later handshakes that send the
+// same regexes; see CompileRegexReplaceSet in sessioninfo.cpp. May be null,
+// meaning no regexes.
+typedef shared_ptr<const vector<RegexReplace>> RegexReplaceSet;
+
 class SessionInfo
 {
 public:
@@ -64,8 +71,8 @@ public:
     string GetPSK() const {return m_psk;}
     vector<tstring> GetHomepages() const {return m_homepages;}
     vector<string> GetDiscoveredServerEntries() const;
-    vector<RegexReplace> GetPageViewRegexes() const {return m_pageViewRegexes;}
-    vector<RegexReplace> GetHttpsRequestRegexes() const {return m_httpsRequestRegexes;}
+    RegexReplaceSet GetPageViewRegexes() const {return m_pageViewRegexes;}
+    RegexReplaceSet GetHttpsRequestRegexes() const {return m_httpsRequestRegexes;}
 
     // A value of zero means disabled.
     DWORD GetPreemptiveReconnectLifetimeMilliseconds() const {return m_preemptiveReconnectLifetimeMilliseconds;}
@@ -111,8 +118,8 @@ private:
     string m_meekFrontingHost;
     vector<tstring> m_homepages;
     vector<string> m_servers;
-    vector<RegexReplace> m_pageViewRegexes;
-    vector<RegexReplace> m_httpsRequestRegexes;
+    RegexReplaceSet m_pageViewRegexes;
+    RegexReplaceSet m_httpsRequestRegexes;
     DWORD m_preemptiveReconnectLifetimeMilliseconds;
     int m_localHttpProxyPort;
     int m_localHttpsProxyPort;
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "span_tracer.h"
+#include "utilities.h"
+
+
+/***********************************************************************
+ SpanTracer
+ */
+
+SpanTracer& SpanTracer::Instance()
+{
+    static SpanTracer instance;
+    return instance;
+}
+
+SpanTracer::SpanTracer()
+    : m_enabled(true),
+      m_nextID(1),
+      m_next(0),
+      m_count(0)
+{
+    QueryPerformanceFrequency(&m_frequency);
+    QueryPerformanceCounter(&m_epoch);
+    m_mutex = CreateMutex(NULL, FALSE, 0);
+}
+
+SpanTracer::~SpanTracer()
+{
+    CloseHandle(m_mutex);
+}
+
+void SpanTracer::SetEnabled(bool enabled)
+{
+    m_enabled = enabled;
+}
+
+unsigned int SpanTracer::NextSpanID()
+{
+    unsigned int id = m_nextID++;
+    if (id == 0 || id == ScopedSpan::INHERIT_PARENT)
+    {
+        // Reserved values; only hit on wraparound
+        id = m_nextID++;
+    }
+    return id;
+}
+
+unsigned long long SpanTracer::NowMicroseconds() const
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    unsigned long long ticks = now.QuadPart - m_epoch.QuadPart;
+    // Split to avoid overflowing the multiplication
+    return (ticks / m_frequency.QuadPart) * 1000000 +
+           (ticks % m_frequency.QuadPart) * 1000000 / m_frequency.QuadPart;
+}
+
+void SpanTracer::Record(const char* name, unsigned int id, unsigned int parent, unsigned long long start, unsigned long long end)
+{
+    AutoMUTEX lock(m_mutex);
+
+    SpanRecord& record = m_records[m_next];
+    record.name = name;
+    record.threadID = GetCurrentThreadId();
+    record.id = id;
+    record.parent = parent;
+    record.start = start;
+    record.end = end;
+
+    m_next = (m_next + 1) % CAPACITY;
+    if (m_count < CAPACITY)
+    {
+        m_count++;
+    }
+}
+
+Json::Value SpanTracer::GetTimelineJson() const
+{
+    Json::Value fields(Json::arrayValue);
+    fields.append("name");
+    fields.append("tid");
+    fields.append("id");
+    fields.append("parent");
+    fields.append("startUs");
+    fields.append("durationUs");
+
+    Json::Value spans(Json::arrayValue);
+    {
+        AutoMUTEX lock(m_mutex);
+        size_t first = (m_next + CAPACITY - m_count) % CAPACITY;
+        for (size_t i = 0; i < m_count; i++)
+        {
+            const SpanRecord& record = m_records[(first + i) % CAPACITY];
+            Json::Value span(Json::arrayValue);
+            span.append(record.name);
+            span.append((Json::UInt)record.threadID);
+            span.append((Json::UInt)record.id);
+            span.append((Json::UInt)record.parent);
+            span.append((Json::UInt64)record.start);
+            span.append((Json::UInt64)(record.end - record.start));
+            spans.append(span);
+        }
+    }
+
+    Json::Value timeline(Json::objectValue);
+    timeline["fields"] = fields;
+    timeline["spans"] = spans;
+    return timeline;
+}
+
+bool SpanTracer::WriteChromeTrace(const tstring& filename) const
+{
+    Json::Value events(Json::arrayValue);
+    {
+        AutoMUTEX lock(m_mutex);
+        size_t first = (m_next + CAPACITY - m_count) % CAPACITY;
+        for (size_t i = 0; i < m_count; i++)
+        {
+            const SpanRecord& record = m_records[(first + i) % CAPACITY];
+            Json::Value event(Json::objectValue);
+            event["name"] = record.name;
+            event["ph"] = "X"; // complete event
+            event["pid"] = (Json::UInt)GetCurrentProcessId();
+            event["tid"] = (Json::UInt)record.threadID;
+            event["ts"] = (Json::UInt64)record.start;
+            event["dur"] = (Json::UInt64)(record.end - record.start);
+            event["args"]["id"] = (Json::UInt)record.id;
+            event["args"]["parent"] = (Json::UInt)record.parent;
+            events.append(event);
+        }
+    }
+
+    Json::Value trace(Json::objectValue);
+    trace["traceEvents"] = events;
+    trace["displayTimeUnit"] = "ms";
+
+    string traceJSON = Json::FastWriter().write(trace);
+
+    AutoHANDLE file = CreateFile(filename.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    DWORD written = 0;
+    return WriteFile(file, traceJSON.c_str(), (DWORD)traceJSON.length(), &written, NULL) &&
+           written == traceJSON.length();
+}
+
+
+/***********************************************************************
+ ScopedSpan
+ */
+
+static thread_local unsigned int t_currentSpan = 0;
+
+ScopedSpan::ScopedSpan(const char* name, unsigned int parent/*=INHERIT_PARENT*/)
+    : m_name(name),
+      m_id(0),
+      m_parent(0),
+      m_previous(0),
+      m_start(0)
+{
+    SpanTracer& tracer = SpanTracer::Instance();
+    if (!tracer.IsEnabled())
+    {
+        return;
+    }
+
+    m_id = tracer.NextSpanID();
+    m_previous = t_currentSpan;
+    m_parent = (parent == INHERIT_PARENT) ? t_currentSpan : parent;
+    t_currentSpan = m_id;
+    m_start = tracer.NowMicroseconds();
+}
+
+ScopedSpan::~ScopedSpan()
+{
+    End();
+}
+
+void ScopedSpan::End()
+{
+    if (m_id == 0)
+    {
+        return;
+    }
+
+    SpanTracer& tracer = SpanTracer::Instance();
+    tracer.Record(m_name, m_id, m_parent, m_start, tracer.NowMicroseconds());
+
+    if (t_currentSpan == m_id)
+    {
+        t_currentSpan = m_previous;
+    }
+    m_id = 0;
+}
+
+// static
+unsigned int ScopedSpan::Current()
+{
+    return t_currentSpan;
+}
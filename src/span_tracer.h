@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+
+/**
+SpanTracer records timed spans of the connection sequence (server list reorder,
+parameter file writing, core spawn, handshake, local proxy start, system proxy
+apply, post-connect, etc.) so that a slow connect can be broken down by phase.
+
+Spans are created with ScopedSpan and recorded into a fixed-size ring buffer,
+so only the most recent spans are kept. The buffer is exported to feedback
+diagnostics as a compact timeline, and can be written out in Chrome trace
+event format for viewing in chrome://tracing.
+
+When the tracer is disabled, a ScopedSpan costs a single relaxed atomic load.
+*/
+class SpanTracer
+{
+public:
+    static SpanTracer& Instance();
+
+    void SetEnabled(bool enabled);
+    bool IsEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    /**
+    Returns the buffered spans, oldest first, as:
+    {"fields": ["name", "tid", "id", "parent", "startUs", "durationUs"],
+     "spans": [[...], ...]}
+    Times are microseconds since the tracer was created.
+    */
+    Json::Value GetTimelineJson() const;
+
+    /**
+    Writes the buffered spans to `filename` in Chrome trace event format.
+    Returns false on failure.
+    */
+    bool WriteChromeTrace(const tstring& filename) const;
+
+    // For use by ScopedSpan
+    unsigned int NextSpanID();
+    unsigned long long NowMicroseconds() const;
+    void Record(const char* name, unsigned int id, unsigned int parent, unsigned long long start, unsigned long long end);
+
+private:
+    SpanTracer();
+    ~SpanTracer();
+
+    // not copyable
+    SpanTracer(SpanTracer const&);
+    SpanTracer& operator=(SpanTracer const&);
+
+    struct SpanRecord
+    {
+        const char* name;
+        DWORD threadID;
+        unsigned int id;
+        unsigned int parent;
+        unsigned long long start;
+        unsigned long long end;
+    };
+
+    static const size_t CAPACITY = 1024;
+
+    std::atomic<bool> m_enabled;
+    std::atomic<unsigned int> m_nextID;
+    LARGE_INTEGER m_frequency;
+    LARGE_INTEGER m_epoch;
+
+    HANDLE m_mutex;
+    SpanRecord m_records[CAPACITY];
+    size_t m_next;
+    size_t m_count;
+};
+
+/**
+Times the enclosing scope (or until End() is called) as a span. The span's
+parent is the innermost ScopedSpan open on the same thread, unless a parent
+span ID is given -- for work handed off to another thread, pass
+ScopedSpan::Current() from the originating thread.
+`name` must outlive the tracer; use a string literal.
+*/
+class ScopedSpan
+{
+public:
+    static const unsigned int INHERIT_PARENT = (unsigned int)-1;
+
+    explicit ScopedSpan(const char* name, unsigned int parent = INHERIT_PARENT);
+    ~ScopedSpan();
+
+    // Ends the span early. Subsequent calls (and the destructor) do nothing.
+    void End();
+
+    // The ID of the innermost span open on this thread; 0 if none.
+    static unsigned int Current();
+
+private:
+    // not copyable
+    ScopedSpan(ScopedSpan const&);
+    ScopedSpan& operator=(ScopedSpan const&);
+
+    const char* m_name;
+    unsigned int m_id;
+    unsigned int m_parent;
+    unsigned int m_previous;
+    unsigned long long m_start;
+};
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+
+/**
+SPSCQueue is a fixed-capacity, lock-free ring buffer for exactly one
+producer thread and one consumer thread. Neither side ever blocks: TryPush
+fails when the ring is full and TryPop fails when it is empty, and it's up
+to the caller to decide what to do then.
+
+CAPACITY must be a power of two.
+*/
+template<typename T, size_t CAPACITY>
+class SPSCQueue
+{
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+public:
+    SPSCQueue() : m_head(0), m_tail(0) {}
+
+    // Producer only. Returns false, leaving `item` untouched, if the ring is full.
+    bool TryPush(T&& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == CAPACITY)
+        {
+            return false;
+        }
+        m_items[tail & (CAPACITY - 1)] = std::move(item);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the ring is empty.
+    bool TryPop(T& o_item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        o_item = std::move(m_items[head & (CAPACITY - 1)]);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The number of items in the ring. Exact when called by the producer or
+    // the consumer while the other side is idle; otherwise a snapshot.
+    size_t Size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+private:
+    // not copyable
+    SPSCQueue(SPSCQueue const&);
+    SPSCQueue& operator=(SPSCQueue const&);
+
+    // Padded so that the two indexes are never on the same cache line and
+    // the two sides don't contend. (Padding rather than alignas, which heap
+    // allocation doesn't honour before C++17 -- warning C4316.)
+    static const size_t CACHE_LINE_SIZE = 64;
+    std::atomic<size_t> m_head;
+    char m_headPadding[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail;
+    char m_tailPadding[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    T m_items[CAPACITY];
+};
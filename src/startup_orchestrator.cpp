@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "startup_orchestrator.h"
+#include "psiclient.h"
+#include "logging.h"
+#include "diagnostic_info.h"
+#include "metrics.h"
+#include "utilities.h"
+#include "stopsignal.h"
+
+
+static const TCHAR* StartupTaskThreadName(StartupTaskThread thread)
+{
+    switch (thread)
+    {
+    case StartupTaskThread::UI: return _T("UI");
+    case StartupTaskThread::Background: return _T("Background");
+    default: return _T("Milestone");
+    }
+}
+
+
+StartupOrchestrator::StartupOrchestrator()
+    : m_uiWindow(NULL),
+      m_started(false),
+      m_timeToInteractiveRecorded(false)
+{
+    m_mutex = CreateMutex(NULL, FALSE, 0);
+    QueryPerformanceFrequency(&m_frequency);
+    m_startTime.QuadPart = 0;
+}
+
+StartupOrchestrator::~StartupOrchestrator()
+{
+    // Background tasks still running at exit are abandoned along with the
+    // process, so the tasks (and their events) are deliberately not waited on.
+    for (auto& task : m_tasks)
+    {
+        CloseHandle(task->doneEvent);
+    }
+    CloseHandle(m_mutex);
+}
+
+void StartupOrchestrator::AddTask(const string& name, StartupTaskThread thread, const vector<string>& dependsOn, std::function<void()> fn)
+{
+    AutoMUTEX lock(m_mutex);
+
+    if (m_started)
+    {
+        throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) " already started");
+    }
+    if (FindTask(name) != NULL)
+    {
+        throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) " duplicate task");
+    }
+
+    unique_ptr<Task> task(new Task);
+    task->name = name;
+    task->thread = thread;
+    task->dependsOn = dependsOn;
+    task->fn = fn;
+    task->state = TaskState::Pending;
+    task->doneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    task->scheduledTime.QuadPart = 0;
+    m_tasks.push_back(std::move(task));
+}
+
+void StartupOrchestrator::AddMilestone(const string& name)
+{
+    AddTask(name, StartupTaskThread::Milestone, {}, nullptr);
+}
+
+void StartupOrchestrator::Start(HWND uiWindow)
+{
+    AutoMUTEX lock(m_mutex);
+
+    if (m_started)
+    {
+        return;
+    }
+
+    for (auto& task : m_tasks)
+    {
+        task->dependencies.clear();
+        for (const auto& dependency : task->dependsOn)
+        {
+            bool found = false;
+            for (size_t i = 0; i < m_tasks.size(); i++)
+            {
+                if (m_tasks[i]->name == dependency)
+                {
+                    task->dependencies.push_back(i);
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s: task %S depends on unknown task %S"), __TFUNCTION__, task->name.c_str(), dependency.c_str());
+                throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) " unknown dependency");
+            }
+        }
+    }
+
+    m_uiWindow = uiWindow;
+    m_started = true;
+    QueryPerformanceCounter(&m_startTime);
+
+    ScheduleReadyTasks();
+}
+
+void StartupOrchestrator::Complete(const string& milestone)
+{
+    AutoMUTEX lock(m_mutex);
+
+    for (size_t i = 0; i < m_tasks.size(); i++)
+    {
+        Task& task = *m_tasks[i];
+        if (task.name != milestone)
+        {
+            continue;
+        }
+
+        if (task.thread != StartupTaskThread::Milestone)
+        {
+            throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) " not a milestone");
+        }
+
+        if (task.state != TaskState::Done)
+        {
+            Json::Value json;
+            json["name"] = task.name;
+            json["reachedMs"] = m_started ? (Json::UInt64)MillisecondsSince(m_startTime) : 0;
+            AddDiagnosticInfo("StartupMilestone", json);
+
+            MarkDone(i);
+            ScheduleReadyTasks();
+        }
+        return;
+    }
+
+    throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) " unknown milestone");
+}
+
+bool StartupOrchestrator::IsDone(const string& name)
+{
+    AutoMUTEX lock(m_mutex);
+
+    Task* task = FindTask(name);
+    return task != NULL && task->state == TaskState::Done;
+}
+
+void StartupOrchestrator::RunUITask(WPARAM wParam)
+{
+    size_t index = (size_t)wParam;
+
+    {
+        AutoMUTEX lock(m_mutex);
+        if (index >= m_tasks.size() || m_tasks[index]->thread != StartupTaskThread::UI)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s: bad task index %d"), __TFUNCTION__, (int)index);
+            return;
+        }
+    }
+
+    RunTask(index);
+}
+
+bool StartupOrchestrator::WaitFor(const vector<string>& names, const StopInfo& stopInfo, DWORD timeoutMs)
+{
+    vector<HANDLE> events;
+    {
+        AutoMUTEX lock(m_mutex);
+        for (const auto& name : names)
+        {
+            Task* task = FindTask(name);
+            if (task == NULL)
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s: unknown task %S"), __TFUNCTION__, name.c_str());
+                return false;
+            }
+            events.push_back(task->doneEvent);
+        }
+    }
+
+    AutoHANDLE stopEvent = CreateEvent(NULL, TRUE, FALSE, 0);
+    if (!stopEvent)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: CreateEvent failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    if (stopInfo.stopSignal)
+    {
+        stopInfo.stopSignal->RegisterStopEvent(stopEvent, stopInfo.stopReasons);
+    }
+    auto unregisterStopEvent = finally([&] {
+        if (stopInfo.stopSignal)
+        {
+            stopInfo.stopSignal->UnregisterStopEvent(stopEvent);
+        }
+    });
+
+    DWORD startTime = GetTickCount();
+
+    // The task events are manual-reset and live as long as this object, so
+    // they can be waited on one at a time, each alongside the stop event.
+    for (HANDLE doneEvent : events)
+    {
+        if (stopInfo.stopSignal && stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, false))
+        {
+            return false;
+        }
+
+        DWORD waitMs = INFINITE;
+        if (timeoutMs != INFINITE)
+        {
+            DWORD elapsed = GetTickCount() - startTime;
+            waitMs = elapsed < timeoutMs ? timeoutMs - elapsed : 0;
+        }
+
+        HANDLE waitHandles[] = { doneEvent, stopEvent };
+        if (WAIT_OBJECT_0 != WaitForMultipleObjects(sizeof(waitHandles)/sizeof(HANDLE), waitHandles, FALSE, waitMs))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void StartupOrchestrator::RecordTimeToInteractive()
+{
+    static MetricGauge& timeToInteractive = MetricsRegistry::Instance().Gauge("startup.time_to_interactive_ms");
+
+    if (m_timeToInteractiveRecorded.exchange(true))
+    {
+        return;
+    }
+
+    FILETIME creationTime, exitTime, kernelTime, userTime, now;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: GetProcessTimes failed (%d)"), __TFUNCTION__, GetLastError());
+        return;
+    }
+    GetSystemTimeAsFileTime(&now);
+
+    ULARGE_INTEGER created, current;
+    created.LowPart = creationTime.dwLowDateTime;
+    created.HighPart = creationTime.dwHighDateTime;
+    current.LowPart = now.dwLowDateTime;
+    current.HighPart = now.dwHighDateTime;
+
+    // FILETIMEs are in 100ns units
+    long long ms = current.QuadPart > created.QuadPart ? (long long)((current.QuadPart - created.QuadPart) / 10000) : 0;
+    timeToInteractive.Set(ms);
+
+    Json::Value json;
+    json["timeToInteractiveMs"] = (Json::Int64)ms;
+    AddDiagnosticInfo("StartupInteractive", json);
+
+    my_print(NOT_SENSITIVE, true, _T("%s: %lld ms"), __TFUNCTION__, ms);
+}
+
+StartupOrchestrator::Task* StartupOrchestrator::FindTask(const string& name)
+{
+    for (auto& task : m_tasks)
+    {
+        if (task->name == name)
+        {
+            return task.get();
+        }
+    }
+    return NULL;
+}
+
+void StartupOrchestrator::MarkDone(size_t index)
+{
+    m_tasks[index]->state = TaskState::Done;
+    SetEvent(m_tasks[index]->doneEvent);
+}
+
+void StartupOrchestrator::ScheduleReadyTasks()
+{
+    if (!m_started)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < m_tasks.size(); i++)
+    {
+        Task& task = *m_tasks[i];
+        if (task.state != TaskState::Pending || task.thread == StartupTaskThread::Milestone)
+        {
+            continue;
+        }
+
+        bool ready = true;
+        for (size_t dependency : task.dependencies)
+        {
+            if (m_tasks[dependency]->state != TaskState::Done)
+            {
+                ready = false;
+                break;
+            }
+        }
+        if (!ready)
+        {
+            continue;
+        }
+
+        task.state = TaskState::Scheduled;
+        QueryPerformanceCounter(&task.scheduledTime);
+
+        if (task.thread == StartupTaskThread::Background)
+        {
+            BackgroundTaskParams* params = new BackgroundTaskParams;
+            params->orchestrator = this;
+            params->index = i;
+
+            HANDLE thread = CreateThread(0, 0, BackgroundTaskThread, (void*)params, 0, 0);
+            if (thread != NULL)
+            {
+                CloseHandle(thread);
+                continue;
+            }
+
+            // Better late than never: fall back to running it on the UI thread
+            my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
+            delete params;
+        }
+
+        PostMessage(m_uiWindow, WM_PSIPHON_STARTUP_TASK, (WPARAM)i, 0);
+    }
+}
+
+// static
+DWORD WINAPI StartupOrchestrator::BackgroundTaskThread(void* data)
+{
+    unique_ptr<BackgroundTaskParams> params((BackgroundTaskParams*)data);
+    params->orchestrator->RunTask(params->index);
+    return 0;
+}
+
+void StartupOrchestrator::RunTask(size_t index)
+{
+    Task* task;
+    std::function<void()> fn;
+    LARGE_INTEGER scheduledTime;
+    {
+        AutoMUTEX lock(m_mutex);
+        task = m_tasks[index].get();
+        if (task->state != TaskState::Scheduled)
+        {
+            return;
+        }
+        fn = task->fn;
+        scheduledTime = task->scheduledTime;
+    }
+
+    unsigned long long queuedMs = MillisecondsSince(scheduledTime);
+    LARGE_INTEGER runStart;
+    QueryPerformanceCounter(&runStart);
+
+    bool failed = false;
+    try
+    {
+        if (fn)
+        {
+            fn();
+        }
+    }
+    catch (std::exception& e)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: task %S failed: %S"), __TFUNCTION__, task->name.c_str(), e.what());
+        failed = true;
+    }
+
+    unsigned long long runMs = MillisecondsSince(runStart);
+
+    // Task names are fixed at declaration, so they're safe to read unlocked
+    MetricsRegistry::Instance().Histogram(("startup.task_ms." + task->name).c_str()).Record(runMs);
+
+    Json::Value json;
+    json["name"] = task->name;
+    json["thread"] = WStringToUTF8(StartupTaskThreadName(task->thread));
+    json["queuedMs"] = (Json::UInt64)queuedMs;
+    json["runMs"] = (Json::UInt64)runMs;
+    json["finishedMs"] = (Json::UInt64)MillisecondsSince(m_startTime);
+    json["failed"] = failed;
+    AddDiagnosticInfo("StartupTask", json);
+
+    my_print(NOT_SENSITIVE, true, _T("%s: %S (%s) took %llu ms, queued %llu ms"), __TFUNCTION__, task->name.c_str(), StartupTaskThreadName(task->thread), runMs, queuedMs);
+
+    AutoMUTEX lock(m_mutex);
+    MarkDone(index);
+    ScheduleReadyTasks();
+}
+
+unsigned long long StartupOrchestrator::MillisecondsSince(const LARGE_INTEGER& start) const
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart - start.QuadPart) * 1000ULL / (unsigned long long)m_frequency.QuadPart;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+
+struct StopInfo;
+
+enum class StartupTaskThread
+{
+    // Run on the UI thread, via a message posted to the main window
+    UI,
+    // Run on its own background thread, in parallel with other tasks
+    Background,
+    // Not run at all; completed by a call to StartupOrchestrator::Complete
+    Milestone
+};
+
+
+/**
+StartupOrchestrator runs the application's initialization tasks in
+dependency order. Tasks are declared up front with AddTask/AddMilestone, each
+naming the tasks it depends on. Once Start is called, every task whose
+dependencies are complete is started: background tasks each on their own
+thread (so independent ones run in parallel), UI tasks by posting
+WM_PSIPHON_STARTUP_TASK to the main window, whose handler must call RunUITask.
+
+Milestones represent events that happen elsewhere (e.g., "the HTML UI has
+loaded") and let tasks be ordered after them.
+
+Each task's queue and run times are recorded in diagnostics and in the
+"startup.task_ms.<name>" histogram.
+
+Thread safe.
+*/
+class StartupOrchestrator
+{
+public:
+    StartupOrchestrator();
+    virtual ~StartupOrchestrator();
+
+    /**
+    Declares a task. Must be called before Start. Exceptions thrown by `fn`
+    are logged and otherwise ignored; dependent tasks still run.
+    */
+    void AddTask(const string& name, StartupTaskThread thread, const vector<string>& dependsOn, std::function<void()> fn);
+
+    /// Declares a milestone. Must be called before Start.
+    void AddMilestone(const string& name);
+
+    /**
+    Starts running tasks. UI tasks are posted to `uiWindow`.
+    Throws if a task depends on an undeclared name.
+    */
+    void Start(HWND uiWindow);
+
+    /// Marks a milestone as reached. May be called before Start, and more than once.
+    void Complete(const string& milestone);
+
+    /// Returns true if the named task or milestone is done; false if it isn't, or is unknown.
+    bool IsDone(const string& name);
+
+    /// Must be called by the WM_PSIPHON_STARTUP_TASK handler, with its wParam.
+    void RunUITask(WPARAM wParam);
+
+    /**
+    Waits for all of the named tasks to complete, or for `stopInfo` to be
+    signalled (stopInfo.stopSignal may be NULL).
+    Returns false on stop, on timeout, or if a name is unknown.
+    Must not be called on the UI thread for a task that may depend on a UI task.
+    */
+    bool WaitFor(const vector<string>& names, const StopInfo& stopInfo, DWORD timeoutMs);
+
+    /**
+    Records the time from process creation until now as the
+    "startup.time_to_interactive_ms" metric. Call when the main window is
+    shown and usable; only the first call records anything, so it's safe to
+    call again when the UI reloads.
+    */
+    void RecordTimeToInteractive();
+
+private:
+    // not copyable
+    StartupOrchestrator(StartupOrchestrator const&);
+    StartupOrchestrator& operator=(StartupOrchestrator const&);
+
+    enum class TaskState { Pending, Scheduled, Done };
+
+    struct Task
+    {
+        string name;
+        StartupTaskThread thread;
+        vector<string> dependsOn;
+        vector<size_t> dependencies;
+        std::function<void()> fn;
+        TaskState state;
+        HANDLE doneEvent;
+        LARGE_INTEGER scheduledTime;
+    };
+
+    struct BackgroundTaskParams
+    {
+        StartupOrchestrator* orchestrator;
+        size_t index;
+    };
+
+    static DWORD WINAPI BackgroundTaskThread(void* data);
+
+    // m_mutex must be held
+    Task* FindTask(const string& name);
+    void MarkDone(size_t index);
+    void ScheduleReadyTasks();
+
+    void RunTask(size_t index);
+    unsigned long long MillisecondsSince(const LARGE_INTEGER& start) const;
+
+    HANDLE m_mutex;
+    HWND m_uiWindow;
+    bool m_started;
+    std::atomic<bool> m_timeToInteractiveRecorded;
+    LARGE_INTEGER m_frequency;
+    LARGE_INTEGER m_startTime;
+    vector<unique_ptr<Task>> m_tasks;
+};
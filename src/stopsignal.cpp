@@ -84,6 +84,14 @@ void StopSignal::SignalStop(DWORD reason)
 {
     AutoMUTEX lock(m_mutex);
     m_stop = m_stop | reason;
+
+    for (auto it = m_stopEvents.begin(); it != m_stopEvents.end(); ++it)
+    {
+        if (it->second & reason)
+        {
+            SetEvent(it->first);
+        }
+    }
 }
 
 void StopSignal::ClearStopSignal(DWORD reason)
@@ -92,6 +100,29 @@ void StopSignal::ClearStopSignal(DWORD reason)
     m_stop = m_stop & ~reason;
 }
 
+void StopSignal::RegisterStopEvent(HANDLE event, DWORD reasons)
+{
+    AutoMUTEX lock(m_mutex);
+    m_stopEvents.push_back(std::make_pair(event, reasons));
+    if (reasons & m_stop)
+    {
+        SetEvent(event);
+    }
+}
+
+void StopSignal::UnregisterStopEvent(HANDLE event)
+{
+    AutoMUTEX lock(m_mutex);
+    for (auto it = m_stopEvents.begin(); it != m_stopEvents.end(); ++it)
+    {
+        if (it->first == event)
+        {
+            m_stopEvents.erase(it);
+            return;
+        }
+    }
+}
+
 // static
 void StopSignal::ThrowSignalException(DWORD reason)
 {
@@ -138,6 +138,15 @@ public:
     // Removes `reason` from the set of currently set reasons.
     virtual void ClearStopSignal(DWORD reason);
 
+    // Registers a caller-owned event that will be set whenever any of the
+    // bitwise-OR'd `reasons` is signalled. If a matching reason is already set,
+    // the event is set immediately. This allows stop conditions to be waited on
+    // with WaitForMultipleObjects alongside other handles, rather than polled.
+    // The event is never reset by the stop signal; a manual-reset event is
+    // recommended. Must be unregistered before the event is closed.
+    void RegisterStopEvent(HANDLE event, DWORD reasons);
+    void UnregisterStopEvent(HANDLE event);
+
     static void ThrowSignalException(DWORD reason);
 
     StopSignal();
@@ -146,6 +155,7 @@ public:
 private:
     HANDLE m_mutex;
     DWORD m_stop;
+    vector<pair<HANDLE, DWORD>> m_stopEvents;
 };
 
 // Convenience struct for passing around a stop signal and set of reasons
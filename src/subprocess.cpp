@@ -142,6 +142,14 @@ bool Subprocess::SpawnSubprocess(const tstring &commandLineFlags)
     WaitForInputIdle(m_processInfo.hProcess, 5000);
 
     m_parentInputPipe = parentInputPipe;
+    try {
+        m_inputWriter.reset(new PipeWriter(m_parentInputPipe));
+    }
+    catch (std::exception& ex) {
+        // The subprocess can still run; WriteInput will just fail
+        my_print(NOT_SENSITIVE, false, _T("%s - PipeWriter failed: %S"), __TFUNCTION__, ex.what());
+        m_inputWriter.reset();
+    }
 
     return true;
 }
@@ -156,11 +164,37 @@ HANDLE Subprocess::ParentInputPipe()
     return m_parentInputPipe;
 }
 
-bool Subprocess::CloseInputPipes()
+bool Subprocess::WriteInput(const char* data, size_t length, DWORD timeoutMs/*=INFINITE*/)
+{
+    if (!m_inputWriter) {
+        return false;
+    }
+    return m_inputWriter->Write(data, length, timeoutMs);
+}
+
+bool Subprocess::FlushInput(DWORD timeoutMs/*=INFINITE*/)
+{
+    if (!m_inputWriter) {
+        return false;
+    }
+    return m_inputWriter->Flush(timeoutMs);
+}
+
+bool Subprocess::InputFailed()
+{
+    return m_inputWriter && m_inputWriter->Failed();
+}
+
+bool Subprocess::CloseInputPipes(DWORD flushTimeoutMs/*=INFINITE*/)
 {
     AutoMUTEX lock(m_mutex);
     bool success = true;
 
+    // The writer must be done with the pipe before it's closed
+    if (m_inputWriter) {
+        (void)m_inputWriter->Close(flushTimeoutMs);
+    }
+
     if (m_parentInputPipe != NULL && m_parentInputPipe != INVALID_HANDLE_VALUE) {
         if (CloseHandle(m_parentInputPipe)) {
             m_parentInputPipe = INVALID_HANDLE_VALUE;
@@ -200,7 +234,8 @@ bool Subprocess::Cleanup()
         m_exePath.clear();
     });
 
-    (void)CloseInputPipes();
+    // Don't wait on a subprocess that isn't reading its input
+    (void)CloseInputPipes(0);
 
     // Give the process an opportunity for graceful shutdown, then terminate
     if (m_processInfo.hProcess != NULL
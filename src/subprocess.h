@@ -20,6 +20,7 @@
 #pragma once
 
 #include "worker_thread.h"
+#include "pipe_writer.h"
 
 // Subprocess is running
 #define SUBPROCESS_STATUS_RUNNING    0x0L
@@ -90,17 +91,41 @@ public:
     /**
     Returns a handle to stdin of the subprocess. Only returns a valid handle
     when Status() == SUBPROCESS_STATUS_RUNNING.
+    Writing to it directly blocks until the subprocess reads; prefer
+    WriteInput.
     */
     virtual HANDLE ParentInputPipe();
 
+    /**
+    Queues data to be written to stdin of the subprocess, in the background.
+    Waits up to `timeoutMs` if too much is already queued (i.e., the
+    subprocess isn't keeping up). Returns true if all of the data was queued;
+    false if none of it was (timed out, input closed, a write failed, or no
+    subprocess). See PipeWriter::Write.
+    Call from the thread that spawned the subprocess.
+    */
+    virtual bool WriteInput(const char* data, size_t length, DWORD timeoutMs=INFINITE);
+
+    /**
+    Waits up to `timeoutMs` for all queued input to be written to the
+    subprocess. Returns false on timeout or if a write failed.
+    */
+    virtual bool FlushInput(DWORD timeoutMs=INFINITE);
+
+    /**
+    True if writing queued input to the subprocess has failed.
+    */
+    virtual bool InputFailed();
+
     /**
     Close child input pipe and parent input pipe. Should be called once
-    these are pipes are not required. See SpawnSubprocess(..). This
-    function can take several seconds to complete.
+    these are pipes are not required. See SpawnSubprocess(..).
+    Queued input is given up to `flushTimeoutMs` to be written first;
+    anything left after that is discarded.
     Returns true if the pipes were closed successfully, otherwise returns
     false.
     */
-    virtual bool CloseInputPipes();
+    virtual bool CloseInputPipes(DWORD flushTimeoutMs=INFINITE);
 
     // Indicates a fatal system error
     class Error
@@ -124,6 +149,7 @@ protected:
     tstring m_exePath;
     PROCESS_INFORMATION m_processInfo;
     HANDLE m_parentInputPipe;
+    unique_ptr<PipeWriter> m_inputWriter;
     HANDLE m_parentOutputPipe;
     string m_parentOutputPipeBuffer;
     HANDLE m_mutex;
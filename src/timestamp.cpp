@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "stdafx.h"
+#include "timestamp.h"
+
+
+static const Timestamp TICKS_PER_MILLISECOND = 10000;
+static const Timestamp TICKS_PER_SECOND = 1000 * TICKS_PER_MILLISECOND;
+
+// Length of "YYYY-MM-DDTHH:MM:SS."
+static const size_t SECONDS_PREFIX_LENGTH = 20;
+
+template<typename charT>
+struct SecondsPrefixCache
+{
+    Timestamp second;
+    bool valid;
+    charT prefix[SECONDS_PREFIX_LENGTH + 1];
+
+    SecondsPrefixCache() : second(0), valid(false) { prefix[0] = 0; }
+};
+
+static void RenderSecondsPrefix(Timestamp second, char* buffer)
+{
+    ULARGE_INTEGER value;
+    value.QuadPart = second * TICKS_PER_SECOND;
+    FILETIME fileTime;
+    fileTime.dwLowDateTime = value.LowPart;
+    fileTime.dwHighDateTime = value.HighPart;
+
+    SYSTEMTIME systime;
+    if (!FileTimeToSystemTime(&fileTime, &systime))
+    {
+        memset(&systime, 0, sizeof(systime));
+    }
+
+    _snprintf_s(
+        buffer,
+        SECONDS_PREFIX_LENGTH + 1,
+        _TRUNCATE,
+        "%04d-%02d-%02dT%02d:%02d:%02d.",
+        systime.wYear,
+        systime.wMonth,
+        systime.wDay,
+        systime.wHour,
+        systime.wMinute,
+        systime.wSecond);
+}
+
+static void RenderSecondsPrefix(Timestamp second, wchar_t* buffer)
+{
+    char narrow[SECONDS_PREFIX_LENGTH + 1];
+    RenderSecondsPrefix(second, narrow);
+
+    // The prefix is pure ASCII
+    for (size_t i = 0; i <= SECONDS_PREFIX_LENGTH; i++)
+    {
+        buffer[i] = (wchar_t)narrow[i];
+    }
+}
+
+template<typename charT>
+static basic_string<charT> FormatISO8601(Timestamp timestamp, SecondsPrefixCache<charT>& cache)
+{
+    Timestamp second = timestamp / TICKS_PER_SECOND;
+    unsigned int milliseconds = (unsigned int)((timestamp % TICKS_PER_SECOND) / TICKS_PER_MILLISECOND);
+
+    if (!cache.valid || cache.second != second)
+    {
+        RenderSecondsPrefix(second, cache.prefix);
+        cache.second = second;
+        cache.valid = true;
+    }
+
+    charT result[SECONDS_PREFIX_LENGTH + 5];
+    memcpy(result, cache.prefix, SECONDS_PREFIX_LENGTH * sizeof(charT));
+    result[SECONDS_PREFIX_LENGTH + 0] = (charT)('0' + milliseconds / 100);
+    result[SECONDS_PREFIX_LENGTH + 1] = (charT)('0' + (milliseconds / 10) % 10);
+    result[SECONDS_PREFIX_LENGTH + 2] = (charT)('0' + milliseconds % 10);
+    result[SECONDS_PREFIX_LENGTH + 3] = (charT)'Z';
+
+    return basic_string<charT>(result, SECONDS_PREFIX_LENGTH + 4);
+}
+
+Timestamp GetTimestamp()
+{
+    FILETIME fileTime;
+    GetSystemTimeAsFileTime(&fileTime);
+
+    ULARGE_INTEGER value;
+    value.LowPart = fileTime.dwLowDateTime;
+    value.HighPart = fileTime.dwHighDateTime;
+    return value.QuadPart;
+}
+
+string FormatISO8601Timestamp(Timestamp timestamp)
+{
+    static thread_local SecondsPrefixCache<char> cache;
+    return FormatISO8601(timestamp, cache);
+}
+
+wstring FormatISO8601TimestampW(Timestamp timestamp)
+{
+    static thread_local SecondsPrefixCache<wchar_t> cache;
+    return FormatISO8601(timestamp, cache);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#pragma once
+
+
+// A raw wall-clock timestamp: 100-nanosecond intervals since January 1, 1601
+// (UTC), i.e. a FILETIME as a single integer. Cheap to take and to store;
+// records should keep these and only format them when they're exported.
+typedef unsigned long long Timestamp;
+
+Timestamp GetTimestamp();
+
+// Format as ISO 8601 UTC with millisecond precision, e.g.
+// "2026-01-02T03:04:05.678Z".
+// The date and time up to the seconds is cached per thread, so formatting a
+// run of timestamps within the same second only renders the milliseconds.
+string FormatISO8601Timestamp(Timestamp timestamp);
+wstring FormatISO8601TimestampW(Timestamp timestamp);
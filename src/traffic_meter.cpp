@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "traffic_meter.h"
+#include "metrics.h"
+
+
+TunneledTrafficMeter& TunneledTrafficMeter::Instance()
+{
+    static TunneledTrafficMeter instance;
+    return instance;
+}
+
+TunneledTrafficMeter::TunneledTrafficMeter()
+    : m_total(0)
+{
+}
+
+void TunneledTrafficMeter::Add(unsigned long long bytes)
+{
+    m_total += bytes;
+
+    static MetricCounter& bytesTransferred = MetricsRegistry::Instance().Counter("tunnel.bytes_transferred");
+    bytesTransferred.Add(bytes);
+}
+
+unsigned long long TunneledTrafficMeter::Total() const
+{
+    return m_total.load();
+}
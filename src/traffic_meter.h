@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+
+
+// Process-wide count of the bytes carried by the tunnel. It lets background
+// work (e.g., upgrade downloads) see whether the user is actively using the
+// tunnel. Each transport feeds it from exactly one source, so that traffic
+// isn't counted twice: CoreTransport from the BytesTransferred notices of the
+// core carrying the tunnel, and VPNTransport from polipo's stats.
+class TunneledTrafficMeter
+{
+public:
+    static TunneledTrafficMeter& Instance();
+
+    void Add(unsigned long long bytes);
+
+    // Monotonically increasing; only differences between samples are meaningful.
+    unsigned long long Total() const;
+
+private:
+    TunneledTrafficMeter();
+
+    // not copyable
+    TunneledTrafficMeter(TunneledTrafficMeter const&);
+    TunneledTrafficMeter& operator=(TunneledTrafficMeter const&);
+
+    std::atomic<unsigned long long> m_total;
+};
@@ -28,6 +28,7 @@
 #include "config.h"
 #include "transport_registry.h"
 #include "systemproxysettings.h"
+#include "span_tracer.h"
 
 
 /******************************************************************************
@@ -43,6 +44,13 @@ ITransport::ITransport(LPCTSTR transportProtocolName)
       m_upgradePaver(NULL),
       m_connectRetryOkay(true)
 {
+    m_sessionInfoMutex = CreateMutex(NULL, FALSE, 0);
+}
+
+
+ITransport::~ITransport()
+{
+    CloseHandle(m_sessionInfoMutex);
 }
 
 
@@ -62,6 +70,12 @@ bool ITransport::ServerWithCapabilitiesExists()
 }
 
 
+bool ITransport::Reconfigure()
+{
+    return false;
+}
+
+
 void ITransport::Connect(
                     SystemProxySettings* systemProxySettings,
                     const StopInfo& stopInfo,
@@ -95,6 +109,7 @@ bool ITransport::IsConnectRetryOkay() const
 
 SessionInfo ITransport::GetSessionInfo() const
 {
+    AutoMUTEX lock(m_sessionInfoMutex);
     return m_sessionInfo;
 }
 
@@ -184,7 +199,7 @@ void ITransport::MarkServerFailed(const ServerEntry& serverEntry)
 }
 
 
-tstring ITransport::GetHandshakeRequestPath(const SessionInfo& sessionInfo)
+tstring ITransport::GetHandshakeRequestPath(const SessionInfo& sessionInfo, bool includeKnownServers/*=true*/)
 {
     tstring handshakeRequestPath;
     handshakeRequestPath = tstring(HTTP_HANDSHAKE_REQUEST_PATH) +
@@ -196,11 +211,9 @@ tstring ITransport::GetHandshakeRequestPath(const SessionInfo& sessionInfo)
                            _T("&relay_protocol=") + GetTransportRequestName();
 
     // Include a list of known server IP addresses in the request query string as required by /handshake
-    ServerEntries serverEntries = m_serverList.GetList();
-    for (ServerEntryIterator ii = serverEntries.begin(); ii != serverEntries.end(); ++ii)
+    if (includeKnownServers)
     {
-        handshakeRequestPath += _T("&known_server=");
-        handshakeRequestPath += UTF8ToWString(ii->serverAddress);
+        handshakeRequestPath += m_serverList.GetKnownServers()->GetQueryString();
     }
 
     return handshakeRequestPath;
@@ -209,11 +222,34 @@ tstring ITransport::GetHandshakeRequestPath(const SessionInfo& sessionInfo)
 
 bool ITransport::DoHandshake(bool preTransport, SessionInfo& sessionInfo)
 {
+    ScopedSpan span("ITransport::DoHandshake");
+
     string handshakeResponse;
 
-    tstring handshakeRequestPath = GetHandshakeRequestPath(sessionInfo);
+    // Send list of known server IP addresses (used for stats logging on the server).
+    // Servers that support it get a compact digest in the request body rather
+    // than a query parameter per server.
+    bool sendDigest = sessionInfo.HasServerEntry()
+                      && sessionInfo.GetServerEntry().HasCapability(KNOWN_SERVERS_DIGEST_CAPABILITY);
+
+    tstring handshakeRequestPath = GetHandshakeRequestPath(sessionInfo, !sendDigest);
+
+    string requestBody;
+    if (sendDigest)
+    {
+        shared_ptr<const KnownServers> knownServers = m_serverList.GetKnownServers();
+
+        Json::Value body(Json::objectValue);
+        body["known_servers_ipv4_digest"] = knownServers->GetIPv4Digest();
+        Json::Value otherAddresses(Json::arrayValue);
+        for (const auto& address : knownServers->GetOtherAddresses())
+        {
+            otherAddresses.append(address);
+        }
+        body["known_servers_other"] = otherAddresses;
 
-    // Send list of known server IP addresses (used for stats logging on the server)
+        requestBody = Json::FastWriter().write(body);
+    }
 
     // Allow an adhoc tunnel if this is a pre-transport handshake (i.e, for VPN)
     ServerRequest::ReqLevel reqLevel = preTransport ? ServerRequest::FULL : ServerRequest::ONLY_IF_TRANSPORT;
@@ -224,7 +260,10 @@ bool ITransport::DoHandshake(bool preTransport, SessionInfo& sessionInfo)
                         sessionInfo,
                         handshakeRequestPath.c_str(),
                         handshakeResponse,
-                        m_stopInfo)
+                        m_stopInfo,
+                        sendDigest ? L"Content-Type: application/json" : NULL,
+                        sendDigest ? (LPVOID)requestBody.c_str() : NULL,
+                        (DWORD)requestBody.length())
         || handshakeResponse.length() <= 0)
     {
         my_print(NOT_SENSITIVE, false, _T("Handshake failed"));
@@ -246,9 +285,8 @@ bool ITransport::DoHandshake(bool preTransport, SessionInfo& sessionInfo)
 // static
 size_t ITransport::AddServerEntries(
         LPCTSTR transportProtocolName,
-        const vector<string>& newServerEntryList,
-        const ServerEntry* serverEntry)
+        const ServerEntries& newServerEntries)
 {
     ServerList serverList(WStringToUTF8(transportProtocolName).c_str());
-    return serverList.AddEntriesToList(newServerEntryList, serverEntry);
+    return serverList.AddEntriesToList(newServerEntries);
 }
@@ -43,7 +43,9 @@ public:
 class IUpgradePaver
 {
 public:
-    virtual void PaveUpgrade(const string&) = 0;
+    // stagedUpgradeFilename must be a verified, decoded upgrade binary at the
+    // path given by GetUpgradeStagingPath. It is moved into place.
+    virtual void PaveUpgrade(const tstring& stagedUpgradeFilename) = 0;
 };
 
 class IAuthorizationsProvider
@@ -65,6 +67,7 @@ class ITransport : public IWorkerThread
 {
 public:
     ITransport(LPCTSTR transportProtocolName);
+    virtual ~ITransport();
 
     //returns immutable transport protocol name
     virtual tstring GetTransportProtocolName() const = 0;
@@ -112,6 +115,13 @@ public:
     // Returns true if the specified server supports this transport.
     virtual bool ServerHasCapabilities(const ServerEntry& entry) const = 0;
 
+    // Asks a connected transport to pick up changed tunnel parameter
+    // settings (see SETTINGS_CHANGE_TUNNEL_PARAMETERS) in place, keeping its
+    // local proxy ports so that system proxy settings can be left alone.
+    // Returns false if the transport can't do that, in which case the caller
+    // should reconnect. The default is false.
+    virtual bool Reconfigure();
+
     // Call to create the connection.
     // A failed attempt must clean itself up as needed.
     // May throw TransportFailed, Error, or Abort.
@@ -145,8 +155,7 @@ public:
 
     static size_t AddServerEntries(
             LPCTSTR transportProtocolName,
-            const vector<string>& newServerEntryList,
-            const ServerEntry* serverEntry);
+            const ServerEntries& newServerEntries);
 
     //
     // Exception classes
@@ -182,12 +191,17 @@ protected:
     void MarkServerSucceeded(const ServerEntry& serverEntry);
     void MarkServerFailed(const ServerEntry& serverEntry);
 
-    tstring GetHandshakeRequestPath(const SessionInfo& sessionInfo);
+    // If includeKnownServers is true, the known server list is appended as
+    // query parameters; otherwise it must be sent as a digest in the body.
+    tstring GetHandshakeRequestPath(const SessionInfo& sessionInfo, bool includeKnownServers=true);
     // May throw StopSignal::StopException
     bool DoHandshake(bool preTransport, SessionInfo& sessionInfo);
 
 protected:
+    // Transports may update m_sessionInfo from their own threads, so writers
+    // must hold m_sessionInfoMutex.
     SessionInfo m_sessionInfo;
+    HANDLE m_sessionInfoMutex;
     SystemProxySettings* m_systemProxySettings;
     const ServerEntry* m_tempConnectServerEntry;
     ServerList m_serverList;
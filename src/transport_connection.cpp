@@ -23,6 +23,7 @@
 #include "local_proxy.h"
 #include "transport.h"
 #include "psiclient.h"
+#include "span_tracer.h"
 
 
 TransportConnection::TransportConnection()
@@ -68,11 +69,14 @@ void TransportConnection::Connect(
 
     m_transport = transport;
 
+    ScopedSpan connectSpan("TransportConnection::Connect");
+
     try
     {
         m_workerThreadSynch.Reset();
 
         // Connect with the transport. Will throw on error.
+        ScopedSpan transportSpan("ITransport::Connect");
         m_transport->Connect(
                     &m_systemProxySettings,
                     stopInfo,
@@ -81,6 +85,7 @@ void TransportConnection::Connect(
                     authorizationsProvider,
                     &m_workerThreadSynch,
                     tempConnectServerEntry);
+        transportSpan.End();
 
         // Get initial SessionInfo. Note that this might be pre-handshake
         // and therefore not be totally filled in.
@@ -117,6 +122,7 @@ void TransportConnection::Connect(
 
             // Apply the system proxy settings that have been collected by the transport
             // and the local proxy.
+            ScopedSpan applySpan("SystemProxySettings::Apply");
             if (!m_systemProxySettings.Apply(allowedToSkipProxySettings))
             {
                 throw IWorkerThread::Error("SystemProxySettings::Apply failed");
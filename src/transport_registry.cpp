@@ -24,6 +24,7 @@
 #include "vpntransport.h"
 #include "coretransport.h"
 #include "serverlist.h"
+#include "server_entry_ingestion.h"
 #include "psiclient.h"
 
 
@@ -90,6 +91,13 @@ void TransportRegistry::NewAll(vector<shared_ptr<ITransport>>& all_transports)
 void TransportRegistry::AddServerEntries(
                             const vector<string>& newServerEntryList, 
                             const ServerEntry* serverEntry)
+{
+    ServerEntryIngestion::Instance().Submit(newServerEntryList, serverEntry);
+}
+
+
+// static
+void TransportRegistry::MergeServerEntries(const ServerEntries& newServerEntries)
 {
     tstringstream results;
     results << _T("Discovered new Psiphon servers: ");
@@ -100,7 +108,7 @@ void TransportRegistry::AddServerEntries(
          it != m_registeredTransports.end();
          ++it)
     {
-        size_t newEntries = it->addServerEntriesFn(it->transportProtocolName.c_str(), newServerEntryList, serverEntry);
+        size_t newEntries = it->addServerEntriesFn(it->transportProtocolName.c_str(), newServerEntries);
 
         if (newEntries > 0)
         {
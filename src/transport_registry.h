@@ -30,7 +30,7 @@ struct ServerEntry;
 //
 
 typedef ITransport* (*TransportFactoryFn)();
-typedef size_t (*AddServerEntriesFn)(LPCTSTR transportProtocolName, const vector<string>& newServerEntryList, const ServerEntry* serverEntry);
+typedef size_t (*AddServerEntriesFn)(LPCTSTR transportProtocolName, const ServerEntries& newServerEntries);
 
 struct RegisteredTransport
 {
@@ -53,11 +53,16 @@ public:
     // Create new instances of all available transports.
     static void NewAll(vector<shared_ptr<ITransport>>& all_transports);
 
-    // Add new server entries to all transports.
+    // Add new server entries to all transports. The entries are handed to
+    // ServerEntryIngestion, so this returns before they've been merged.
     static void AddServerEntries(
                     const vector<string>& newServerEntryList, 
                     const ServerEntry* serverEntry);
 
+    // Merge decoded server entries into all transports' lists, now. Used by
+    // ServerEntryIngestion.
+    static void MergeServerEntries(const ServerEntries& newServerEntries);
+
 private:
     struct RegistryEntryComparison 
     {
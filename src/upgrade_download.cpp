@@ -0,0 +1,576 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "upgrade_download.h"
+#include "config.h"
+#include "logging.h"
+#include "psiclient.h"
+#include "embeddedvalues.h"
+#include "httpsrequest.h"
+#include "authenticated_data_package.h"
+#include "traffic_meter.h"
+#include "utilities.h"
+
+
+// The download runs at the idle rate until the user is seen to be using the
+// tunnel, and then drops to the busy rate. Rates are in bytes per second.
+static const unsigned int UPGRADE_DOWNLOAD_IDLE_RATE = 512 * 1024;
+static const unsigned int UPGRADE_DOWNLOAD_BUSY_RATE = 32 * 1024;
+
+// Tunneled traffic, other than the download itself, above which the user is
+// considered to be active. In bytes per second.
+static const unsigned int FOREGROUND_TRAFFIC_THRESHOLD = 8 * 1024;
+static const DWORD FOREGROUND_TRAFFIC_SAMPLE_MS = 1000;
+
+static const DWORD REPLAY_CHUNK_SIZE = 64 * 1024;
+
+
+namespace {
+
+// Classic token bucket, with a burst capacity of one second's worth of tokens.
+class TokenBucket
+{
+public:
+    TokenBucket(unsigned int bytesPerSecond)
+        : m_bytesPerSecond(bytesPerSecond),
+          m_tokens(bytesPerSecond),
+          m_lastRefill(GetTickCount())
+    {
+    }
+
+    void SetRate(unsigned int bytesPerSecond)
+    {
+        Refill();
+        m_bytesPerSecond = bytesPerSecond;
+        m_tokens = min(m_tokens, m_bytesPerSecond);
+    }
+
+    // Takes `bytes` tokens. Consumption may drive the bucket into debt, which
+    // lets chunks larger than the burst capacity through. Returns how long to
+    // wait, in milliseconds, for the debt to be paid off before consuming more.
+    DWORD Consume(size_t bytes)
+    {
+        Refill();
+        m_tokens -= (double)bytes;
+
+        return m_tokens < 0 ? (DWORD)((-m_tokens * 1000.0) / m_bytesPerSecond) + 1 : 0;
+    }
+
+private:
+    void Refill()
+    {
+        DWORD now = GetTickCount();
+        m_tokens += GetTickCountDiff(m_lastRefill, now) * m_bytesPerSecond / 1000.0;
+        m_tokens = min(m_tokens, m_bytesPerSecond);
+        m_lastRefill = now;
+    }
+
+    double m_bytesPerSecond;
+    double m_tokens;
+    DWORD m_lastRefill;
+};
+
+// Header names are case-insensitive. Returns the first value, or "".
+string GetHeader(const map<string, vector<string>>& headers, const char* name)
+{
+    for (const auto& entry : headers)
+    {
+        if (_stricmp(entry.first.c_str(), name) == 0 && !entry.second.empty())
+        {
+            return entry.second[0];
+        }
+    }
+    return "";
+}
+
+// The validator identifies the version of the package that the partial file
+// holds the start of. It's stored as JSON: {"validator": string, "length": number}
+void LoadValidator(string& o_validator, unsigned long long& o_length)
+{
+    o_validator.clear();
+    o_length = 0;
+
+    string json;
+    if (!ReadRegistryStringValue(LOCAL_SETTINGS_REGISTRY_VALUE_UPGRADE_DOWNLOAD_VALIDATOR, json) || json.empty())
+    {
+        return;
+    }
+
+    Json::Value value;
+    Json::Reader reader;
+    if (!reader.parse(json, value) || !value.isObject())
+    {
+        return;
+    }
+
+    try
+    {
+        o_validator = value.get("validator", "").asString();
+        o_length = value.get("length", 0).asUInt64();
+    }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: JSON parse exception: %S"), __TFUNCTION__, e.what());
+        o_validator.clear();
+        o_length = 0;
+    }
+}
+
+void SaveValidator(const string& validator, unsigned long long length)
+{
+    string json;
+    if (!validator.empty())
+    {
+        Json::Value value;
+        value["validator"] = validator;
+        value["length"] = (Json::UInt64)length;
+        json = Json::FastWriter().write(value);
+    }
+
+    RegistryFailureReason reason = REGISTRY_FAILURE_NO_REASON;
+    (void)WriteRegistryStringValue(LOCAL_SETTINGS_REGISTRY_VALUE_UPGRADE_DOWNLOAD_VALIDATOR, json, reason);
+}
+
+bool TruncateFile(HANDLE file, unsigned long long length)
+{
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)length;
+    return SetFilePointerEx(file, offset, NULL, FILE_BEGIN) && SetEndOfFile(file);
+}
+
+
+// Appends the download to the partial file and feeds it through the package
+// verifier into the staging file. When resuming, the verifier is first
+// brought up to date by replaying the partial file from disk, before the
+// request is sent.
+class ResumableUpgradeSink : public IHTTPSResponseBodySink
+{
+public:
+    ResumableUpgradeSink(
+        HANDLE partialFile,
+        HANDLE stagingFile,
+        unsigned long long resumeOffset)
+        : m_partialFile(partialFile),
+          m_stagingFile(stagingFile),
+          m_verifier(UPGRADE_SIGNATURE_PUBLIC_KEY, stagingFile),
+          m_bucket(UPGRADE_DOWNLOAD_IDLE_RATE),
+          m_readDelay(0),
+          m_resumeOffset(resumeOffset),
+          m_partialLength(resumeOffset),
+          m_expectedLength(0),
+          m_accepted(false),
+          m_failed(false),
+          m_corrupt(false),
+          m_verifierAtResumeOffset(false),
+          m_lastReportedPercent(-10),
+          m_sampleStart(0),
+          m_sampleTrafficTotal(0),
+          m_sampleOwnBytes(0)
+    {
+    }
+
+    virtual void Reset()
+    {
+        // Discard anything from a previous attempt, but keep what was
+        // already in the partial file when we started.
+        (void)TruncateFile(m_partialFile, m_resumeOffset);
+        m_partialLength = m_resumeOffset;
+        m_expectedLength = 0;
+        m_readDelay = 0;
+        m_accepted = false;
+        m_failed = false;
+        m_corrupt = false;
+
+        // Reset is called on the thread making the request, so the partial
+        // file is replayed here rather than in Accept, which runs on the
+        // WinHTTP callback thread. It's only replayed again if a previous
+        // attempt fed the verifier more.
+        if (m_resumeOffset > 0 && !m_verifierAtResumeOffset)
+        {
+            m_verifierAtResumeOffset = Replay();
+            m_failed = !m_verifierAtResumeOffset;
+        }
+    }
+
+    virtual bool Accept(int code, const map<string, vector<string>>& headers)
+    {
+        if (code == HTTPSRequest::PARTIAL_CONTENT && m_resumeOffset > 0)
+        {
+            // The If-Range validator matched, so the server is sending the
+            // rest of the same package. Content-Range: bytes first-last/total
+            unsigned long long first = 0, last = 0, total = 0;
+            string contentRange = GetHeader(headers, "Content-Range");
+            if (sscanf_s(contentRange.c_str(), "bytes %llu-%llu/%llu", &first, &last, &total) != 3
+                || first != m_resumeOffset)
+            {
+                my_print(NOT_SENSITIVE, true, _T("%s: unexpected Content-Range: %S"), __TFUNCTION__, contentRange.c_str());
+                m_failed = true;
+                m_corrupt = true;
+            }
+            else
+            {
+                // Reset has already replayed the partial file
+                m_expectedLength = total;
+            }
+        }
+        else if (code == HTTPSRequest::OK)
+        {
+            // Either this is a fresh download or the package has changed
+            // since the partial download; either way, start over.
+            m_resumeOffset = 0;
+            m_partialLength = 0;
+            m_expectedLength = _strtoui64(GetHeader(headers, "Content-Length").c_str(), NULL, 10);
+
+            string validator = GetHeader(headers, "ETag");
+            if (validator.empty())
+            {
+                validator = GetHeader(headers, "Last-Modified");
+            }
+
+            m_verifier.Reset();
+            m_verifierAtResumeOffset = false;
+            m_failed = !TruncateFile(m_partialFile, 0) || !TruncateFile(m_stagingFile, 0);
+
+            // Without a validator we can't safely resume, so don't try.
+            SaveValidator(validator, m_expectedLength);
+        }
+        else
+        {
+            return false;
+        }
+
+        m_accepted = true;
+        m_sampleStart = GetTickCount();
+        m_sampleTrafficTotal = TunneledTrafficMeter::Instance().Total();
+        m_sampleOwnBytes = 0;
+        ReportProgress();
+        return true;
+    }
+
+    virtual bool Write(const char* data, size_t length)
+    {
+        if (m_failed)
+        {
+            return false;
+        }
+
+        AdjustRate(length);
+
+        // Rather than blocking the WinHTTP callback thread, the request is
+        // asked to hold off reading more (see ReadDelay)
+        m_readDelay = m_bucket.Consume(length);
+
+        DWORD written = 0;
+        if (!WriteFile(m_partialFile, data, length, &written, NULL) || written != length)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s: WriteFile failed (%d)"), __TFUNCTION__, GetLastError());
+            m_failed = true;
+            return false;
+        }
+        m_partialLength += length;
+
+        m_verifierAtResumeOffset = false;
+        if (!m_verifier.Put(data, length))
+        {
+            m_failed = true;
+            m_corrupt = true;
+            return false;
+        }
+
+        ReportProgress();
+        return true;
+    }
+
+    virtual DWORD ReadDelay()
+    {
+        return m_readDelay;
+    }
+
+    // Returns true if the whole package was received and verified.
+    bool Finish()
+    {
+        if (!m_accepted || m_failed)
+        {
+            return false;
+        }
+
+        if (m_expectedLength > 0 && m_partialLength != m_expectedLength)
+        {
+            // The connection dropped early. What we have is still good.
+            my_print(NOT_SENSITIVE, true, _T("%s: incomplete download (%llu of %llu bytes)"), __TFUNCTION__, m_partialLength, m_expectedLength);
+            return false;
+        }
+
+        if (!m_verifier.Finish() || !FlushFileBuffers(m_stagingFile))
+        {
+            m_corrupt = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    // True if the partial file can't be used to resume.
+    bool Corrupt() const
+    {
+        return m_corrupt;
+    }
+
+private:
+    // Feeds the first m_resumeOffset bytes of the partial file to the verifier.
+    bool Replay()
+    {
+        m_verifier.Reset();
+        if (!TruncateFile(m_stagingFile, 0))
+        {
+            return false;
+        }
+
+        LARGE_INTEGER zero = { 0 };
+        if (!SetFilePointerEx(m_partialFile, zero, NULL, FILE_BEGIN))
+        {
+            return false;
+        }
+
+        unique_ptr<char[]> buffer(new char[REPLAY_CHUNK_SIZE]);
+        unsigned long long remaining = m_resumeOffset;
+        while (remaining > 0)
+        {
+            DWORD toRead = (DWORD)min(remaining, (unsigned long long)REPLAY_CHUNK_SIZE);
+            DWORD read = 0;
+            if (!ReadFile(m_partialFile, buffer.get(), toRead, &read, NULL) || read != toRead)
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s: ReadFile failed (%d)"), __TFUNCTION__, GetLastError());
+                m_corrupt = true;
+                return false;
+            }
+
+            if (!m_verifier.Put(buffer.get(), read))
+            {
+                m_corrupt = true;
+                return false;
+            }
+
+            remaining -= read;
+        }
+
+        // Subsequent writes append.
+        return TruncateFile(m_partialFile, m_resumeOffset);
+    }
+
+    // Drops to the busy rate while the user is using the tunnel. The traffic
+    // meter includes the download itself (when tunneled), so that's subtracted.
+    void AdjustRate(size_t length)
+    {
+        m_sampleOwnBytes += length;
+
+        DWORD now = GetTickCount();
+        DWORD elapsed = GetTickCountDiff(m_sampleStart, now);
+        if (elapsed < FOREGROUND_TRAFFIC_SAMPLE_MS)
+        {
+            return;
+        }
+
+        unsigned long long trafficTotal = TunneledTrafficMeter::Instance().Total();
+        unsigned long long traffic = trafficTotal - m_sampleTrafficTotal;
+        unsigned long long foreground = traffic > m_sampleOwnBytes ? traffic - m_sampleOwnBytes : 0;
+
+        m_bucket.SetRate(
+            foreground * 1000 / elapsed > FOREGROUND_TRAFFIC_THRESHOLD
+                ? UPGRADE_DOWNLOAD_BUSY_RATE
+                : UPGRADE_DOWNLOAD_IDLE_RATE);
+
+        m_sampleStart = now;
+        m_sampleTrafficTotal = trafficTotal;
+        m_sampleOwnBytes = 0;
+    }
+
+    void ReportProgress()
+    {
+        if (m_expectedLength == 0)
+        {
+            return;
+        }
+
+        int percent = (int)(m_partialLength * 100 / m_expectedLength);
+        if (percent / 10 != m_lastReportedPercent / 10)
+        {
+            my_print(NOT_SENSITIVE, false, _T("Downloading new version... %d%%"), percent);
+            m_lastReportedPercent = percent;
+        }
+    }
+
+private:
+    HANDLE m_partialFile;
+    HANDLE m_stagingFile;
+    SignedDataPackageStreamVerifier m_verifier;
+    TokenBucket m_bucket;
+    DWORD m_readDelay;
+    unsigned long long m_resumeOffset;
+    unsigned long long m_partialLength;
+    unsigned long long m_expectedLength;
+    bool m_accepted;
+    bool m_failed;
+    bool m_corrupt;
+    // True while the verifier holds exactly the first m_resumeOffset bytes
+    bool m_verifierAtResumeOffset;
+    int m_lastReportedPercent;
+    DWORD m_sampleStart;
+    unsigned long long m_sampleTrafficTotal;
+    unsigned long long m_sampleOwnBytes;
+};
+
+} // namespace
+
+
+bool DownloadUpgrade(const StopInfo& stopInfo, tstring& o_stagedUpgradeFilename)
+{
+    o_stagedUpgradeFilename.clear();
+
+    tstring stagingPath;
+    if (!GetUpgradeStagingPath(stagingPath))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: GetUpgradeStagingPath failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+    tstring partialPath = stagingPath + _T(".partial");
+
+    HANDLE partialFile = CreateFile(partialPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    HANDLE stagingFile = CreateFile(stagingPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    auto closeFiles = [&]() {
+        if (partialFile != INVALID_HANDLE_VALUE) CloseHandle(partialFile);
+        if (stagingFile != INVALID_HANDLE_VALUE) CloseHandle(stagingFile);
+        partialFile = stagingFile = INVALID_HANDLE_VALUE;
+    };
+    auto cleanup = finally(closeFiles);
+
+    if (partialFile == INVALID_HANDLE_VALUE || stagingFile == INVALID_HANDLE_VALUE)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: CreateFile failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    // Resume if there's a partial download and we know what it's part of.
+
+    string validator;
+    unsigned long long expectedLength = 0;
+    LoadValidator(validator, expectedLength);
+
+    LARGE_INTEGER partialSize = { 0 };
+    unsigned long long resumeOffset = 0;
+    if (!validator.empty() && GetFileSizeEx(partialFile, &partialSize))
+    {
+        resumeOffset = (unsigned long long)partialSize.QuadPart;
+    }
+
+    // A complete partial file would get a 416 response; just fetch it again.
+    if (resumeOffset > 0 && expectedLength > 0 && resumeOffset >= expectedLength)
+    {
+        resumeOffset = 0;
+    }
+
+    if (resumeOffset == 0 && !TruncateFile(partialFile, 0))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: TruncateFile failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    wstring additionalHeaders;
+    if (resumeOffset > 0)
+    {
+        // If-Range makes the server send the whole (new) package if it has
+        // changed since the partial download.
+        wstringstream headers;
+        headers << L"Range: bytes=" << resumeOffset << L"-\r\n"
+                << L"If-Range: " << UTF8ToWString(validator) << L"\r\n";
+        additionalHeaders = headers.str();
+
+        my_print(NOT_SENSITIVE, false, _T("Resuming download of new version..."));
+    }
+
+    ResumableUpgradeSink sink(partialFile, stagingFile, resumeOffset);
+
+    HTTPSRequest httpsRequest;
+    httpsRequest.SetResponseBodySink(&sink);
+    HTTPSRequest::Response httpsResponse;
+    bool requestSuccess = false;
+
+    try
+    {
+        requestSuccess = httpsRequest.MakeRequest(
+            UTF8ToWString(UPGRADE_ADDRESS).c_str(),
+            443,
+            "",
+            UTF8ToWString(UPGRADE_REQUEST_PATH).c_str(),
+            stopInfo,
+            HTTPSRequest::PsiphonProxy::USE,
+            httpsResponse,
+            true, // fail over to URL proxy
+            additionalHeaders.empty() ? NULL : additionalHeaders.c_str());
+    }
+    catch (StopSignal::StopException&)
+    {
+        my_print(NOT_SENSITIVE, false, _T("Download of new version interrupted; it will be resumed."));
+        throw;
+    }
+
+    if (httpsResponse.code == HTTPSRequest::RANGE_NOT_SATISFIABLE)
+    {
+        // The partial file doesn't match what the server has. Start over next time.
+        SaveValidator("", 0);
+        (void)TruncateFile(partialFile, 0);
+        return false;
+    }
+
+    if (!requestSuccess
+        || (httpsResponse.code != HTTPSRequest::OK && httpsResponse.code != HTTPSRequest::PARTIAL_CONTENT))
+    {
+        // If the download failed, we simply do nothing. Whatever made it into
+        // the partial file will be resumed next time.
+        return false;
+    }
+
+    bool verified = sink.Finish();
+    if (!verified && !sink.Corrupt())
+    {
+        // Incomplete, but resumable.
+        return false;
+    }
+
+    // Either the upgrade is staged, or the package is bad and must be
+    // downloaded afresh. In both cases the partial download is done with.
+    closeFiles();
+    (void)DeleteFile(partialPath.c_str());
+    SaveValidator("", 0);
+
+    if (!verified)
+    {
+        // Bad package. Log and continue.
+        my_print(NOT_SENSITIVE, false, _T("Upgrade package verification failed! Please report this error."));
+        (void)DeleteFile(stagingPath.c_str());
+        return false;
+    }
+
+    my_print(NOT_SENSITIVE, false, _T("Download complete"));
+
+    o_stagedUpgradeFilename = stagingPath;
+    return true;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "stopsignal.h"
+
+
+// Downloads the upgrade package and writes the verified, decoded binary to
+// o_stagedUpgradeFilename (see GetUpgradeStagingPath), ready to be paved.
+//
+// The raw package is kept in a partial file beside the staging file, and the
+// server's validator (ETag or Last-Modified) is kept in the registry, so that
+// a download interrupted by a stop signal or a dropped tunnel is resumed with
+// a Range request next time rather than started over.
+//
+// The download is rate limited, and backs off further while the user is
+// sending traffic through the tunnel. Progress is reported in the UI log.
+//
+// Returns true if the staged binary is ready. Returns false if the download
+// failed or was incomplete (partial progress is kept), or if the package
+// failed verification (partial progress is discarded).
+// Throws StopSignal::StopException if stop was signaled; partial progress is kept.
+bool DownloadUpgrade(const StopInfo& stopInfo, tstring& o_stagedUpgradeFilename);
@@ -63,6 +63,18 @@
 #define SKIP_AUTO_CONNECT_NAME          "SkipAutoConnect"
 #define SKIP_AUTO_CONNECT_DEFAULT       FALSE
 
+#define CONNECTION_TRACE_NAME           "ConnectionTrace"
+#define CONNECTION_TRACE_DEFAULT        CONNECTION_TRACE_TIMELINE
+
+#define CORE_NOTICE_RECORDING_NAME      "CoreNoticeRecording"
+#define CORE_NOTICE_RECORDING_DEFAULT   FALSE
+
+#define CORE_NOTICE_REPLAY_NAME         "CoreNoticeReplay"
+#define CORE_NOTICE_REPLAY_DEFAULT      L""
+
+#define REORDER_PROBES_NAME             "ReorderProbes"
+#define REORDER_PROBES_DEFAULT          REORDER_PROBES_BY_CAPABILITY
+
 #define SKIP_UPSTREAM_PROXY_NAME        "SSHParentProxySkip"
 #define SKIP_UPSTREAM_PROXY_DEFAULT     FALSE
 
@@ -228,9 +240,9 @@ void Settings::ToJson(Json::Value& o_json)
 // FromJson updates the stores settings from an object stored in JSON format.
 bool Settings::FromJson(
     const string& utf8JSON,
-    bool& o_reconnectRequired)
+    DWORD& o_changes)
 {
-    o_reconnectRequired = false;
+    o_changes = SETTINGS_CHANGE_NONE;
 
     Json::Value json;
     Json::Reader reader;
@@ -242,7 +254,10 @@ bool Settings::FromJson(
         return false;
     }
 
-    bool reconnectRequiredValueChanged = false;
+    // Changes that can be applied to a running tunnel core
+    bool tunnelParametersChanged = false;
+    // Changes that require the transport to be restarted
+    bool transportChanged = false;
 
     try
     {
@@ -253,74 +268,74 @@ bool Settings::FromJson(
         RegistryFailureReason failReason;
 
         BOOL splitTunnel = json.get("SplitTunnel", SPLIT_TUNNEL_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || !!splitTunnel != Settings::SplitTunnel();
+        tunnelParametersChanged = tunnelParametersChanged || !!splitTunnel != Settings::SplitTunnel();
         WriteRegistryDwordValue(SPLIT_TUNNEL_NAME, splitTunnel);
 
         BOOL splitTunnelChineseSites = json.get("SplitTunnelChineseSites", SPLIT_TUNNEL_CHINESE_SITES_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || !!splitTunnelChineseSites != Settings::SplitTunnelChineseSites();
+        tunnelParametersChanged = tunnelParametersChanged || !!splitTunnelChineseSites != Settings::SplitTunnelChineseSites();
         WriteRegistryDwordValue(SPLIT_TUNNEL_CHINESE_SITES_NAME, splitTunnelChineseSites);
 
         BOOL disableTimeouts = json.get("DisableTimeouts", DISABLE_TIMEOUTS_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || !!disableTimeouts != Settings::DisableTimeouts();
+        tunnelParametersChanged = tunnelParametersChanged || !!disableTimeouts != Settings::DisableTimeouts();
         WriteRegistryDwordValue(DISABLE_TIMEOUTS_NAME, disableTimeouts);
 
         wstring transport = json.get("VPN", TRANSPORT_DEFAULT).asUInt() ? TRANSPORT_VPN : TRANSPORT_DEFAULT;
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || transport != Settings::Transport();
+        transportChanged = transportChanged || transport != Settings::Transport();
         WriteRegistryStringValue(
             TRANSPORT_NAME,
             transport,
             failReason);
 
         DWORD httpPort = json.get("LocalHttpProxyPort", HTTP_PROXY_PORT_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || httpPort != Settings::LocalHttpProxyPort();
+        transportChanged = transportChanged || httpPort != Settings::LocalHttpProxyPort();
         WriteRegistryDwordValue(HTTP_PROXY_PORT_NAME, httpPort);
 
         DWORD socksPort = json.get("LocalSocksProxyPort", SOCKS_PROXY_PORT_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || socksPort != Settings::LocalSocksProxyPort();
+        transportChanged = transportChanged || socksPort != Settings::LocalSocksProxyPort();
         WriteRegistryDwordValue(SOCKS_PROXY_PORT_NAME, socksPort);
 
         BOOL exposeLocalProxiesToLAN = json.get("ExposeLocalProxiesToLAN", EXPOSE_LOCAL_PROXIES_TO_LAN_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || !!exposeLocalProxiesToLAN != Settings::ExposeLocalProxiesToLAN();
+        transportChanged = transportChanged || !!exposeLocalProxiesToLAN != Settings::ExposeLocalProxiesToLAN();
         WriteRegistryDwordValue(EXPOSE_LOCAL_PROXIES_TO_LAN_NAME, exposeLocalProxiesToLAN);
 
         string upstreamProxyUsername = json.get("UpstreamProxyUsername", UPSTREAM_PROXY_USERNAME_DEFAULT).asString();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || upstreamProxyUsername != Settings::UpstreamProxyUsername();
+        tunnelParametersChanged = tunnelParametersChanged || upstreamProxyUsername != Settings::UpstreamProxyUsername();
         WriteRegistryStringValue(
             UPSTREAM_PROXY_USERNAME_NAME,
             upstreamProxyUsername,
             failReason);
 
         string upstreamProxyPassword = json.get("UpstreamProxyPassword", UPSTREAM_PROXY_PASSWORD_DEFAULT).asString();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || upstreamProxyPassword != Settings::UpstreamProxyPassword();
+        tunnelParametersChanged = tunnelParametersChanged || upstreamProxyPassword != Settings::UpstreamProxyPassword();
         WriteRegistryStringValue(
             UPSTREAM_PROXY_PASSWORD_NAME,
             upstreamProxyPassword,
             failReason);
 
         string upstreamProxyDomain = json.get("UpstreamProxyDomain", UPSTREAM_PROXY_DOMAIN_DEFAULT).asString();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || upstreamProxyDomain != Settings::UpstreamProxyDomain();
+        tunnelParametersChanged = tunnelParametersChanged || upstreamProxyDomain != Settings::UpstreamProxyDomain();
         WriteRegistryStringValue(
             UPSTREAM_PROXY_DOMAIN_NAME,
             upstreamProxyDomain,
             failReason);
 
         string upstreamProxyHostname = json.get("UpstreamProxyHostname", UPSTREAM_PROXY_HOSTNAME_DEFAULT).asString();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || upstreamProxyHostname != Settings::UpstreamProxyHostname();
+        tunnelParametersChanged = tunnelParametersChanged || upstreamProxyHostname != Settings::UpstreamProxyHostname();
         WriteRegistryStringValue(
             UPSTREAM_PROXY_HOSTNAME_NAME,
             upstreamProxyHostname,
             failReason);
 
         DWORD upstreamProxyPort = json.get("UpstreamProxyPort", UPSTREAM_PROXY_PORT_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || upstreamProxyPort != Settings::UpstreamProxyPort();
+        tunnelParametersChanged = tunnelParametersChanged || upstreamProxyPort != Settings::UpstreamProxyPort();
         WriteRegistryDwordValue(UPSTREAM_PROXY_PORT_NAME, upstreamProxyPort);
 
         BOOL skipUpstreamProxy = json.get("SkipUpstreamProxy", SKIP_UPSTREAM_PROXY_DEFAULT).asUInt();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || !!skipUpstreamProxy != Settings::SkipUpstreamProxy();
+        tunnelParametersChanged = tunnelParametersChanged || !!skipUpstreamProxy != Settings::SkipUpstreamProxy();
         WriteRegistryDwordValue(SKIP_UPSTREAM_PROXY_NAME, skipUpstreamProxy);
 
         string egressRegion = json.get("EgressRegion", EGRESS_REGION_DEFAULT).asString();
-        reconnectRequiredValueChanged = reconnectRequiredValueChanged || egressRegion != Settings::EgressRegion();
+        tunnelParametersChanged = tunnelParametersChanged || egressRegion != Settings::EgressRegion();
         WriteRegistryStringValue(
             EGRESS_REGION_NAME,
             egressRegion,
@@ -340,7 +355,14 @@ bool Settings::FromJson(
         return false;
     }
 
-    o_reconnectRequired = reconnectRequiredValueChanged;
+    if (tunnelParametersChanged)
+    {
+        o_changes |= SETTINGS_CHANGE_TUNNEL_PARAMETERS;
+    }
+    if (transportChanged)
+    {
+        o_changes |= SETTINGS_CHANGE_TRANSPORT;
+    }
 
     return true;
 }
@@ -589,6 +611,26 @@ bool Settings::SkipAutoConnect()
     return !!GetSettingDword(SKIP_AUTO_CONNECT_NAME, SKIP_AUTO_CONNECT_DEFAULT);
 }
 
+DWORD Settings::ConnectionTrace()
+{
+    return GetSettingDword(CONNECTION_TRACE_NAME, CONNECTION_TRACE_DEFAULT);
+}
+
+bool Settings::CoreNoticeRecording()
+{
+    return !!GetSettingDword(CORE_NOTICE_RECORDING_NAME, CORE_NOTICE_RECORDING_DEFAULT);
+}
+
+tstring Settings::CoreNoticeReplayFilename()
+{
+    return GetSettingString(CORE_NOTICE_REPLAY_NAME, CORE_NOTICE_REPLAY_DEFAULT);
+}
+
+DWORD Settings::ReorderProbes()
+{
+    return GetSettingDword(REORDER_PROBES_NAME, REORDER_PROBES_DEFAULT);
+}
+
 /*
 For internal use only
 TODO: Probably shouldn't be in the "usersettings" file
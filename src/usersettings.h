@@ -20,14 +20,36 @@
 #pragma once
 
 
+// Spans are not recorded
+#define CONNECTION_TRACE_DISABLED       0
+// Spans are recorded and included in feedback diagnostics
+#define CONNECTION_TRACE_TIMELINE       1
+// As above, and a Chrome trace file is also written after each connect
+#define CONNECTION_TRACE_CHROME_TRACE   2
+
+// Server list reorder probes each server with the strongest check its
+// capabilities allow (TLS or HTTP where possible)
+#define REORDER_PROBES_BY_CAPABILITY    0
+// Server list reorder only checks that a TCP connection can be made
+#define REORDER_PROBES_TCP_ONLY         1
+
+// Kinds of change reported by Settings::FromJson, combined as flags
+#define SETTINGS_CHANGE_NONE                0x0L
+// Tunnel parameters (split tunnel, egress region, upstream proxy, timeouts);
+// may be applied in place (see ITransport::Reconfigure)
+#define SETTINGS_CHANGE_TUNNEL_PARAMETERS   (1L << 0)
+// Transport type or local proxy ports; requires a reconnect
+#define SETTINGS_CHANGE_TRANSPORT           (1L << 1)
+
+
 namespace Settings
 {
     void Initialize();
 
     void ToJson(Json::Value& o_json);
-    // Returns false on error. o_reconnectRequired will be true if a reconnect
-    // is going to occur to apply the settings.
-    bool FromJson(const string& utf8JSON, bool& o_reconnectRequired);
+    // Returns false on error. o_changes is set to the SETTINGS_CHANGE_* flags
+    // describing what needs to be done to apply the settings.
+    bool FromJson(const string& utf8JSON, DWORD& o_changes);
 
     // Returns true if settings changed.
     bool Show(HINSTANCE hInst, HWND hParentWnd);
@@ -62,6 +84,22 @@ namespace Settings
     bool SkipProxySettings();
     bool SkipAutoConnect();
 
+    // Connection phase tracing; see SpanTracer. Not exposed in the UI.
+    // One of CONNECTION_TRACE_{DISABLED, TIMELINE, CHROME_TRACE}.
+    DWORD ConnectionTrace();
+
+    // Record tunnel core notices for offline analysis; see NoticeRecorder. Not exposed in the UI.
+    bool CoreNoticeRecording();
+
+    // A notice recording to replay at startup, to benchmark notice handling;
+    // see NoticeReplay::Benchmark. Empty (the default) for none. Not exposed in the UI.
+    tstring CoreNoticeReplayFilename();
+
+    // How servers are probed when reordering the server list; see
+    // ChooseReachabilityProbe. Not exposed in the UI.
+    // One of REORDER_PROBES_{BY_CAPABILITY, TCP_ONLY}.
+    DWORD ReorderProbes();
+
     // These are used by the web UI
     void SetCookies(const string& value);
     string GetCookies();
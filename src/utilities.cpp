@@ -32,6 +32,7 @@
 #include "stopsignal.h"
 #include "diagnostic_info.h"
 #include "webbrowser.h"
+#include "timestamp.h"
 #include <iomanip>
 #include <iphlpapi.h>
 #include <ws2tcpip.h>
@@ -392,6 +393,14 @@ bool GetOwnExecutablePath(tstring& o_path) {
     return true;
 }
 
+bool GetUpgradeStagingPath(tstring& o_path) {
+    if (!GetOwnExecutablePath(o_path)) {
+        return false;
+    }
+    o_path += _T(".upgrade");
+    return true;
+}
+
 
 // Caller can check GetLastError() on failure
 bool GetShortPathName(const tstring& path, tstring& o_shortPath)
@@ -547,16 +556,52 @@ DWORD WaitForConnectability(
 
 bool TestForOpenPort(int& targetPort, int maxIncrement, const StopInfo& stopInfo)
 {
+    // A port is available if we can bind it ourselves. Unlike attempting to
+    // connect, this gives an immediate answer, and it also catches ports that
+    // are bound but not (yet) listening.
+
+    // Winsock is started once for the whole scan, not per port.
+    WSADATA wsaData;
+    int startupResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (0 != startupResult)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: WSAStartup failed (%d)"), __TFUNCTION__, startupResult);
+        return false;
+    }
+    auto wsaCleanup = finally([] { WSACleanup(); });
+
     int maxPort = targetPort + maxIncrement;
     do
     {
+        // Throws if signaled
+        stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, true);
+
         if (targetPort > 0 && targetPort <= 0xFFFF)
         {
-            if (ERROR_SUCCESS != WaitForConnectability(
-                (USHORT)targetPort,
-                100,
-                0,
-                stopInfo))
+            SOCKET sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (INVALID_SOCKET == sock)
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s: socket failed (%d)"), __TFUNCTION__, WSAGetLastError());
+                return false;
+            }
+
+            // Don't share the port with a socket that's bound with SO_REUSEADDR
+            BOOL exclusive = TRUE;
+            if (SOCKET_ERROR == setsockopt(sock, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char*)&exclusive, sizeof(exclusive)))
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s: setsockopt failed (%d)"), __TFUNCTION__, WSAGetLastError());
+            }
+
+            sockaddr_in addr;
+            ZeroMemory(&addr, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+            addr.sin_port = htons((USHORT)targetPort);
+
+            int bindResult = bind(sock, (sockaddr*)&addr, sizeof(addr));
+            closesocket(sock);
+
+            if (0 == bindResult)
             {
                 return true;
             }
@@ -1649,23 +1694,7 @@ wstring GetLocaleID()
 
 tstring GetISO8601DatetimeString()
 {
-    SYSTEMTIME systime;
-    GetSystemTime(&systime);
-
-    TCHAR ret[64];
-    _sntprintf_s(
-        ret,
-        sizeof(ret) / sizeof(ret[0]),
-        _T("%04d-%02d-%02dT%02d:%02d:%02d.%03dZ"),
-        systime.wYear,
-        systime.wMonth,
-        systime.wDay,
-        systime.wHour,
-        systime.wMinute,
-        systime.wSecond,
-        systime.wMilliseconds);
-
-    return ret;
+    return FormatISO8601TimestampW(GetTimestamp());
 }
 
 
@@ -67,6 +67,11 @@ bool GetUniqueTempFilename(const tstring& extension, tstring& o_filepath, int at
 /// Retrieves the path of the current executable. Returns false on error.
 bool GetOwnExecutablePath(tstring& o_path);
 
+/// Retrieves the path where a new version of the executable is written before
+/// being moved into place. It's beside the executable, so that the move is a
+/// rename on the same volume. Returns false on error.
+bool GetUpgradeStagingPath(tstring& o_path);
+
 
 /*
  * Network and IPC Utilities
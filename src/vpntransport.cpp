@@ -28,6 +28,7 @@
 #include "utilities.h"
 #include "server_request.h"
 #include "diagnostic_info.h"
+#include "span_tracer.h"
 
 
 #define VPN_CONNECTION_TIMEOUT_SECONDS  20
@@ -63,9 +64,12 @@ VPNTransport::VPNTransport()
       m_state(CONNECTION_STATE_STOPPED),
       m_stateChangeEvent(INVALID_HANDLE_VALUE),
       m_rasConnection(0),
-      m_lastErrorCode(0)
+      m_lastErrorCode(0),
+      m_traceStartTime(0),
+      m_connectTrace(Json::arrayValue)
 {
     m_stateChangeEvent = CreateEvent(NULL, FALSE, FALSE, 0);
+    m_traceMutex = CreateMutex(NULL, FALSE, 0);
 }
 
 VPNTransport::~VPNTransport()
@@ -81,6 +85,7 @@ VPNTransport::~VPNTransport()
         (void)Cleanup();
     }
     CloseHandle(m_stateChangeEvent);
+    CloseHandle(m_traceMutex);
 }
 
 tstring VPNTransport::GetTransportProtocolName() const 
@@ -255,6 +260,45 @@ void VPNTransport::TransportConnect()
     my_print(NOT_SENSITIVE, false, _T("%s successfully connected."), GetTransportDisplayName().c_str());
 }
 
+//==== Connect steps ===========================================================
+
+// Runs `fn` as the connect step `name` in its own span, recording the step's
+// start offset from `stepsStartTime`, its duration and whether it succeeded
+// into `timing`. Exceptions from `fn` propagate.
+static void RunConnectStep(const char* name, unsigned int parentSpan, DWORD stepsStartTime, Json::Value& timing, function<void()> fn)
+{
+    ScopedSpan span(name, parentSpan);
+    timing["step"] = name;
+    timing["succeeded"] = false;
+    DWORD stepStartTime = GetTickCount();
+    timing["startMs"] = (Json::UInt)(stepStartTime - stepsStartTime);
+    auto recordDuration = finally([&] { timing["durationMs"] = (Json::UInt)(GetTickCount() - stepStartTime); });
+    fn();
+    timing["succeeded"] = true;
+}
+
+struct ConnectStepThreadParams
+{
+    function<void()> fn;
+    // Set if `fn` threw; rethrown by the connecting thread once it has joined.
+    std::exception_ptr failure;
+};
+
+static DWORD WINAPI ConnectStepThread(void* object)
+{
+    ConnectStepThreadParams* params = (ConnectStepThreadParams*)object;
+    try
+    {
+        params->fn();
+    }
+    catch (...)
+    {
+        params->failure = std::current_exception();
+    }
+    return 0;
+}
+
+
 void VPNTransport::TransportConnectHelper()
 {
     //
@@ -295,35 +339,98 @@ void VPNTransport::TransportConnectHelper()
     json["ipAddress"] = sessionInfo.GetServerAddress();
     AddDiagnosticInfoJson("ConnectingServer", json);
 
-    // Do pre-handshake
+    // Each connect step is timed; the per-step start offsets (relative to the
+    // first step) and durations are recorded as the VPNConnectSteps diagnostic.
 
-    if (!DoHandshake(
-            true,  // pre-handshake
-            sessionInfo))
-    {
-        MarkServerFailed(sessionInfo.GetServerEntry());
-        throw TransportFailed();
-    }
+    DWORD stepsStartTime = GetTickCount();
+    // Steps run on other threads are parented to this thread's span.
+    unsigned int parentSpan = ScopedSpan::Current();
+    Json::Value preHandshakeTiming, tweakVPNTiming, establishTiming;
+    auto recordStepTimings = finally([&] {
+        Json::Value stepTimings(Json::arrayValue);
+        for (const Json::Value* timing : { &preHandshakeTiming, &tweakVPNTiming, &establishTiming })
+        {
+            if (!timing->isNull())
+            {
+                stepTimings.append(*timing);
+            }
+        }
+        AddDiagnosticInfoJson("VPNConnectSteps", stepTimings);
+    });
+
+    auto runStep = [=](const char* name, Json::Value& timing, function<void()> fn) {
+        RunConnectStep(name, parentSpan, stepsStartTime, timing, fn);
+    };
 
     //
     // Check VPN services and fix if required/possible
     //
-    
+
+    // The VPN tweaks are local service and registry work that doesn't depend
+    // on the pre-handshake, so they run on their own thread while the
+    // pre-handshake is in flight. Establishing the connection requires both.
+
     // Note: we proceed even if the call fails. Testing is inconsistent -- don't
     // always need all tweaks to connect.
-    TweakVPN();
+    ConnectStepThreadParams tweakVPNParams;
+    tweakVPNParams.fn = [=, &tweakVPNTiming]() {
+        runStep("TweakVPN", tweakVPNTiming, TweakVPN);
+    };
+
+    AutoHANDLE tweakVPNThread = CreateThread(0, 0, ConnectStepThread, (void*)&tweakVPNParams, 0, 0);
+    if (!tweakVPNThread)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CreateThread failed (%d); tweaking VPN in sequence"), __TFUNCTION__, GetLastError());
+        ConnectStepThread((void*)&tweakVPNParams);
+    }
+
+    std::exception_ptr preHandshakeFailure;
+    try
+    {
+        runStep("PreHandshake", preHandshakeTiming, [&]() {
+            if (!DoHandshake(
+                    true,  // pre-handshake
+                    sessionInfo))
+            {
+                MarkServerFailed(sessionInfo.GetServerEntry());
+                throw TransportFailed();
+            }
+        });
+    }
+    catch (...)
+    {
+        preHandshakeFailure = std::current_exception();
+    }
+
+    // Always wait for the tweaks, even if the pre-handshake failed, so that
+    // they don't outlive this connect attempt. They're bounded local work.
+    if (tweakVPNThread)
+    {
+        WaitForSingleObject(tweakVPNThread, INFINITE);
+    }
+
+    if (preHandshakeFailure)
+    {
+        std::rethrow_exception(preHandshakeFailure);
+    }
+    if (tweakVPNParams.failure)
+    {
+        std::rethrow_exception(tweakVPNParams.failure);
+    }
 
     //
     // Start VPN connection
     //
 
-    if (!Establish(
-            UTF8ToWString(sessionInfo.GetServerAddress()), 
-            UTF8ToWString(sessionInfo.GetPSK())))
-    {
-        MarkServerFailed(sessionInfo.GetServerEntry());
-        throw TransportFailed();
-    }
+    runStep("Establish", establishTiming, [&]() {
+        if (!Establish(
+                UTF8ToWString(sessionInfo.GetServerAddress()), 
+                UTF8ToWString(sessionInfo.GetPSK())))
+        {
+            MarkServerFailed(sessionInfo.GetServerEntry());
+            throw TransportFailed();
+        }
+    });
 
     //
     // Monitor VPN connection and wait for CONNECTED or FAILED
@@ -331,9 +438,15 @@ void VPNTransport::TransportConnectHelper()
     
     // Also, wait no longer than VPN_CONNECTION_TIMEOUT_SECONDS... overriding any system
     // configuration built-in VPN client timeout (which we've found to be too long -- over a minute).
-    if (!WaitForConnectionStateToChangeFrom(
-            CONNECTION_STATE_STARTING, 
-            VPN_CONNECTION_TIMEOUT_SECONDS*1000))
+    ScopedSpan waitSpan("VPNTransport::WaitForConnection");
+    bool stateChanged = WaitForConnectionStateToChangeFrom(
+                            CONNECTION_STATE_STARTING, 
+                            VPN_CONNECTION_TIMEOUT_SECONDS*1000);
+    waitSpan.End();
+
+    EmitConnectTrace(!stateChanged);
+
+    if (!stateChanged)
     {
         MarkServerFailed(sessionInfo.GetServerEntry());
         throw TransportFailed();
@@ -349,7 +462,10 @@ void VPNTransport::TransportConnectHelper()
 
     // The connection is good.
     MarkServerSucceeded(sessionInfo.GetServerEntry());
-    m_sessionInfo = sessionInfo;
+    {
+        AutoMUTEX lock(m_sessionInfoMutex);
+        m_sessionInfo = sessionInfo;
+    }
 
     //
     // Patch DNS bug on Windowx XP; and flush DNS
@@ -358,6 +474,7 @@ void VPNTransport::TransportConnectHelper()
     
     // Note: we proceed even if the call fails. This means some domains
     // may not resolve properly.
+    ScopedSpan tweakDNSSpan("TweakDNS");
     TweakDNS();
 }
 
@@ -498,6 +615,7 @@ bool VPNTransport::Establish(const tstring& serverAddress, const tstring& PSK)
     vpnParams.dwCallbackId = (ULONG_PTR)this;
 
     m_rasConnection = 0;
+    ResetConnectTrace();
     SetConnectionState(CONNECTION_STATE_STARTING);
     returnCode = RasDial(0, 0, &vpnParams, 2, &(VPNTransport::RasDialCallback), &m_rasConnection);
     if (ERROR_SUCCESS != returnCode)
@@ -544,33 +662,48 @@ bool VPNTransport::DoPeriodicCheck()
 
 bool VPNTransport::WaitForConnectionStateToChangeFrom(ConnectionState state, DWORD timeout)
 {
-    DWORD totalWaitMilliseconds = 0;
+    // Block on both the RasDialCallback state change event and the stop signal,
+    // so that we wake exactly when something happens rather than polling.
 
-    while (state == GetConnectionState())
+    AutoHANDLE stopEvent = CreateEvent(NULL, TRUE, FALSE, 0);
+    if (!stopEvent)
     {
-        // Wait for RasDialCallback to set a new state, or timeout (to check cancel/termination)
+        std::stringstream s;
+        s << __FUNCTION__ << ": CreateEvent failed (" << GetLastError() << ")";
+        throw Error(s.str().c_str());
+    }
 
-        DWORD waitMilliseconds = 100;
+    m_stopInfo.stopSignal->RegisterStopEvent(stopEvent, m_stopInfo.stopReasons);
+    auto unregisterStopEvent = finally([&] { m_stopInfo.stopSignal->UnregisterStopEvent(stopEvent); });
 
-        DWORD result = WaitForSingleObject(GetStateChangeEvent(), waitMilliseconds);
+    HANDLE waitHandles[] = { GetStateChangeEvent(), stopEvent };
 
-        totalWaitMilliseconds += waitMilliseconds;
+    // Elapsed time is measured against a fixed start tick -- with unsigned
+    // arithmetic this is correct across a GetTickCount wrap -- so that spurious
+    // wakes don't shorten or lengthen the effective timeout.
+    DWORD startTime = GetTickCount();
 
-        if (result == WAIT_TIMEOUT)
+    while (state == GetConnectionState())
+    {
+        if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, false))
         {
-            if (totalWaitMilliseconds >= timeout)
-                return false;
+            throw Abort();
         }
-        else if (result == WAIT_OBJECT_0)
+
+        DWORD elapsed = GetTickCount() - startTime;
+        if (elapsed >= timeout)
         {
-            // State event set, but that doesn't mean that the state actually changed.
-            // Let the loop condition check.
-            continue;
+            return false;
         }
-        else if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, false)) // stop event signalled
+
+        DWORD result = WaitForMultipleObjects(
+                        sizeof(waitHandles)/sizeof(HANDLE), waitHandles, FALSE, timeout - elapsed);
+
+        if (result == WAIT_OBJECT_0 || result == WAIT_OBJECT_0 + 1 || result == WAIT_TIMEOUT)
         {
-            // TODO: Maybe this should let CheckSignalStop throw
-            throw Abort();
+            // State event set doesn't mean that the state actually changed, and
+            // the stop event may not be for us. Let the loop checks decide.
+            continue;
         }
         else
         {
@@ -583,6 +716,37 @@ bool VPNTransport::WaitForConnectionStateToChangeFrom(ConnectionState state, DWO
     return true;
 }
 
+void VPNTransport::ResetConnectTrace()
+{
+    AutoMUTEX lock(m_traceMutex);
+    m_traceStartTime = GetTickCount();
+    m_connectTrace = Json::Value(Json::arrayValue);
+}
+
+void VPNTransport::AddConnectTraceEntry(RASCONNSTATE rasConnState, DWORD error)
+{
+    AutoMUTEX lock(m_traceMutex);
+    Json::Value entry;
+    entry["state"] = (Json::UInt)rasConnState;
+    entry["error"] = (Json::UInt)error;
+    entry["elapsedMs"] = (Json::UInt)(GetTickCount() - m_traceStartTime);
+    m_connectTrace.append(entry);
+}
+
+void VPNTransport::EmitConnectTrace(bool timedOut)
+{
+    // Each entry is a RASCONNSTATE reported to RasDialCallback along with the
+    // time since RasDial was called, so connect latency can be broken down by
+    // phase (port open, IPSec negotiation, authentication, projection, etc.)
+
+    AutoMUTEX lock(m_traceMutex);
+    Json::Value json;
+    json["timedOut"] = timedOut;
+    json["totalMs"] = (Json::UInt)(GetTickCount() - m_traceStartTime);
+    json["states"] = m_connectTrace;
+    AddDiagnosticInfoJson("VPNConnectTrace", json);
+}
+
 tstring VPNTransport::GetPPPIPAddress() const
 {
     tstring IPAddress;
@@ -700,6 +864,8 @@ void CALLBACK VPNTransport::RasDialCallback(
     VPNTransport* vpnTransport = (VPNTransport*)userData;
 
     my_print(NOT_SENSITIVE, true, _T("RasDialCallback (%x %d)"), rasConnState, dwError);
+
+    vpnTransport->AddConnectTraceEntry(rasConnState, dwError);
     
     if (0 != dwError)
     {
@@ -832,8 +998,12 @@ void FixProhibitIpsec()
     RegCloseKey(key);
 }
 
-void FixVPNServices()
+// Returns true if every service is in (or was restored to) the required
+// configuration, or doesn't exist.
+bool FixVPNServices()
 {
+    bool success = true;
+
     // Check for disabled IPSec services and attempt to restore to
     // default (enabled, auto-start) config and start
 
@@ -1010,12 +1180,15 @@ void FixVPNServices()
         catch(std::exception& ex)
         {
             my_print(NOT_SENSITIVE, false, string("Fix VPN Services failed: ") + ex.what());
+            success = false;
         }
 
         // cleanup
         CloseServiceHandle(service); 
         CloseServiceHandle(manager);
     }
+
+    return success;
 }
 
 void TweakVPN()
@@ -1028,7 +1201,16 @@ void TweakVPN()
     // the fixes are always required.
 
     FixProhibitIpsec();
-    FixVPNServices();
+
+    // Checking the services takes several service control manager round trips
+    // (and up to a couple of seconds per service start), so once they're known
+    // to be good we skip the check on reconnects for the rest of the session.
+    // A failed fix is retried on the next connect.
+    static std::atomic<bool> vpnServicesFixed(false);
+    if (!vpnServicesFixed)
+    {
+        vpnServicesFixed = FixVPNServices();
+    }
 }
 
 //==== TweakDNS utility functions =============================================
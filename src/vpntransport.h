@@ -79,6 +79,9 @@ protected:
     tstring GetPPPIPAddress() const;
     HRASCONN GetActiveRasConnection();
     bool Establish(const tstring& serverAddress, const tstring& PSK);
+    void ResetConnectTrace();
+    void AddConnectTraceEntry(RASCONNSTATE rasConnState, DWORD error);
+    void EmitConnectTrace(bool timedOut);
     static void CALLBACK RasDialCallback(
                             DWORD userData,
                             DWORD,
@@ -94,5 +97,11 @@ private:
     HRASCONN m_rasConnection;
     unsigned int m_lastErrorCode;
     tstring m_pppIPAddress;
+
+    // State-machine trace of RasDialCallback timings for the current connect
+    // attempt. Written from the RAS callback thread; guarded by m_traceMutex.
+    HANDLE m_traceMutex;
+    DWORD m_traceStartTime;
+    Json::Value m_connectTrace;
     ServerListReorder m_serverListReorder;
 };
@@ -4050,6 +4050,12 @@
       });
     });
 
+    // Wire up the metrics snapshot display. The C code responds by calling
+    // HtmlCtrlInterface_Metrics.
+    $('#debug-Metrics a').click(function() {
+      commandAppOperation('metrics');
+    });
+
     // Wire up the UpdateDpiScaling test
     $('#debug-UpdateDpiScaling a').click(function() {
       HtmlCtrlInterface_UpdateDpiScaling({
@@ -4513,6 +4519,17 @@
     });
   }
 
+  // Show a runtime metrics snapshot (counters, gauges, histograms) in the debug pane.
+  function HtmlCtrlInterface_Metrics(jsonArgs) {
+    DEBUG_LOG('HtmlCtrlInterface_Metrics called');
+
+    // Allow object as input to assist with debugging
+    var args = _.isObject(jsonArgs) ? jsonArgs : JSON.parse(jsonArgs);
+    nextTick(function() {
+      $('#debug-Metrics-snapshot').text(JSON.stringify(args, null, 2));
+    });
+  }
+
   // Handle UI deeplinks.
   function HtmlCtrlInterface_Deeplink(jsonArgs) {
     DEBUG_LOG('HtmlCtrlInterface_Deeplink called');
@@ -4615,30 +4632,56 @@
     });
   }
 
-  // Give the C code a string table entry in the appropriate language.
+  // Locales whose string tables have already been given to the C code.
+  var g_stringTableLocalesSent = {};
+
+  // IE limits URLs to 2083 characters, and commandAppOperation base64-encodes
+  // the UTF-8 JSON argument, which grows it by a third. This leaves room for
+  // the URL prefix and the rest of the stringtableset message.
+  const STRING_TABLE_CHUNK_MAX_BYTES = 1400;
+
+  // Give the C code the string table in the appropriate language.
   // `locale` is the locale for this string table.
-  // The `stringtable` can and should be a full set of key:string mappings, but
-  // the strings will be sent to the C code one at a time, to prevent URL size
-  // overflow.
+  // The `stringtable` should be a full set of key:string mappings. It is sent
+  // to the C code in as few messages as will fit in a URL; the last one is
+  // flagged so the C code knows when the table is complete. The C code caches
+  // the table for each locale, so switching back to a locale already sent only
+  // names the locale.
   function HtmlCtrlInterface_AddStringTableItem(locale, stringtable) {
-    for (var key in stringtable) {
-      if (!stringtable.hasOwnProperty(key)) {
-        continue;
-      }
-
-      var item = {
-        locale: locale,
-        key: key,
-        string: stringtable[key]
-      };
-      sendStringTableItem(item);
+    if (g_stringTableLocalesSent[locale]) {
+      nextTick(function() {
+        commandAppOperation('stringtablelocale', { locale: locale });
+      });
+      return;
     }
 
-    function sendStringTableItem(itemObj) {
+    g_stringTableLocalesSent[locale] = true;
+
+    const chunks = [];
+    let chunk = {};
+    let chunkBytes = 0;
+    _.forOwn(stringtable, function(str, key) {
+      // The UTF-8 length of `"key":"str",`
+      const entryBytes = unescape(encodeURIComponent(JSON.stringify(key) + JSON.stringify(str))).length + 2;
+      if (chunkBytes > 0 && chunkBytes + entryBytes > STRING_TABLE_CHUNK_MAX_BYTES) {
+        chunks.push(chunk);
+        chunk = {};
+        chunkBytes = 0;
+      }
+      chunk[key] = str;
+      chunkBytes += entryBytes;
+    });
+    chunks.push(chunk);
+
+    chunks.forEach(function(strings, i) {
       nextTick(function() {
-        commandAppOperation('stringtable', itemObj);
+        commandAppOperation('stringtableset', {
+          locale: locale,
+          strings: strings,
+          last: i === chunks.length - 1
+        });
       });
-    }
+    });
   }
 
   /**
@@ -4786,6 +4829,7 @@
   window.HtmlCtrlInterface_RefreshSettings = HtmlCtrlInterface_RefreshSettings;
   window.HtmlCtrlInterface_UpdateDpiScaling = HtmlCtrlInterface_UpdateDpiScaling;
   window.HtmlCtrlInterface_Deeplink = HtmlCtrlInterface_Deeplink;
+  window.HtmlCtrlInterface_Metrics = HtmlCtrlInterface_Metrics;
   window.HtmlCtrlInterface_PsiCashMessage = HtmlCtrlInterface_PsiCashMessage;
 
   })(window);